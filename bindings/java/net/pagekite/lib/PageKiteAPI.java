@@ -87,6 +87,7 @@ public class PageKiteAPI extends Object
     public static final int PK_EV_COUNTER = (0x00000003 | PK_EV_MASK_STATS);
     public static final int PK_EV_CFG_FANCY_URL = (0x00000004 | PK_EV_MASK_MISC);
     public static final int PK_EV_TUNNEL_REQUEST = (0x00000005 | PK_EV_MASK_MISC);
+    public static final int PK_EV_BACKEND_STATE = (0x00000006 | PK_EV_MASK_STATS);
     public static final int PK_EV_RESPOND_DEFAULT = 0x00000000;
     public static final int PK_EV_RESPOND_TRUE = 0x000000ff;
     public static final int PK_EV_RESPOND_OK = 0x00000001;
@@ -94,11 +95,20 @@ public class PageKiteAPI extends Object
     public static final int PK_EV_RESPOND_FALSE = 0x0000ff00;
     public static final int PK_EV_RESPOND_ABORT = 0x00000100;
     public static final int PK_EV_RESPOND_REJECT = 0x00000200;
+    public static final int PK_BALANCE_LEAST_CONNS = 0;
+    public static final int PK_BALANCE_ROUND_ROBIN = 1;
+    public static final int PK_BREAKER_CLOSED = 0;
+    public static final int PK_BREAKER_OPEN = 1;
+    public static final int PK_BREAKER_HALF_OPEN = 2;
+    public static final int PK_FLOW_CONTROL_CLASSIC = 0;
+    public static final int PK_FLOW_CONTROL_DELAY = 1;
 
     public static native boolean init(String app_id, int max_kites, int max_frontends, int max_conns, String dyndns_url, int flags, int verbosity);
     public static native boolean initPagekitenet(String app_id, int max_kites, int max_conns, int flags, int verbosity);
     public static native boolean initWhitelabel(String app_id, int max_kites, int max_conns, int flags, int verbosity, String whitelabel_tld);
     public static native int addKite(String proto, String kitename, int pport, String secret, String backend, int lport);
+    public static native int addKiteBackend(String proto, String kitename, int pport, String backend, int lport, int weight);
+    public static native int setKiteWeight(String proto, String kitename, int pport, int weight);
     public static native int addServiceFrontends(int flags);
     public static native int addWhitelabelFrontends(int flags, String whitelabel_tld);
     public static native int lookupAndAddFrontend(String domain, int port, int update_from_dns);
@@ -113,6 +123,10 @@ public class PageKiteAPI extends Object
     public static native int enableWatchdog(int enable);
     public static native int enableTickTimer(int enable);
     public static native int setConnEvictionIdleS(int seconds);
+    public static native int setBackendPool(int min, int max, int idle_s);
+    public static native int setElasticConns(int max_conns);
+    public static native int setBackendBalancing(int policy);
+    public static native int setFlowControl(int policy, int max_window_kb);
     public static native int setOpensslCiphers(String ciphers);
     public static native int wantSpareFrontends(int spares);
     public static native int threadStart();
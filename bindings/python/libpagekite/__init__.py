@@ -85,6 +85,7 @@ PK_EV_LOGGING = (0x00000002 | PK_EV_MASK_LOGGING)
 PK_EV_COUNTER = (0x00000003 | PK_EV_MASK_STATS)
 PK_EV_CFG_FANCY_URL = (0x00000004 | PK_EV_MASK_MISC)
 PK_EV_TUNNEL_REQUEST = (0x00000005 | PK_EV_MASK_MISC)
+PK_EV_BACKEND_STATE = (0x00000006 | PK_EV_MASK_STATS)
 PK_EV_RESPOND_DEFAULT = 0x00000000
 PK_EV_RESPOND_TRUE = 0x000000ff
 PK_EV_RESPOND_OK = 0x00000001
@@ -92,6 +93,13 @@ PK_EV_RESPOND_ACCEPT = 0x00000002
 PK_EV_RESPOND_FALSE = 0x0000ff00
 PK_EV_RESPOND_ABORT = 0x00000100
 PK_EV_RESPOND_REJECT = 0x00000200
+PK_BALANCE_LEAST_CONNS = 0
+PK_BALANCE_ROUND_ROBIN = 1
+PK_BREAKER_CLOSED = 0
+PK_BREAKER_OPEN = 1
+PK_BREAKER_HALF_OPEN = 2
+PK_FLOW_CONTROL_CLASSIC = 0
+PK_FLOW_CONTROL_DELAY = 1
 
 
 def get_libpagekite_cdll():
@@ -102,6 +110,8 @@ def get_libpagekite_cdll():
             (c_void_p, "init_pagekitenet", (c_char_p, c_int, c_int, c_int, c_int,)),
             (c_void_p, "init_whitelabel", (c_char_p, c_int, c_int, c_int, c_int, c_char_p,)),
             (c_int, "add_kite", (c_void_p, c_char_p, c_char_p, c_int, c_char_p, c_char_p, c_int,)),
+            (c_int, "add_kite_backend", (c_void_p, c_char_p, c_char_p, c_int, c_char_p, c_int, c_int,)),
+            (c_int, "set_kite_weight", (c_void_p, c_char_p, c_char_p, c_int, c_int,)),
             (c_int, "add_service_frontends", (c_void_p, c_int,)),
             (c_int, "add_whitelabel_frontends", (c_void_p, c_int, c_char_p,)),
             (c_int, "lookup_and_add_frontend", (c_void_p, c_char_p, c_int, c_int,)),
@@ -116,6 +126,10 @@ def get_libpagekite_cdll():
             (c_int, "enable_watchdog", (c_void_p, c_int,)),
             (c_int, "enable_tick_timer", (c_void_p, c_int,)),
             (c_int, "set_conn_eviction_idle_s", (c_void_p, c_int,)),
+            (c_int, "set_backend_pool", (c_void_p, c_int, c_int, c_int,)),
+            (c_int, "set_elastic_conns", (c_void_p, c_int,)),
+            (c_int, "set_backend_balancing", (c_void_p, c_int,)),
+            (c_int, "set_flow_control", (c_void_p, c_int, c_int,)),
             (c_int, "set_openssl_ciphers", (c_void_p, c_char_p,)),
             (c_int, "want_spare_frontends", (c_void_p, c_int,)),
             (c_int, "thread_start", (c_void_p,)),
@@ -162,10 +176,12 @@ class PageKite(object):
         Initialize the PageKite manager.
         
         This allocates a static amount of RAM for PageKite (not
-        counting buffers managed by OpenSSL). Since libpagekite's
-        resource usage is allocated up-front, you need to specify
-        maximum numbers of kites, front-end relays and in-flight
-        connections you want to keep track of at any one time.
+        counting buffers managed by OpenSSL, or I/O buffers which
+        are borrowed from a shared pool while connections have
+        data in flight). Since most of libpagekite's resource
+        usage is allocated up-front, you need to specify maximum
+        numbers of kites, front-end relays and in-flight connections
+        you want to keep track of at any one time.
         
         The `flags` variable should be used with the constants
         `PK_WITH_*` and `PK_AS_*`, bitwise OR'ed together to tune
@@ -271,6 +287,18 @@ class PageKite(object):
         
         Note: When used with the "raw" protocol, the public port
         cannot be 0.
+        
+        The origin server may also be a Unix domain socket, by
+        setting the backend to "unix:/path/to/socket" (or "unix:@name"
+        for a Linux abstract socket). The port is then ignored.
+        
+        If the origin server is down, a circuit breaker opens
+        and incoming requests are rejected right away, with an
+        occasional request let through to probe whether it is
+        back. Changes are reported using PK_EV_BACKEND_STATE events,
+        whose integer data is the new state (PK_BREAKER_CLOSED,
+        _OPEN or _HALF_OPEN) and whose string data is "proto:kitename:pport
+        trips", trips being how often the breaker has opened.
     
         Args:
            * `const char* proto`: Protocol
@@ -286,6 +314,65 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_add_kite(self.pkm, c_char_p(proto.encode("utf-8")), c_char_p(kitename.encode("utf-8")), c_int(pport), c_char_p(secret.encode("utf-8")), c_char_p(backend.encode("utf-8")), c_int(lport))
 
+    def add_kite_backend(self, proto, kitename, pport, backend, lport, weight):
+        """
+        Add another origin server to a kite.
+        
+        New streams for the kite are spread over all its origin
+        servers, as configured by `pagekite_set_backend_balancing`.
+        Origin servers which repeatedly fail to accept connections
+        are skipped for a few seconds.
+        
+        The kite must already have been configured using `pagekite_add_kite`,
+        with the same protocol, name and public port. Each kite
+        can have up to 8 origin servers.
+        
+        This method can only be called before starting the master
+        thread.
+    
+        Args:
+           * `const char* proto`: Protocol
+           * `const char* kitename`: Kite DNS name
+           * `int pport`: Public port, 0 for default/any
+           * `const char* backend`: Hostname of the origin server
+           * `int lport`: Port of the origin server
+           * `int weight`: Relative share of new streams, normally 1
+    
+        Returns:
+            0 on success, -1 on failure.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_add_kite_backend(self.pkm, c_char_p(proto.encode("utf-8")), c_char_p(kitename.encode("utf-8")), c_int(pport), c_char_p(backend.encode("utf-8")), c_int(lport), c_int(weight))
+
+    def set_kite_weight(self, proto, kitename, pport, weight):
+        """
+        Give a kite a bigger share of busy tunnels.
+        
+        When several streams are waiting to send data over the
+        same tunnel, they take turns. Each turn a stream may send
+        up to 16 KB times its kite's weight, so a kite with weight
+        4 gets four times the bandwidth of a kite with weight
+        1 when the tunnel is congested. Small requests never wait
+        for more than one turn of each busy stream.
+        
+        The kite must already have been configured using `pagekite_add_kite`,
+        with the same protocol, name and public port. Weights
+        range from 1 (the default) to 64.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `const char* proto`: Protocol
+           * `const char* kitename`: Kite DNS name
+           * `int pport`: Public port, 0 for default/any
+           * `int weight`: Share of congested tunnels, normally 1
+    
+        Returns:
+            0 on success, -1 on failure.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_kite_weight(self.pkm, c_char_p(proto.encode("utf-8")), c_char_p(kitename.encode("utf-8")), c_int(pport), c_int(weight))
+
     def add_service_frontends(self, flags):
         """
         Configure libpagekite to use the Pagekite.net pool of
@@ -467,6 +554,11 @@ class PageKite(object):
         requests that cannot be handled (e.g. because the origin
         web server is down or things are misconfigured).
         
+        The URL can also be chosen per host, by answering PK_EV_CFG_FANCY_URL
+        events. Requests are never delayed waiting for an answer:
+        this URL is used until one arrives, and answers are cached
+        for five minutes.
+        
         This function can be called at any time.
     
         Args:
@@ -599,6 +691,117 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_set_conn_eviction_idle_s(self.pkm, c_int(seconds))
 
+    def set_backend_pool(self, min, max, idle_s):
+        """
+        Keep a pool of pre-connected backend sockets.
+        
+        To reduce the latency of new streams, libpagekite can
+        keep a few idle connections open to the local server of
+        each kite, ready to be handed out as soon as a request
+        arrives. The pool is refilled in the background, to at
+        least `min` connections or however many were used since
+        the last refill, up to `max`.
+        
+        Pooled connections which have been idle for more than
+        `idle_s` seconds are closed, as are any which the local
+        server closes.
+        
+        The pool is disabled by default (`max = 0`). Only use
+        it with local servers which do not mind idle connections,
+        such as most web servers.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int min`: Minimum number of idle connections per kite
+           * `int max`: Maximum number of idle connections per kite
+           * `int idle_s`: Close pooled connections idle this long
+    
+        Returns:
+            0 on success, -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_backend_pool(self.pkm, c_int(min), c_int(max), c_int(idle_s))
+
+    def set_elastic_conns(self, max_conns):
+        """
+        Let the connection table grow under load.
+        
+        By default the manager can track at most `max_conns` streams,
+        as given to `pagekite_init`, and when that table is full
+        the idlest stream gets evicted or new ones are refused.
+        Setting a larger limit here lets the table grow in chunks
+        of 64 connections as needed, up to `max_conns`. Chunks
+        which have been unused for a minute are released again,
+        so memory use follows the load.
+        
+        The limit can only be raised, never lowered below the
+        current size.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int max_conns`: Maximum number of concurrent streams
+    
+        Returns:
+            0 on success, -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_elastic_conns(self.pkm, c_int(max_conns))
+
+    def set_backend_balancing(self, policy):
+        """
+        Choose how to spread streams over a kite's origin servers.
+        
+        With PK_BALANCE_LEAST_CONNS (the default), each new stream
+        goes to the origin server with the fewest active streams,
+        relative to its weight. With PK_BALANCE_ROUND_ROBIN they
+        take turns, in proportion to their weights.
+        
+        This only matters for kites with more than one origin
+        server, see `pagekite_add_kite_backend`.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int policy`: PK_BALANCE_LEAST_CONNS or PK_BALANCE_ROUND_ROBIN
+    
+        Returns:
+            0 on success, -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_backend_balancing(self.pkm, c_int(policy))
+
+    def set_flow_control(self, policy, max_window_kb):
+        """
+        Choose how streams pace themselves.
+        
+        Each stream may only send so far ahead of what the remote
+        end has acknowledged. With PK_FLOW_CONTROL_CLASSIC (the
+        default) this window grows slowly and is capped at 384
+        KB, which keeps buffers small but limits a single stream
+        to about 10 Mbit/s on a 300 ms path.
+        
+        PK_FLOW_CONTROL_DELAY instead measures each stream's round-trip
+        time and grows the window quickly until it sees data queueing
+        up, so single streams can fill fast, long-distance links.
+        
+        The window never exceeds `max_window_kb`, or the policy's
+        default (384 KB or 16 MB) if that is 0.
+        
+        This function can be called at any time, but only affects
+        how windows change from then on.
+    
+        Args:
+           * `int policy`: PK_FLOW_CONTROL_CLASSIC or PK_FLOW_CONTROL_DELAY
+           * `int max_window_kb`: Largest allowed window in KB, 0 for the default
+    
+        Returns:
+            0 on success, -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_flow_control(self.pkm, c_int(policy), c_int(max_window_kb))
+
     def set_openssl_ciphers(self, ciphers):
         """
         Choose which ciphers to use in TLS
@@ -55,6 +55,10 @@ class BaseEventHandler(object):
         The event data string will contain the name of the requested HTTP
         Host. If a string is returned in the event response, it will be
         used as the base URL for fancy error pages.
+
+        Responses are cached per Host for a few minutes; requests are not
+        held up waiting for this handler, they use the default URL until
+        it has answered.
         """
         return PK_EV_RESPOND_DEFAULT
 
@@ -101,6 +101,9 @@ int main(int argc, char **argv) {
   kite_r.fsalt[0] = '\0';
   kite_rp = &kite_r;
 
+  memset(&pkc, 0, sizeof(struct pk_conn));
+  pkc.sockfd = -1;
+
   srand(time(0) ^ getpid());
   if (0 > pk_connect(&pkc, argv[1], 443, 1, &kite_r, NULL, ctx)) {
     pk_perror(argv[1]);
@@ -88,9 +88,13 @@ void usage(int ecode, char* message) {
                   "\t-r U\tSet a custom rejection URL, U.\n"
                   "\t-l D\tConnect to host D instead of localhost\n"
                   "\t-c N\tSet max connection count to N (default = 25)\n"
+                  "\t-G N\tGrow the connection table on demand, up to N\n"
                   "\t-n N\tAlways connect to N spare frontends (default = 0)\n"
                   "\t-B N\tBail out (abort) after N logged errors\n"
                   "\t-E N\tAllow eviction of streams idle for >N seconds\n"
+                  "\t-p N\tKeep N idle connections open to each local server\n"
+                  "\t-L\tUse round robin for LPORT lists (a,b,...), not load\n"
+                  "\t-D\tUse delay based flow control, for fast long links\n"
                   "\t-F x\tUse x (a DNS name) as frontend pool\n"
                   "\t-P x\tUse x (a port number) as frontend port\n"
                   "\t-R\tChoose frontends at random, instead of pinging\n"
@@ -167,6 +171,9 @@ int summarize_status(const char* fpath, const char* format, const char *status_m
 int main(int argc, char **argv) {
   unsigned int bail_on_errors = 0;
   unsigned int conn_eviction_idle_s = 0;
+  int backend_pool = 0;
+  int backend_balancing = PK_BALANCE_LEAST_CONNS;
+  int flow_control = PK_FLOW_CONTROL_CLASSIC;
   char* proto;
   char* kitename;
   char* secret;
@@ -183,6 +190,7 @@ int main(int argc, char **argv) {
   int use_watchdog = 0;
   int modify_http_headers = 1;
   int max_conns = 25;
+  int elastic_conns = 0;
   int spare_frontends = 0;
   char* fe_hostname = NULL;
   int fe_port = 443;
@@ -190,6 +198,7 @@ int main(int argc, char **argv) {
   int ac;
   int pport;
   int lport;
+  char* lports;
   int flags = (PK_WITH_SSL
               |PK_WITH_IPV4
               |PK_WITH_DYNAMIC_FE_LIST
@@ -200,7 +209,7 @@ int main(int argc, char **argv) {
 #endif
 
   while (-1 != (ac = getopt(argc, argv,
-                            "46a:B:c:CE:F:P:HIl:Nn:qr:RsSvV:Ww:Y:Z"))) {
+                            "46a:B:c:CDE:F:G:P:HIl:LNn:p:qr:RsSvV:Ww:Y:Z"))) {
     switch (ac) {
       case '4':
         flags &= ~PK_WITH_IPV4;
@@ -262,6 +271,12 @@ int main(int argc, char **argv) {
       case 'R':
         use_fake_ping = 1;
         break;
+      case 'L':
+        backend_balancing = PK_BALANCE_ROUND_ROBIN;
+        break;
+      case 'D':
+        flow_control = PK_FLOW_CONTROL_DELAY;
+        break;
       case 'S':
         ddns_url = NULL;
         break;
@@ -296,10 +311,18 @@ int main(int argc, char **argv) {
         gotargs++;
         if (1 == sscanf(optarg, "%d", &max_conns)) break;
         usage(EXIT_ERR_USAGE, "Invalid argument to -c");
+      case 'G':
+        gotargs++;
+        if (1 == sscanf(optarg, "%d", &elastic_conns)) break;
+        usage(EXIT_ERR_USAGE, "Invalid argument to -G");
       case 'E':
         gotargs++;
         if (1 == sscanf(optarg, "%u", &conn_eviction_idle_s)) break;
         usage(EXIT_ERR_USAGE, "Invalid argument to -E");
+      case 'p':
+        gotargs++;
+        if (1 == sscanf(optarg, "%d", &backend_pool)) break;
+        usage(EXIT_ERR_USAGE, "Invalid argument to -p");
       case 'n':
         gotargs++;
         if (1 == sscanf(optarg, "%d", &spare_frontends)) break;
@@ -357,6 +380,10 @@ int main(int argc, char **argv) {
   pagekite_enable_fake_ping(m, use_fake_ping);
   pagekite_set_bail_on_errors(m, bail_on_errors);
   pagekite_set_conn_eviction_idle_s(m, conn_eviction_idle_s);
+  pagekite_set_backend_pool(m, backend_pool, backend_pool, 30);
+  pagekite_set_backend_balancing(m, backend_balancing);
+  pagekite_set_flow_control(m, flow_control, 0);
+  if (elastic_conns > 0) pagekite_set_elastic_conns(m, elastic_conns);
   if (rejection_url != NULL) pagekite_set_rejection_url(m, rejection_url);
 
   /* Move the logging to the event API, mostly for testing. */
@@ -385,6 +412,19 @@ int main(int argc, char **argv) {
       pagekite_free(m);
       safe_exit(EXIT_ERR_ADD_KITE);
     }
+    /* LPORT may be a comma separated list, to spread the load */
+    for (lports = strchr(argv[ac+1], ',');
+         lports != NULL;
+         lports = strchr(lports+1, ',')) {
+      if ((1 != sscanf(lports+1, "%d", &lport)) ||
+          (0 > pagekite_add_kite_backend(m, proto, kitename, pport,
+                                         localhost, lport, 1)))
+      {
+        pagekite_perror(m, argv[0]);
+        pagekite_free(m);
+        safe_exit(EXIT_ERR_ADD_KITE);
+      }
+    }
   }
 
   /* The API could do this stuff on INIT, but since we allow for manually
@@ -113,6 +113,7 @@ WARNING: This file is processed automatically to generate the JNI and API
 #define PK_EV_COUNTER         (0x00000003 | PK_EV_MASK_STATS)
 #define PK_EV_CFG_FANCY_URL   (0x00000004 | PK_EV_MASK_MISC)
 #define PK_EV_TUNNEL_REQUEST  (0x00000005 | PK_EV_MASK_MISC)
+#define PK_EV_BACKEND_STATE   (0x00000006 | PK_EV_MASK_STATS)
 
 #define PK_EV_RESPOND_DEFAULT  0x00000000
 #define PK_EV_RESPOND_TRUE     0x000000ff
@@ -122,6 +123,19 @@ WARNING: This file is processed automatically to generate the JNI and API
 #define PK_EV_RESPOND_ABORT    0x00000100
 #define PK_EV_RESPOND_REJECT   0x00000200
 
+/* Constants: Backend load balancing policies */
+#define PK_BALANCE_LEAST_CONNS 0
+#define PK_BALANCE_ROUND_ROBIN 1
+
+/* Constants: Backend circuit breaker states (see PK_EV_BACKEND_STATE) */
+#define PK_BREAKER_CLOSED      0
+#define PK_BREAKER_OPEN        1
+#define PK_BREAKER_HALF_OPEN   2
+
+/* Constants: Stream flow control (window) policies */
+#define PK_FLOW_CONTROL_CLASSIC 0
+#define PK_FLOW_CONTROL_DELAY   1
+
 /* Constants: Pagekite.net service related constants */
 #define PAGEKITE_NET_DDNS "http://up.pagekite.net/?hostname=%s&myip=%s&sign=%s"
 #define PAGEKITE_NET_V4FRONTENDS "fe4_091c.b5p.us", 443
@@ -162,10 +176,11 @@ typedef void* pagekite_mgr;
 /* Initialization: Initialize the PageKite manager.
  *
  *    This allocates a static amount of RAM for PageKite (not counting
- *    buffers managed by OpenSSL). Since libpagekite's resource usage is
- *    allocated up-front, you need to specify maximum numbers of kites,
- *    front-end relays and in-flight connections you want to keep track
- *    of at any one time.
+ *    buffers managed by OpenSSL, or I/O buffers which are borrowed from
+ *    a shared pool while connections have data in flight). Since most of
+ *    libpagekite's resource usage is allocated up-front, you need to
+ *    specify maximum numbers of kites, front-end relays and in-flight
+ *    connections you want to keep track of at any one time.
  *
  *    The `flags` variable should be used with the constants `PK_WITH_*`
  *    and `PK_AS_*`, bitwise OR'ed together to tune the behaviour of
@@ -250,6 +265,18 @@ DECLSPEC_DLL pagekite_mgr pagekite_init_whitelabel(
  *
  *    Note: When used with the "raw" protocol, the public port cannot be 0.
  *
+ *    The origin server may also be a Unix domain socket, by setting the
+ *    backend to "unix:/path/to/socket" (or "unix:@name" for a Linux
+ *    abstract socket). The port is then ignored.
+ *
+ *    If the origin server is down, a circuit breaker opens and incoming
+ *    requests are rejected right away, with an occasional request let
+ *    through to probe whether it is back. Changes are reported using
+ *    PK_EV_BACKEND_STATE events, whose integer data is the new state
+ *    (PK_BREAKER_CLOSED, _OPEN or _HALF_OPEN) and whose string data is
+ *    "proto:kitename:pport trips", trips being how often the breaker
+ *    has opened.
+ *
  * Returns: 0 on success, -1 on failure.
  */
 DECLSPEC_DLL int pagekite_add_kite(
@@ -263,6 +290,57 @@ DECLSPEC_DLL int pagekite_add_kite(
 );
 
 
+/* Initialization: Add another origin server to a kite.
+ *
+ *    New streams for the kite are spread over all its origin servers,
+ *    as configured by `pagekite_set_backend_balancing`. Origin servers
+ *    which repeatedly fail to accept connections are skipped for a few
+ *    seconds.
+ *
+ *    The kite must already have been configured using `pagekite_add_kite`,
+ *    with the same protocol, name and public port. Each kite can have up
+ *    to 8 origin servers.
+ *
+ *    This method can only be called before starting the master thread.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+DECLSPEC_DLL int pagekite_add_kite_backend(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  const char* proto,    /* Protocol */
+  const char* kitename, /* Kite DNS name */
+  int pport,            /* Public port, 0 for default/any */
+  const char* backend,  /* Hostname of the origin server */
+  int lport,            /* Port of the origin server */
+  int weight            /* Relative share of new streams, normally 1 */
+);
+
+
+/* Initialization: Give a kite a bigger share of busy tunnels.
+ *
+ *    When several streams are waiting to send data over the same tunnel,
+ *    they take turns. Each turn a stream may send up to 16 KB times its
+ *    kite's weight, so a kite with weight 4 gets four times the bandwidth
+ *    of a kite with weight 1 when the tunnel is congested. Small requests
+ *    never wait for more than one turn of each busy stream.
+ *
+ *    The kite must already have been configured using `pagekite_add_kite`,
+ *    with the same protocol, name and public port. Weights range from
+ *    1 (the default) to 64.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+DECLSPEC_DLL int pagekite_set_kite_weight(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  const char* proto,    /* Protocol */
+  const char* kitename, /* Kite DNS name */
+  int pport,            /* Public port, 0 for default/any */
+  int weight            /* Share of congested tunnels, normally 1 */
+);
+
+
 /* Initialization: Configure libpagekite to use the Pagekite.net pool of
  *                 public front-end relay servers.
  *
@@ -409,6 +487,10 @@ DECLSPEC_DLL int pagekite_set_housekeeping_max_interval(
  *    that cannot be handled (e.g. because the origin web server is down
  *    or things are misconfigured).
  *
+ *    The URL can also be chosen per host, by answering PK_EV_CFG_FANCY_URL
+ *    events. Requests are never delayed waiting for an answer: this URL
+ *    is used until one arrives, and answers are cached for five minutes.
+ *
  *    This function can be called at any time.
  *
  * Returns: 0
@@ -521,6 +603,99 @@ DECLSPEC_DLL int pagekite_set_conn_eviction_idle_s(
 );
 
 
+/* Initialization: Keep a pool of pre-connected backend sockets.
+ *
+ *    To reduce the latency of new streams, libpagekite can keep a few
+ *    idle connections open to the local server of each kite, ready to be
+ *    handed out as soon as a request arrives. The pool is refilled in the
+ *    background, to at least `min` connections or however many were used
+ *    since the last refill, up to `max`.
+ *
+ *    Pooled connections which have been idle for more than `idle_s`
+ *    seconds are closed, as are any which the local server closes.
+ *
+ *    The pool is disabled by default (`max = 0`). Only use it with local
+ *    servers which do not mind idle connections, such as most web servers.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+DECLSPEC_DLL int pagekite_set_backend_pool(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int min,              /* Minimum number of idle connections per kite */
+  int max,              /* Maximum number of idle connections per kite */
+  int idle_s            /* Close pooled connections idle this long */
+);
+
+
+/* Initialization: Let the connection table grow under load.
+ *
+ *    By default the manager can track at most `max_conns` streams, as
+ *    given to `pagekite_init`, and when that table is full the idlest
+ *    stream gets evicted or new ones are refused. Setting a larger limit
+ *    here lets the table grow in chunks of 64 connections as needed, up
+ *    to `max_conns`. Chunks which have been unused for a minute are
+ *    released again, so memory use follows the load.
+ *
+ *    The limit can only be raised, never lowered below the current size.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+DECLSPEC_DLL int pagekite_set_elastic_conns(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int max_conns         /* Maximum number of concurrent streams */
+);
+
+
+/* Initialization: Choose how to spread streams over a kite's origin servers.
+ *
+ *    With PK_BALANCE_LEAST_CONNS (the default), each new stream goes to
+ *    the origin server with the fewest active streams, relative to its
+ *    weight. With PK_BALANCE_ROUND_ROBIN they take turns, in proportion
+ *    to their weights.
+ *
+ *    This only matters for kites with more than one origin server, see
+ *    `pagekite_add_kite_backend`.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+DECLSPEC_DLL int pagekite_set_backend_balancing(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int policy            /* PK_BALANCE_LEAST_CONNS or PK_BALANCE_ROUND_ROBIN */
+);
+
+
+/* Initialization: Choose how streams pace themselves.
+ *
+ *    Each stream may only send so far ahead of what the remote end has
+ *    acknowledged. With PK_FLOW_CONTROL_CLASSIC (the default) this window
+ *    grows slowly and is capped at 384 KB, which keeps buffers small but
+ *    limits a single stream to about 10 Mbit/s on a 300 ms path.
+ *
+ *    PK_FLOW_CONTROL_DELAY instead measures each stream's round-trip
+ *    time and grows the window quickly until it sees data queueing up,
+ *    so single streams can fill fast, long-distance links.
+ *
+ *    The window never exceeds `max_window_kb`, or the policy's default
+ *    (384 KB or 16 MB) if that is 0.
+ *
+ *    This function can be called at any time, but only affects how
+ *    windows change from then on.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+DECLSPEC_DLL int pagekite_set_flow_control(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int policy,           /* PK_FLOW_CONTROL_CLASSIC or PK_FLOW_CONTROL_DELAY */
+  int max_window_kb     /* Largest allowed window in KB, 0 for the default */
+);
+
+
 /* Initialization: Choose which ciphers to use in TLS
  *
  *    See the SSL_set_cipher_list(3) and ciphers(1) man pages for details.
@@ -143,6 +143,58 @@ jint Java_net_pagekite_lib_PageKiteAPI_addKite(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_addKiteBackend(
+  JNIEnv* env, jclass unused_class
+, jstring jproto
+, jstring jkitename
+, jint jpport
+, jstring jbackend
+, jint jlport
+, jint jweight
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  const jbyte* proto = NULL;
+  if (jproto != NULL) proto = (*env)->GetStringUTFChars(env, jproto, NULL);
+  const jbyte* kitename = NULL;
+  if (jkitename != NULL) kitename = (*env)->GetStringUTFChars(env, jkitename, NULL);
+  int pport = jpport;
+  const jbyte* backend = NULL;
+  if (jbackend != NULL) backend = (*env)->GetStringUTFChars(env, jbackend, NULL);
+  int lport = jlport;
+  int weight = jweight;
+
+  jint rv = pagekite_add_kite_backend(pagekite_manager_global, proto, kitename, pport, backend, lport, weight);
+
+  if (jproto != NULL) (*env)->ReleaseStringUTFChars(env, jproto, proto);
+  if (jkitename != NULL) (*env)->ReleaseStringUTFChars(env, jkitename, kitename);
+  if (jbackend != NULL) (*env)->ReleaseStringUTFChars(env, jbackend, backend);
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setKiteWeight(
+  JNIEnv* env, jclass unused_class
+, jstring jproto
+, jstring jkitename
+, jint jpport
+, jint jweight
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  const jbyte* proto = NULL;
+  if (jproto != NULL) proto = (*env)->GetStringUTFChars(env, jproto, NULL);
+  const jbyte* kitename = NULL;
+  if (jkitename != NULL) kitename = (*env)->GetStringUTFChars(env, jkitename, NULL);
+  int pport = jpport;
+  int weight = jweight;
+
+  jint rv = pagekite_set_kite_weight(pagekite_manager_global, proto, kitename, pport, weight);
+
+  if (jproto != NULL) (*env)->ReleaseStringUTFChars(env, jproto, proto);
+  if (jkitename != NULL) (*env)->ReleaseStringUTFChars(env, jkitename, kitename);
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_addServiceFrontends(
   JNIEnv* env, jclass unused_class
 , jint jflags
@@ -341,6 +393,64 @@ jint Java_net_pagekite_lib_PageKiteAPI_setConnEvictionIdleS(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_setBackendPool(
+  JNIEnv* env, jclass unused_class
+, jint jmin
+, jint jmax
+, jint jidle_s
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int min = jmin;
+  int max = jmax;
+  int idle_s = jidle_s;
+
+  jint rv = pagekite_set_backend_pool(pagekite_manager_global, min, max, idle_s);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setElasticConns(
+  JNIEnv* env, jclass unused_class
+, jint jmax_conns
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int max_conns = jmax_conns;
+
+  jint rv = pagekite_set_elastic_conns(pagekite_manager_global, max_conns);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setBackendBalancing(
+  JNIEnv* env, jclass unused_class
+, jint jpolicy
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int policy = jpolicy;
+
+  jint rv = pagekite_set_backend_balancing(pagekite_manager_global, policy);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setFlowControl(
+  JNIEnv* env, jclass unused_class
+, jint jpolicy
+, jint jmax_window_kb
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int policy = jpolicy;
+  int max_window_kb = jmax_window_kb;
+
+  jint rv = pagekite_set_flow_control(pagekite_manager_global, policy, max_window_kb);
+
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_setOpensslCiphers(
   JNIEnv* env, jclass unused_class
 , jstring jciphers
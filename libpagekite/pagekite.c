@@ -446,6 +446,54 @@ int pagekite_set_conn_eviction_idle_s(pagekite_mgr pkm, int seconds)
   return 0;
 }
 
+int pagekite_set_backend_pool(pagekite_mgr pkm, int min, int max, int idle_s)
+{
+  if (pkm == NULL) return -1;
+  if (max > PK_BACKEND_POOL_MAX) max = PK_BACKEND_POOL_MAX;
+  if (max < 0) max = 0;
+  if (min > max) min = max;
+  if (min < 0) min = 0;
+  PK_MANAGER(pkm)->be_pool_min = min;
+  PK_MANAGER(pkm)->be_pool_max = max;
+  PK_MANAGER(pkm)->be_pool_idle_s = idle_s;
+  return 0;
+}
+
+int pagekite_set_elastic_conns(pagekite_mgr pkm, int max_conns)
+{
+  if (pkm == NULL) return -1;
+  pkm_set_elastic_conns(PK_MANAGER(pkm), max_conns);
+  return 0;
+}
+
+int pagekite_set_backend_balancing(pagekite_mgr pkm, int policy)
+{
+  if (pkm == NULL) return -1;
+  if ((policy != PK_BALANCE_LEAST_CONNS) &&
+      (policy != PK_BALANCE_ROUND_ROBIN)) return -1;
+  PK_MANAGER(pkm)->be_balancing = policy;
+  return 0;
+}
+
+int pagekite_set_flow_control(pagekite_mgr pkm, int policy, int max_window_kb)
+{
+  if (pkm == NULL) return -1;
+  if ((policy != PK_FLOW_CONTROL_CLASSIC) &&
+      (policy != PK_FLOW_CONTROL_DELAY)) return -1;
+  if (max_window_kb <= 0) {
+    max_window_kb = (policy == PK_FLOW_CONTROL_DELAY)
+                  ? CONN_WINDOW_SIZE_KB_CEILING
+                  : CONN_WINDOW_SIZE_KB_MAXIMUM;
+  }
+  if (max_window_kb > CONN_WINDOW_SIZE_KB_CEILING)
+    max_window_kb = CONN_WINDOW_SIZE_KB_CEILING;
+  if (max_window_kb < CONN_WINDOW_SIZE_KB_MINIMUM)
+    max_window_kb = CONN_WINDOW_SIZE_KB_MINIMUM;
+  PK_MANAGER(pkm)->flow_control = policy;
+  PK_MANAGER(pkm)->flow_window_max_kb = max_window_kb;
+  return 0;
+}
+
 int pagekite_set_openssl_ciphers(pagekite_mgr pkm, const char* ciphers)
 {
   (void) pkm;
@@ -482,6 +530,31 @@ int pagekite_add_kite(pagekite_mgr pkm,
           ) ? 0 : -1;
 }
 
+int pagekite_add_kite_backend(pagekite_mgr pkm,
+  const char* proto,
+  const char* kitename,
+  int pport,
+  const char* backend,
+  int lport,
+  int weight)
+{
+  if ((pkm == NULL) || (proto == NULL) || (kitename == NULL) ||
+      (backend == NULL) || (*backend == '\0')) return -1;
+  return (0 > pkm_add_kite_backend(PK_MANAGER(pkm), proto, kitename, pport,
+                                   backend, lport, weight)) ? -1 : 0;
+}
+
+int pagekite_set_kite_weight(pagekite_mgr pkm,
+  const char* proto,
+  const char* kitename,
+  int pport,
+  int weight)
+{
+  if ((pkm == NULL) || (proto == NULL) || (kitename == NULL)) return -1;
+  return (0 > pkm_set_kite_weight(PK_MANAGER(pkm), proto, kitename, pport,
+                                  weight)) ? -1 : 0;
+}
+
 int pagekite_lookup_and_add_frontend(pagekite_mgr pkm,
   const char* domain,
   int port,
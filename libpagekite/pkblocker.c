@@ -312,6 +312,45 @@ int pkb_check_kites_dns(struct pk_manager* pkm)
   return (in_dns < 1);  /* A problem if nothing is in DNS! */
 }
 
+int pkb_check_backends(struct pk_manager* pkm)
+{
+  int i, k, count, problems = 0;
+  time_t64 now = pk_time();
+  struct pk_kite_backend* backend;
+  struct pk_pagekite* kite;
+  struct pk_pagekite** kites;
+
+  PK_TRACE_FUNCTION;
+
+  if (NULL == (kites = malloc(pkm->kite_max * sizeof(struct pk_pagekite*))))
+    return 1;
+  count = pkm_kites_to_check(pkm, kites);
+
+  /* Refresh the cached addresses of any backends which have expired,
+   * see if kites with an open circuit breaker have recovered, and
+   * maintain the pools of pre-connected sockets. */
+  for (k = 0; k < count; k++) {
+    kite = kites[k];
+    for (i = 0; i < kite->backend_count; i++) {
+      backend = kite->backends + i;
+      if ((backend->local_addr_expires <= now) &&
+          (0 > pkm_resolve_backend(pkm, backend))) problems++;
+    }
+    if (kite->breaker != PK_BREAKER_CLOSED)
+      pkm_probe_backends(pkm, kite);
+    for (i = 0; i < kite->backend_count; i++) {
+      backend = kite->backends + i;
+      if (((pkm->be_pool_max > 0) && (backend->down_until <= now)) ||
+          (backend->pool_size > 0))
+        pkm_be_pool_fill(pkm, backend);
+    }
+  }
+
+  pkm_kites_checked(pkm, kites, count);
+  free(kites);
+  return problems;
+}
+
 int pkb_check_frontend_dns(struct pk_manager* pkm)
 {
   int i, changes, have_nulls;
@@ -703,6 +742,9 @@ void pkb_check_tunnels(struct pk_manager* pkm)
   pk_log(PK_LOG_MANAGER_DEBUG,
          "Checking network & tunnels... (v%s)", PK_VERSION);
 
+  /* Backends first, so they are ready before any tunnels come up. */
+  pkb_check_backends(pkm);
+
   problems += dns_is_down = (0 != pkb_check_kites_dns(pkm));
   if (dns_is_down) {
     /* Is it completely down? We might be requesting a name that does not
@@ -778,11 +820,17 @@ void* pkb_run_blocker(void *void_pkblocker)
           pkm_reconfig_stop((struct pk_manager*) job.ptr_data);
         }
         break;
+      case PK_CHECK_BACKENDS:
+        pkb_check_backends((struct pk_manager*) job.ptr_data);
+        break;
       case PK_RELAY_INCOMING:
 #if HAVE_RELAY
         pkr_relay_incoming(job.int_data, job.ptr_data);
 #endif
         break;
+      case PK_LOOKUP_FANCY_URL:
+        pkm_lookup_fancy_url((struct pk_manager*) job.ptr_data, job.int_data);
+        break;
       case PK_QUIT:
         /* Put the job back in the queue, in case there are many workers */
         pkb_add_job(&(pkm->blocking_jobs), PK_QUIT, 0, NULL);
@@ -24,7 +24,9 @@ typedef enum {
   PK_NO_JOB,
   PK_CHECK_WORLD,
   PK_CHECK_FRONTENDS,
+  PK_CHECK_BACKENDS,
   PK_RELAY_INCOMING,
+  PK_LOOKUP_FANCY_URL,
   PK_QUIT,
 } pk_job_t;
 
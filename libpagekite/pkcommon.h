@@ -41,9 +41,15 @@ typedef long long time_t64;
 #  include <errno.h>
 #  include <sys/types.h>
 #  include <sys/socket.h>
+#  include <sys/uio.h>
+#  ifndef __MINGW32__
+#    include <sys/un.h>
+#    define HAVE_AF_UNIX 1
+#  endif
 #  include <arpa/inet.h>
 #  include <netdb.h>
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <signal.h>
 #  include <pthread.h>
 #  include <time.h>
@@ -118,6 +124,7 @@ typedef unsigned int              uint32_t;
 #  define PKS_listen(s, bl)     listen(_get_osfhandle(s), bl)
 #  define PKS_accept(s, d, l)   accept(_get_osfhandle(s), d, l)
 #  define PKS_setsockopt(f, l, o, v, s)  setsockopt(_get_osfhandle(f), l, o, v, s)
+#  define PKS_getsockopt(f, l, o, v, s)  getsockopt(_get_osfhandle(f), l, o, v, s)
 #  define PKS_EV_FD(s)          s
 #else
 #  define PKS(s)                s
@@ -127,15 +134,28 @@ typedef unsigned int              uint32_t;
 #  define PKS_read(s, d, l)     read(s, d, l)
 #  define PKS_peek(s, d, l)     recv(s, d, l, MSG_PEEK)
 #  define PKS_write(s, d, l)    write(s, d, l)
+#  define PKS_writev(s, v, c)   writev(s, v, c)
 #  define PKS_close(s)          close(s)
 #  define PKS_shutdown(s, how)  shutdown(s, how)
 #  define PKS_bind(s, d, l)     bind(s, d, l)
 #  define PKS_listen(s, bl)     listen(s, bl)
 #  define PKS_accept(s, d, l)   accept(s, d, l)
 #  define PKS_setsockopt(f, l, o, v, s) setsockopt(f, l, o, v, s)
+#  define PKS_getsockopt(f, l, o, v, s) getsockopt(f, l, o, v, s)
 #  define PKS_EV_FD(s)          s
 #endif
 
+#if defined(_MSC_VER) || defined(__MINGW32__)
+/* No writev() on Windows; writing just the first vector is a legal (if
+ * short) gathered write, callers queue whatever is left over. */
+struct iovec {
+  void*  iov_base;
+  size_t iov_len;
+};
+#  undef PKS_writev
+#  define PKS_writev(s, v, c)   PKS_write(s, (v)[0].iov_base, (v)[0].iov_len)
+#endif
+
 #if defined(HAVE_OPENSSL) && (HAVE_OPENSSL != 0)
 #  include <openssl/ssl.h>
 #  include <openssl/bio.h>
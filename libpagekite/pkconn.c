@@ -33,7 +33,227 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pklogging.h"
 
 #include <ctype.h>
+#if PK_TESTS
+#include <assert.h>
+#endif
+
+
+/*** Buffer pool *************************************************************/
+
+struct pkc_buffer {
+  struct pkc_buffer* next;   /* Idle list or output queue link */
+  int                cls;
+  int                start;  /* Output queue: first unsent byte */
+  int                end;    /* Output queue: end of queued data */
+  int                mark;   /* Output queue: last frame boundary, or -1 */
+  /* Data follows */
+};
+#define PKC_BUFFER_DATA(b) (((char*) (b)) + sizeof(struct pkc_buffer))
+#define PKC_BUFFER_HEAD(d) ((struct pkc_buffer*) ((d) - sizeof(struct pkc_buffer)))
+
+static const int pkc_buffer_sizes[PKC_BUFFER_CLASSES] = PKC_BUFFER_CLASS_SIZES;
+static struct pkc_buffer* pkc_buffers_idle[PKC_BUFFER_CLASSES];
+static int pkc_buffers_idle_count[PKC_BUFFER_CLASSES];
+static pthread_mutex_t pkc_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Borrow a buffer with room for at least `bytes`, reporting the actual
+ * capacity in `size`. Returns NULL if too large or out of memory. */
+char* pkc_buffer_get(int bytes, int* size)
+{
+  int cls;
+  struct pkc_buffer* buf;
+
+  for (cls = 0; cls < PKC_BUFFER_CLASSES; cls++)
+    if (bytes <= pkc_buffer_sizes[cls]) break;
+  if (cls >= PKC_BUFFER_CLASSES) return NULL;
+
+  pthread_mutex_lock(&pkc_buffers_lock);
+  if (NULL != (buf = pkc_buffers_idle[cls])) {
+    pkc_buffers_idle[cls] = buf->next;
+    pkc_buffers_idle_count[cls] -= 1;
+    pk_state.buffers_idle -= 1;
+    pk_state.buffer_bytes_idle -= pkc_buffer_sizes[cls];
+  }
+  else {
+    /* Allocating while locked keeps the stats honest; this is rare. */
+    buf = malloc(sizeof(struct pkc_buffer) + pkc_buffer_sizes[cls]);
+  }
+  if (buf != NULL) {
+    buf->cls = cls;
+    pk_state.buffers_in_use += 1;
+    pk_state.buffer_bytes_in_use += pkc_buffer_sizes[cls];
+  }
+  pthread_mutex_unlock(&pkc_buffers_lock);
+
+  if (buf == NULL) return NULL;
+  if (size != NULL) *size = pkc_buffer_sizes[cls];
+  return PKC_BUFFER_DATA(buf);
+}
 
+void pkc_buffer_put(char* data)
+{
+  int cls;
+  struct pkc_buffer* buf;
+  if (data == NULL) return;
+
+  buf = PKC_BUFFER_HEAD(data);
+  cls = buf->cls;
+
+  pthread_mutex_lock(&pkc_buffers_lock);
+  pk_state.buffers_in_use -= 1;
+  pk_state.buffer_bytes_in_use -= pkc_buffer_sizes[cls];
+  if (pkc_buffers_idle_count[cls] < PKC_BUFFER_IDLE_MAX) {
+    buf->next = pkc_buffers_idle[cls];
+    pkc_buffers_idle[cls] = buf;
+    pkc_buffers_idle_count[cls] += 1;
+    pk_state.buffers_idle += 1;
+    pk_state.buffer_bytes_idle += pkc_buffer_sizes[cls];
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pkc_buffers_lock);
+
+  if (buf != NULL) free(buf);
+}
+
+/* Return the input buffer to the pool, if it is empty. */
+void pkc_release_buffers(struct pk_conn* pkc)
+{
+  if ((pkc->in_buffer != NULL) && (pkc->in_buffer_pos == 0)) {
+    pkc_buffer_put(pkc->in_buffer);
+    pkc->in_buffer = NULL;
+  }
+}
+
+
+/*** Output queue ************************************************************/
+
+/* There are two queues (lanes): data, and control frames such as pings
+ * and progress reports. Each write to the data lane is one frame, and each
+ * segment remembers where the last frame that ended in it ends, so queued
+ * control frames can cut in at that boundary instead of waiting for all
+ * the data ahead of them. A segment which starts on a frame boundary has
+ * its mark at 0 until a frame ends in it. */
+#define PKC_AT_FRAME(seg) (((seg) == NULL) || ((seg)->start == (seg)->mark))
+
+/* Append data to a lane, topping up the last segment first. If the lane
+ * is empty, midframe says whether the data continues a frame which has
+ * already been partially sent. */
+static int pkc_queue_append(struct pk_conn* pkc,
+                            struct pkc_buffer** head, struct pkc_buffer** tail,
+                            char* data, ssize_t length, int midframe)
+{
+  int room, size;
+  char* segdata;
+  struct pkc_buffer* seg;
+
+  while (length > 0) {
+    seg = *tail;
+    if ((seg == NULL) ||
+        (0 >= (room = pkc_buffer_sizes[seg->cls] - seg->end))) {
+      segdata = pkc_buffer_get(min(length, CONN_IO_BUFFER_SIZE), &size);
+      if (segdata == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+      seg = PKC_BUFFER_HEAD(segdata);
+      seg->next = NULL;
+      seg->start = seg->end = 0;
+      if (*tail != NULL)
+        seg->mark = ((*tail)->mark == (*tail)->end) ? 0 : -1;
+      else
+        seg->mark = midframe ? -1 : 0;
+      if (*tail != NULL) (*tail)->next = seg;
+      else *head = seg;
+      *tail = seg;
+      room = size;
+    }
+    if (room > length) room = length;
+    memcpy(PKC_BUFFER_DATA(seg) + seg->end, data, room);
+    seg->end += room;
+    data += room;
+    length -= room;
+    pkc->out_buffer_pos += room;
+    if (head == &(pkc->ctl_head)) pkc->ctl_buffer_pos += room;
+  }
+  return 0;
+}
+
+static int pkc_queue_output(struct pk_conn* pkc, char* data, ssize_t length,
+                            int midframe)
+{
+  return pkc_queue_append(pkc, &(pkc->out_head), &(pkc->out_tail),
+                          data, length, midframe);
+}
+
+/* Whatever was queued last completes a frame. */
+static void pkc_queue_frame_end(struct pk_conn* pkc)
+{
+  if (pkc->out_tail != NULL) pkc->out_tail->mark = pkc->out_tail->end;
+}
+
+/* Mark bytes as sent, returning drained segments to the pool. */
+static void pkc_dequeue(struct pk_conn* pkc,
+                        struct pkc_buffer** head, struct pkc_buffer** tail,
+                        ssize_t bytes)
+{
+  struct pkc_buffer* seg;
+
+  pkc->out_buffer_pos -= bytes;
+  while ((NULL != (seg = *head)) && (bytes > 0)) {
+    if (bytes < seg->end - seg->start) {
+      seg->start += bytes;
+      return;
+    }
+    bytes -= (seg->end - seg->start);
+    if (NULL == (*head = seg->next)) *tail = NULL;
+    pkc_buffer_put(PKC_BUFFER_DATA(seg));
+  }
+}
+
+static void pkc_dequeue_output(struct pk_conn* pkc, ssize_t bytes)
+{
+  pkc_dequeue(pkc, &(pkc->out_head), &(pkc->out_tail), bytes);
+  if (pkc->out_head == NULL) pkc->status &= ~CONN_STATUS_SKB_QUEUED;
+}
+
+static void pkc_dequeue_control(struct pk_conn* pkc, ssize_t bytes)
+{
+  time_t64 waited;
+
+  pkc->ctl_buffer_pos -= bytes;
+  pkc_dequeue(pkc, &(pkc->ctl_head), &(pkc->ctl_tail), bytes);
+  if (pkc->ctl_head == NULL) {
+    pkc->status &= ~CONN_STATUS_CTL_WRITE;
+    waited = pk_time_ms() - pkc->ctl_queued_ms;
+    pk_state.ctl_queue_drains += 1;
+    pk_state.ctl_queue_ms_total += waited;
+    if (waited > pk_state.ctl_queue_ms_max)
+      pk_state.ctl_queue_ms_max = waited;
+  }
+}
+
+/* Throw away anything still waiting to be sent. */
+void pkc_discard_output(struct pk_conn* pkc)
+{
+  struct pkc_buffer* seg;
+  while (NULL != (seg = pkc->out_head)) {
+    pkc->out_head = seg->next;
+    pkc_buffer_put(PKC_BUFFER_DATA(seg));
+  }
+  while (NULL != (seg = pkc->ctl_head)) {
+    pkc->ctl_head = seg->next;
+    pkc_buffer_put(PKC_BUFFER_DATA(seg));
+  }
+  pkc->out_tail = pkc->ctl_tail = NULL;
+  pkc->out_buffer_pos = pkc->ctl_buffer_pos = 0;
+  pkc->status &= ~(CONN_STATUS_CTL_WRITE|CONN_STATUS_SKB_QUEUED);
+#ifdef HAVE_OPENSSL
+  pkc->want_write = 0;
+#endif
+}
+
+
+/*** Connections *************************************************************/
 
 void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
 {
@@ -47,9 +267,10 @@ void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
   pkc->status &= ~CONN_STATUS_BITS;
   pkc->status |= status;
   pkc->activity = pk_time();
-  pkc->out_buffer_pos = 0;
+  pkc_discard_output(pkc);
   pkc->in_buffer_pos = 0;
   pkc->send_window_kb = CONN_WINDOW_SIZE_KB_INITIAL;
+  memset(&(pkc->window), 0, sizeof(struct pkc_window));
   pkc->read_bytes = 0;
   pkc->read_kb = 0;
   pkc->sent_kb = 0;
@@ -63,6 +284,7 @@ void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
   pkc->ssl = NULL;
   pkc->want_write = 0;
 #endif
+  pkc_release_buffers(pkc);
 }
 
 
@@ -259,6 +481,25 @@ int pkc_wait(struct pk_conn* pkc, int timeout_ms)
 }
 
 ssize_t pkc_read(struct pk_conn* pkc)
+{
+  ssize_t bytes;
+
+  if ((pkc->in_buffer == NULL) &&
+      (NULL == (pkc->in_buffer = pkc_buffer_get(CONN_IO_BUFFER_SIZE, NULL)))) {
+    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+           "%d: pkc_read() failed to allocate a buffer", pkc->sockfd);
+    pkc->status |= CONN_STATUS_BROKEN;
+    errno = ENOMEM;
+    return -1;
+  }
+
+  bytes = pkc_read_into(pkc, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
+  if (bytes > 0) pkc->in_buffer_pos += bytes;
+  return bytes;
+}
+
+/* Read into a caller-supplied buffer, e.g. straight into a parser. */
+ssize_t pkc_read_into(struct pk_conn* pkc, char* buffer, ssize_t length)
 {
   char *errfmt;
   ssize_t bytes, delta;
@@ -268,7 +509,7 @@ ssize_t pkc_read(struct pk_conn* pkc)
 #ifdef HAVE_OPENSSL
     case CONN_SSL_DATA:
       pkc_reset_error_state();
-      bytes = SSL_read(pkc->ssl, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
+      bytes = SSL_read(pkc->ssl, buffer, length);
       if (bytes < 0) ssl_errno = SSL_get_error(pkc->ssl, bytes);
       break;
     case CONN_SSL_HANDSHAKE:
@@ -279,15 +520,14 @@ ssize_t pkc_read(struct pk_conn* pkc)
       bytes = 0;
 #endif
     default:
-      bytes = PKS_read(pkc->sockfd, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
+      bytes = PKS_read(pkc->sockfd, buffer, length);
   }
 
   if (bytes > 0) {
     if (pk_state.log_mask & PK_LOG_TRACE) {
-      pk_log_raw_data(PK_LOG_TRACE, "R", pkc->sockfd, PKC_IN(*pkc), bytes);
+      pk_log_raw_data(PK_LOG_TRACE, "R", pkc->sockfd, buffer, bytes);
     }
 
-    pkc->in_buffer_pos += bytes;
     pkc->activity = pk_time(0);
 
     /* Update KB counter and window... this is a bit messy. */
@@ -296,6 +536,10 @@ ssize_t pkc_read(struct pk_conn* pkc)
       pkc->read_kb += 1;
       pkc->read_bytes -= 1024;
     }
+
+    /* Time a round trip, for the window controllers. */
+    if (!pkc->window.probe_ms && (pkc->read_kb > pkc->sent_kb))
+      pkc_window_probe(pkc, pk_time_ms());
   }
   else if (bytes == 0) {
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA, "pkc_read() hit EOF");
@@ -399,25 +643,97 @@ ssize_t pkc_raw_write(struct pk_conn* pkc, char* data, ssize_t length) {
   return wrote;
 }
 
-void pkc_report_progress(struct pk_conn* pkc, char *sid, struct pk_conn* feconn)
+/* How many KB to deliver between reports. The far end's window is not
+ * visible to us, but our own window for the stream sees the same tunnel,
+ * so it stands in: fast streams report less often, slow ones still get
+ * several reports per window. */
+int pkc_report_increment(struct pk_conn* pkc)
+{
+  int increment = pkc->send_window_kb / 8;
+  if (increment < CONN_REPORT_INCREMENT) return CONN_REPORT_INCREMENT;
+  if (increment > CONN_REPORT_INCREMENT_MAX) return CONN_REPORT_INCREMENT_MAX;
+  return increment;
+}
+
+/* Account for delivered data, returning the new total in KB, or -1 if
+ * there is not a whole KB to report. */
+ssize_t pkc_take_progress(struct pk_conn* pkc)
+{
+  if (pkc->wrote_bytes < 1024) return -1;
+  pkc->reported_kb += (pkc->wrote_bytes/1024);
+  pkc->wrote_bytes %= 1024;
+  return pkc->reported_kb;
+}
+
+/* Tell the far end how much has been delivered, once a full increment
+ * has been written (or any whole KB, if flushing). Returns 1 if something
+ * is left unreported, the caller should flush it later. */
+int pkc_report_progress(struct pk_conn* pkc, char *sid, struct pk_conn* feconn,
+                        int flush)
 {
   char buffer[256];
   int bytes;
-  if (pkc->wrote_bytes >= CONN_REPORT_INCREMENT*1024) {
-    pkc->reported_kb += (pkc->wrote_bytes/1024);
-    pkc->wrote_bytes %= 1024;
-    bytes = pk_format_skb(buffer, sid, pkc->reported_kb);
+  ssize_t kb;
+
+  if (!flush &&
+      (pkc->wrote_bytes < (size_t) pkc_report_increment(pkc) * 1024))
+    return (pkc->wrote_bytes >= 1024);
+  if (0 > (kb = pkc_take_progress(pkc)))
+    return 0;
+
+  /* An SKB which rode along on a queued data frame must not be overtaken
+   * by a newer one, so while there is one, reports queue behind it. */
+  bytes = pk_format_skb(buffer, sid, kb);
+  if (feconn->status & CONN_STATUS_SKB_QUEUED)
     pkc_write(feconn, buffer, bytes);
-    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
-           "%d: sid=%s, wrote_bytes=%d, reported_kb=%d",
-           pkc->sockfd, sid, pkc->wrote_bytes, pkc->reported_kb);
+  else
+    pkc_write_control(feconn, buffer, bytes);
+  pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
+         "%d: sid=%s, wrote_bytes=%d, reported_kb=%d",
+         pkc->sockfd, sid, pkc->wrote_bytes, pkc->reported_kb);
+  return 0;
+}
+
+/* Pick the segment to write next. Control frames go first if the data
+ * lane is at a frame boundary, otherwise data is only written up to its
+ * next boundary. An SSL write being retried must be retried as is. */
+static struct pkc_buffer* pkc_next_output(struct pk_conn* pkc,
+                                          ssize_t* length)
+{
+  struct pkc_buffer* seg = pkc->out_head;
+  int control;
+
+#ifdef HAVE_OPENSSL
+  if (pkc->want_write > 0)
+    control = (pkc->status & CONN_STATUS_CTL_WRITE) && (pkc->ctl_head != NULL);
+  else
+#endif
+  control = (pkc->ctl_head != NULL) && PKC_AT_FRAME(seg);
+
+  if (control) {
+    pkc->status |= CONN_STATUS_CTL_WRITE;
+    seg = pkc->ctl_head;
+    *length = seg->end - seg->start;
+    return seg;
+  }
+  pkc->status &= ~CONN_STATUS_CTL_WRITE;
+  if (seg == NULL) {
+    *length = 0;
   }
+  else if ((pkc->ctl_head != NULL) && (seg->mark > seg->start)) {
+    *length = seg->mark - seg->start;
+  }
+  else {
+    *length = seg->end - seg->start;
+  }
+  return seg;
 }
 
 ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
                   char* where)
 {
-  ssize_t flushed, wrote, bytes;
+  ssize_t flushed, wrote, bytes, seglen;
+  struct pkc_buffer* seg;
   flushed = wrote = errno = bytes = 0;
   int loops_left = 1000;
 
@@ -427,6 +743,10 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
     return -1;
   }
 
+  /* Nothing can be written until the connection is established. */
+  if (pkc->status & CONN_STATUS_CONNECTING)
+    return 0;
+
   if (mode == BLOCKING_FLUSH) {
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
            "%d[%s]: Attempting blocking flush", pkc->sockfd, where);
@@ -435,26 +755,28 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
              "%d[%s]: Failed to set socket blocking", pkc->sockfd, where);
   }
 
-  /* First, flush whatever was in the conn buffers */
+  /* First, flush whatever is in the output queue, one segment at a time */
   do {
     PK_TRACE_LOOP("flushing");
-    wrote = pkc_raw_write(pkc, pkc->out_buffer, pkc->out_buffer_pos);
+    seg = pkc_next_output(pkc, &seglen);
+    wrote = pkc_raw_write(pkc,
+                          (seg != NULL) ? PKC_BUFFER_DATA(seg) + seg->start
+                                        : NULL,
+                          seglen);
     if (wrote > 0) {
-      if (pkc->out_buffer_pos > wrote) {
-        memmove(pkc->out_buffer,
-                pkc->out_buffer + wrote,
-                pkc->out_buffer_pos - wrote);
-      }
-      pkc->out_buffer_pos -= wrote;
+      if (pkc->status & CONN_STATUS_CTL_WRITE)
+        pkc_dequeue_control(pkc, wrote);
+      else
+        pkc_dequeue_output(pkc, wrote);
       flushed += wrote;
     }
     else if ((errno != EINTR) && (errno != 0))
       break;
-  } while ((mode == BLOCKING_FLUSH) &&
-           (pkc->out_buffer_pos > 0) &&
+  } while ((pkc->out_buffer_pos > 0) &&
+           ((mode == BLOCKING_FLUSH) || (wrote == seglen)) &&
            (loops_left-- > 0));
 
-  if (loops_left <= 0) {
+  if ((mode == BLOCKING_FLUSH) && (loops_left <= 0)) {
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
            "%d[%s]: BUG! Flush failed after 1000 iterations",
            pkc->sockfd, where);
@@ -512,43 +834,588 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
   return flushed;
 }
 
+/* Should this write just be queued, for a corked conn's next flush? */
+static int pkc_corked(struct pk_conn* pkc, ssize_t length)
+{
+  return ((pkc->status & CONN_STATUS_CORKED) &&
+          (pkc->out_buffer_pos + length <= CONN_CORK_BYTES));
+}
+
 ssize_t pkc_write(struct pk_conn* pkc, char* data, ssize_t length)
 {
-  ssize_t wleft;
   ssize_t wrote = 0;
 
-  /* 1. Try to flush already buffered data. */
+  /* 0. Corked conns only queue small writes, they are flushed later. */
+  if (pkc_corked(pkc, length)) {
+    if (0 > pkc_queue_output(pkc, data, length, 0)) return -1;
+    pkc_queue_frame_end(pkc);
+    return length;
+  }
+
+  /* 1. Try to flush already queued data. */
   if (pkc->out_buffer_pos)
-    pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_write/1");
+    pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_write");
 
-  /* 2. If successful, try to write new data (0 copies!) */
-  if (0 == pkc->out_buffer_pos) {
+  /* 2. If successful, try to write new data (0 copies!). We never try
+   *    more than one segment's worth, so if SSL wants us to retry, the
+   *    same bytes will be at the head of the queue. Conns which are still
+   *    connecting just queue everything. */
+  if ((0 == pkc->out_buffer_pos) &&
+      !(pkc->status & CONN_STATUS_CONNECTING)) {
+    pkc->status &= ~CONN_STATUS_CTL_WRITE;  /* Retries come from out_head */
     errno = 0;
     do {
       PK_TRACE_LOOP("writing");
-      wrote = pkc_raw_write(pkc, data, length);
+      wrote = pkc_raw_write(pkc, data, min(length, CONN_IO_BUFFER_SIZE));
     } while ((wrote < 0) && ((errno == EINTR) || (errno == 0)));
   }
 
+  /* 3. Queue whatever is left, the writable watcher will drain it. This
+   *    never blocks; callers use the queue depth for back-pressure. */
   if (wrote < length) {
     if (wrote < 0) /* Ignore errors, for now */
       wrote = 0;
+    if (0 > pkc_queue_output(pkc, data+wrote, length-wrote, (wrote > 0))) {
+      pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+             "%d[pkc_write]: Failed to queue %d bytes",
+             pkc->sockfd, length-wrote);
+      return -1;
+    }
+    pkc_queue_frame_end(pkc);
+  }
+
+  return length;
+}
+
+/* Control frames are small and time sensitive. If data is queued, they
+ * wait in their own lane and go out at the next frame boundary, instead
+ * of behind everything else. They must not depend on the order of the
+ * data frames around them, so this is not for EOFs. */
+ssize_t pkc_write_control(struct pk_conn* pkc, char* data, ssize_t length)
+{
+  if (0 == pkc->out_buffer_pos)
+    return pkc_write(pkc, data, length);
 
-    wleft = length-wrote;
-    if (wleft <= PKC_OUT_FREE(*pkc)) {
-      /* 2a. Have data left, there is space in our buffer: buffer it! */
-      memcpy(PKC_OUT(*pkc), data+wrote, wleft);
-      pkc->out_buffer_pos += wleft;
+  if (pkc->ctl_head == NULL) pkc->ctl_queued_ms = pk_time_ms();
+  if (0 > pkc_queue_append(pkc, &(pkc->ctl_head), &(pkc->ctl_tail),
+                           data, length, 0)) {
+    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+           "%d[pkc_write_control]: Failed to queue %d bytes",
+           pkc->sockfd, length);
+    return -1;
+  }
+  pk_state.ctl_frames_queued += 1;
+
+  if ((pkc->sockfd >= 0) && !pkc_corked(pkc, 0))
+    pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_write_control");
+  return length;
+}
+
+
+ssize_t pkc_writev(struct pk_conn* pkc, struct iovec* iov, int iovcnt)
+{
+  struct iovec vec[PKC_WRITEV_MAX];
+  struct pkc_buffer* seg;
+  ssize_t length, queued, wrote, bytes;
+  int i, n;
+
+  for (length = i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+
+  if (pkc_corked(pkc, length)) {
+    for (i = 0; i < iovcnt; i++) {
+      if (0 > pkc_queue_output(pkc, iov[i].iov_base, iov[i].iov_len, 0))
+        return -1;
     }
-    else {
-      /* 2b. If new+old data > buffer size, do a blocking write. */
-      if (0 > pkc_flush(pkc, data+wrote, length-wrote, BLOCKING_FLUSH,
-                        "pkc_write/2")) {
-        /* Give up and return an error. We are broken. */
+    pkc_queue_frame_end(pkc);
+    return length;
+  }
+
+  /* Encrypted conns: coalesce everything in the queue, so the frame goes
+   * out as a single SSL record instead of one per vector. Control frames
+   * waiting to cut in are also left to pkc_flush. */
+  if ((pkc->state != CONN_CLEAR_DATA) || (iovcnt > PKC_WRITEV_MAX/2) ||
+      (pkc->status & CONN_STATUS_CONNECTING) || (pkc->ctl_head != NULL)) {
+    for (i = 0; i < iovcnt; i++) {
+      if (0 > pkc_queue_output(pkc, iov[i].iov_base, iov[i].iov_len, 0))
         return -1;
+    }
+    pkc_queue_frame_end(pkc);
+    if (pkc->sockfd >= 0)
+      pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_writev");
+    return length;
+  }
+
+  /* Cleartext: gather whatever is already queued and the new data into a
+   * single writev(). If the queue is too long to fit, only the queue is
+   * written this time around, to preserve ordering. */
+  n = queued = 0;
+  for (seg = pkc->out_head;
+       (seg != NULL) && (n < PKC_WRITEV_MAX - iovcnt);
+       seg = seg->next) {
+    vec[n].iov_base = PKC_BUFFER_DATA(seg) + seg->start;
+    vec[n++].iov_len = seg->end - seg->start;
+    queued += seg->end - seg->start;
+  }
+  if (seg == NULL) {
+    for (i = 0; i < iovcnt; i++) vec[n++] = iov[i];
+  }
+
+  pkc->status &= ~CONN_STATUS_CTL_WRITE;
+  errno = 0;
+  do {
+    PK_TRACE_LOOP("writing");
+    wrote = PKS_writev(pkc->sockfd, vec, n);
+  } while ((wrote < 0) && (errno == EINTR));
+
+  if (wrote > 0) {
+    pkc->wrote_bytes += wrote;
+    if (pk_state.log_mask & PK_LOG_TRACE) {
+      for (bytes = wrote, i = 0; (i < n) && (bytes > 0); i++) {
+        pk_log_raw_data(PK_LOG_TRACE, "W", pkc->sockfd, vec[i].iov_base,
+                        min(bytes, (ssize_t) vec[i].iov_len));
+        bytes -= vec[i].iov_len;
       }
     }
+    bytes = min(wrote, queued);
+    pkc_dequeue_output(pkc, bytes);
+    wrote -= bytes;
+  }
+  else {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != 0)) {
+      pkc->status |= CONN_STATUS_CLS_WRITE;
+      pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
+             "%d[pkc_writev]: errno=%d, closing", pkc->sockfd, errno);
+    }
+    wrote = 0;
+  }
+
+  /* Queue whatever is left of the new data. */
+  for (bytes = wrote, i = 0; i < iovcnt; i++) {
+    if (wrote >= (ssize_t) iov[i].iov_len) {
+      wrote -= iov[i].iov_len;
+    }
+    else {
+      if (0 > pkc_queue_output(pkc, (char*) iov[i].iov_base + wrote,
+                                    iov[i].iov_len - wrote, (bytes > 0)))
+        return -1;
+      wrote = 0;
+    }
   }
+  pkc_queue_frame_end(pkc);
 
   return length;
 }
+
+/*** Stream windows **********************************************************/
+
+/* A window controller decides how far a stream may read ahead of what the
+ * far end has acknowledged (send_window_kb). It is told about SKB acks,
+ * SPD throttling and the tunnel blocking, and should stay within max_kb;
+ * the caller enforces the bounds regardless. */
+typedef void (pkc_window_controller)(struct pk_conn*, int, flow_op, size_t,
+                                     time_t64);
+
+static void pkc_window_classic(struct pk_conn* pkc, int max_kb, flow_op op,
+                               size_t kb, time_t64 now_ms)
+{
+  int window_kb;
+  (void) max_kb;
+  (void) now_ms;
+
+  switch (op) {
+    case CONN_REMOTE_THROTTLE:
+      /* Integer-safe way to reduce by about 20% */
+      pkc->send_window_kb -= (1 + pkc->send_window_kb / 5);
+      break;
+    case CONN_TUNNEL_BLOCKED:
+      /* Oops, writing too fast! Reduce window size by about a third */
+      pkc->send_window_kb -= (1 + pkc->send_window_kb / 3);
+      break;
+    case CONN_REMOTE_ACKED:
+      pkc->sent_kb = kb;
+      if (pkc->send_window_kb == CONN_WINDOW_SIZE_KB_INITIAL) {
+        window_kb = pkc->read_kb - pkc->sent_kb;
+        pkc->send_window_kb = window_kb + (window_kb / 8);
+      }
+      else {
+        /* Ramp up our sending speed by default. Push-back from the
+         * tunnel blocking will lower this if it gets too high. */
+        pkc->send_window_kb += 1;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static void pkc_window_delay(struct pk_conn* pkc, int max_kb, flow_op op,
+                             size_t kb, time_t64 now_ms)
+{
+  /* Delay based, like TCP Vegas: compare each RTT sample to the lowest
+   * one seen to estimate how much of our window is sitting in queues
+   * (ours, the tunnel's or the network's), and steer that towards
+   * CONN_WINDOW_QUEUE_KB_TARGET. Until the first sign of queueing the
+   * window doubles every round trip. A blocked tunnel shows up as delay,
+   * so it needs no special treatment.
+   *
+   * Our own queue would hide the true minimum RTT, so when that goes
+   * stale the window is briefly cut to the floor to measure it again. */
+  struct pkc_window* w = &(pkc->window);
+  int window_kb, queued_kb, target_kb, used;
+  (void) max_kb;
+
+  if (op == CONN_REMOTE_THROTTLE) {
+    pkc->send_window_kb -= (1 + pkc->send_window_kb / 5);
+    w->ramped = 1;
+    return;
+  }
+  if (op != CONN_REMOTE_ACKED) return;
+
+  used = (2 * (pkc->read_kb - pkc->sent_kb) >= pkc->send_window_kb);
+  pkc->sent_kb = kb;
+  if ((w->probe_ms == 0) || (kb < w->probe_kb)) return;
+
+  w->rtt_ms = (int) (now_ms - w->probe_ms);
+  if (w->rtt_ms < 1) w->rtt_ms = 1;
+  w->probe_ms = 0;
+  if ((w->rtt_min_ms == 0) || (w->rtt_ms <= w->rtt_min_ms) ||
+      (w->saved_kb > 0)) {
+    w->rtt_min_ms = w->rtt_ms;
+    w->rtt_min_at = now_ms;
+    if (w->saved_kb > 0) {
+      pkc->send_window_kb = w->saved_kb;
+      w->saved_kb = 0;
+      return;
+    }
+  }
+  else if (w->rtt_min_at + CONN_WINDOW_RTT_TTL_MS < now_ms) {
+    w->saved_kb = pkc->send_window_kb;
+    pkc->send_window_kb = 2 * CONN_REPORT_INCREMENT;
+    return;
+  }
+
+  window_kb = pkc->send_window_kb;
+  queued_kb = (int) (((time_t64) window_kb * (w->rtt_ms - w->rtt_min_ms))
+                     / w->rtt_ms);
+
+  target_kb = CONN_WINDOW_QUEUE_KB_TARGET + (window_kb / 8);
+  if (queued_kb < target_kb / 2) {
+    /* Only grow if we were actually using the window. */
+    if (used) window_kb += (w->ramped ? (window_kb / 4) : window_kb);
+  }
+  else {
+    w->ramped = 1;
+    window_kb += (target_kb - queued_kb) / 2;
+  }
+  if (window_kb < 2 * CONN_REPORT_INCREMENT)
+    window_kb = 2 * CONN_REPORT_INCREMENT;
+  pkc->send_window_kb = window_kb;
+}
+
+static pkc_window_controller* pkc_window_controllers[] = {
+  pkc_window_classic,  /* PK_FLOW_CONTROL_CLASSIC */
+  pkc_window_delay     /* PK_FLOW_CONTROL_DELAY */
+};
+
+void pkc_window_probe(struct pk_conn* pkc, time_t64 now_ms)
+{
+  pkc->window.probe_ms = now_ms;
+  pkc->window.probe_kb = pkc->read_kb;
+}
+
+void pkc_window_update(struct pk_conn* pkc, int controller, int max_kb,
+                       flow_op op, size_t kb, time_t64 now_ms)
+{
+  if ((controller < 0) || (controller > PK_FLOW_CONTROL_DELAY))
+    controller = PK_FLOW_CONTROL_CLASSIC;
+  if ((max_kb < CONN_WINDOW_SIZE_KB_MINIMUM) ||
+      (max_kb > CONN_WINDOW_SIZE_KB_CEILING))
+    max_kb = CONN_WINDOW_SIZE_KB_MAXIMUM;
+
+  pkc_window_controllers[controller](pkc, max_kb, op, kb, now_ms);
+
+  if (pkc->send_window_kb > (size_t) max_kb) {
+    pkc->send_window_kb = max_kb;
+  }
+  else if (pkc->send_window_kb < CONN_WINDOW_SIZE_KB_MINIMUM) {
+    pkc->send_window_kb = CONN_WINDOW_SIZE_KB_MINIMUM;
+  }
+}
+
+#if PK_TESTS
+static int pkc_window_simulate(int controller, int max_kb, int kb_per_s,
+                               int rtt_ms, int seconds, int* window_kb)
+{
+  /* One stream through a bottleneck of kb_per_s, acknowledged rtt_ms after
+   * delivery, in CONN_REPORT_INCREMENT steps like pkc_report_progress
+   * does for small windows.
+   * Returns the rate achieved during the last simulated second. */
+  struct pk_conn pkc;
+  size_t acked[1024];
+  size_t queued, delivered, reported, last_second;
+  int credit, kb;
+  time_t64 t;
+
+  assert(rtt_ms < 1024);
+  memset(&pkc, 0, sizeof(struct pk_conn));
+  memset(acked, 0, sizeof(acked));
+  pkc.sockfd = -1;
+  pkc_reset_conn(&pkc, 0);
+  queued = delivered = reported = last_second = 0;
+  credit = 0;
+
+  for (t = 1; t <= 1000 * seconds; t++) {
+    if (acked[t % 1024] >= reported + CONN_REPORT_INCREMENT) {
+      reported = acked[t % 1024];
+      pkc_window_update(&pkc, controller, max_kb,
+                        CONN_REMOTE_ACKED, reported, t);
+    }
+    for (kb = 0; pkc.read_kb < pkc.sent_kb + pkc.send_window_kb; kb++) {
+      pkc.read_kb++;
+      queued++;
+    }
+    if (kb && !pkc.window.probe_ms) pkc_window_probe(&pkc, t);
+    for (credit += kb_per_s; (credit >= 1000) && queued; credit -= 1000) {
+      queued--;
+      delivered++;
+    }
+    if (credit > 1000) credit = 1000;
+    acked[(t + rtt_ms) % 1024] = delivered;
+    if (t == 1000 * (seconds - 1)) last_second = delivered;
+  }
+  if (window_kb != NULL) *window_kb = pkc.send_window_kb;
+  return (delivered - last_second);
+}
+#endif
+
+int pkconn_test(void)
+{
+#if PK_TESTS
+  int size, i, j;
+  int fds[2];
+  char* b1;
+  char* b2;
+  char data[1000], rbuf[4096];
+  struct iovec iov[2];
+  struct pk_conn pkc, be;
+  unsigned int in_use = pk_state.buffers_in_use;
+  unsigned int ctl_queued = pk_state.ctl_frames_queued;
+  unsigned int ctl_drains = pk_state.ctl_queue_drains;
+  char* stream;
+  char* ctl;
+  int queued, total;
+  ssize_t seglen;
+
+  /* Buffers come in size classes, and are recycled through the pool. */
+  assert(NULL == pkc_buffer_get(CONN_IO_BUFFER_SIZE + 1, &size));
+  assert(NULL != (b1 = pkc_buffer_get(100, &size)));
+  assert(size >= 100 && size < CONN_IO_BUFFER_SIZE);
+  assert(in_use + 1 == pk_state.buffers_in_use);
+  pkc_buffer_put(b1);
+  assert(in_use == pk_state.buffers_in_use);
+  assert(0 < pk_state.buffers_idle);
+  assert(b1 == (b2 = pkc_buffer_get(size, NULL)));
+  pkc_buffer_put(b2);
+
+  /* Fresh conns own no memory. */
+  memset(&pkc, 0, sizeof(struct pk_conn));
+  pkc.sockfd = -1;
+  pkc_reset_conn(&pkc, 0);
+  assert(NULL == pkc.in_buffer);
+  assert(NULL == pkc.out_head);
+
+  /* Writes never block, the excess is queued in order and drained by
+   * later flushes. */
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  set_non_blocking(fds[0]);
+  set_non_blocking(fds[1]);
+  size = 4096;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  pkc.sockfd = fds[0];
+  for (i = 0; i < (int) sizeof(data); i++) data[i] = (char) i;
+  for (i = 0; i < 64; i++) {
+    assert((ssize_t) sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+  }
+  assert(pkc.out_buffer_pos > CONN_IO_BUFFER_SIZE);
+  assert(NULL != pkc.out_head && pkc.out_head != pkc.out_tail);
+  for (i = 0; i < 64 * (int) sizeof(data); ) {
+    pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test");
+    while (0 < (size = read(fds[1], rbuf, sizeof(rbuf)))) {
+      for (j = 0; j < size; j++, i++) {
+        assert(rbuf[j] == data[i % sizeof(data)]);
+      }
+    }
+  }
+  assert(0 == pkc.out_buffer_pos);
+  assert(NULL == pkc.out_head && NULL == pkc.out_tail);
+
+  /* Gathered writes go out after anything already queued. */
+  iov[0].iov_base = "hello ";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = "world";
+  iov[1].iov_len = 5;
+  pkc.sockfd = -1;
+  assert(3 == pkc_write(&pkc, "<< ", 3));
+  assert(3 == pkc.out_buffer_pos);
+  pkc.sockfd = fds[0];
+  assert(11 == pkc_writev(&pkc, iov, 2));
+  assert(0 == pkc.out_buffer_pos);
+  assert(14 == read(fds[1], rbuf, sizeof(rbuf)));
+  assert(0 == strncmp(rbuf, "<< hello world", 14));
+
+  /* Nothing is written while a connect() is still in progress. */
+  pkc.status |= CONN_STATUS_CONNECTING;
+  assert(3 == pkc_write(&pkc, "<< ", 3));
+  assert(11 == pkc_writev(&pkc, iov, 2));
+  assert(0 == pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test"));
+  assert(14 == pkc.out_buffer_pos);
+  pkc.status &= ~CONN_STATUS_CONNECTING;
+  assert(14 == pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test"));
+  assert(14 == read(fds[1], rbuf, sizeof(rbuf)));
+  assert(0 == strncmp(rbuf, "<< hello world", 14));
+
+  /* Discarding output returns the queue to the pool. */
+  pkc.sockfd = -1;
+  assert((ssize_t) sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+  assert((int) sizeof(data) == pkc.out_buffer_pos);
+  pkc_discard_output(&pkc);
+  assert(0 == pkc.out_buffer_pos);
+  assert(NULL == pkc.out_head);
+  assert(in_use == pk_state.buffers_in_use);
+
+  /* Control frames jump the queue, but only at a frame boundary and no
+   * later than one segment into the queued data. */
+  pkc.sockfd = fds[0];
+  for (i = 0; i < 64; i++) {
+    assert((ssize_t) sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+  }
+  assert(CONN_IO_BUFFER_SIZE < (queued = pkc.out_buffer_pos));
+  assert(5 == pkc_write_control(&pkc, "<ctl>", 5));
+  assert(ctl_queued + 1 == pk_state.ctl_frames_queued);
+  assert(5 == pkc.ctl_buffer_pos && queued + 5 == pkc.out_buffer_pos);
+  assert(NULL != (stream = malloc(64 * sizeof(data) + 5)));
+  for (total = 0; total < 64 * (int) sizeof(data) + 5; ) {
+    pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test");
+    while (0 < (size = read(fds[1], stream + total,
+                            64 * sizeof(data) + 5 - total))) total += size;
+  }
+  assert(0 == pkc.out_buffer_pos && NULL == pkc.ctl_head);
+  assert(ctl_drains + 1 == pk_state.ctl_queue_drains);
+  assert(NULL != (ctl = memmem(stream, total, "<ctl>", 5)));
+  assert(0 == (ctl - stream) % sizeof(data));
+  assert(ctl - stream <= 64 * (int) sizeof(data) - queued + CONN_IO_BUFFER_SIZE);
+  memmove(ctl, ctl + 5, total - (ctl - stream) - 5);
+  for (i = 0; i < 64 * (int) sizeof(data); i++) {
+    assert(stream[i] == data[i % sizeof(data)]);
+  }
+  free(stream);
+
+  /* A drained control lane is not retried, even if it was written last */
+  pkc.sockfd = -1;
+  assert(0 == pkc_queue_output(&pkc, "abc", 3, 1));
+  assert(3 == pkc_write_control(&pkc, "<c>", 3));
+  pkc.sockfd = fds[0];
+  assert(6 == pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test"));
+  assert(6 == read(fds[1], rbuf, sizeof(rbuf)));
+  assert(0 == strncmp(rbuf, "abc<c>", 6));
+  assert(!(pkc.status & CONN_STATUS_CTL_WRITE));
+#ifdef HAVE_OPENSSL
+  pkc.sockfd = -1;
+  assert(3 == pkc_write(&pkc, "abc", 3));
+  pkc.status |= CONN_STATUS_CTL_WRITE;
+  pkc.want_write = 3;
+  assert(pkc.out_head == pkc_next_output(&pkc, &seglen));
+  assert(!(pkc.status & CONN_STATUS_CTL_WRITE) && (3 == seglen));
+  pkc.want_write = 0;
+  pkc_discard_output(&pkc);
+  pkc.sockfd = fds[0];
+#endif
+
+  /* Corked conns batch small writes up until flushed... */
+  pkc.status |= CONN_STATUS_CORKED;
+  assert(3 == pkc_write(&pkc, "<< ", 3));
+  assert(11 == pkc_writev(&pkc, iov, 2));
+  assert(5 == pkc_write_control(&pkc, "<ctl>", 5));
+  assert(19 == pkc.out_buffer_pos);
+  assert(0 > read(fds[1], rbuf, sizeof(rbuf)));
+  assert(19 == pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test"));
+  assert(19 == read(fds[1], rbuf, sizeof(rbuf)));
+  assert(0 == strncmp(rbuf, "<< hello world<ctl>", 19));
+
+  /* ... but never more than CONN_CORK_BYTES of them. */
+  for (i = 0; i * (int) sizeof(data) <= CONN_CORK_BYTES; i++) {
+    assert((ssize_t) sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+  }
+  assert(0 < (total = read(fds[1], rbuf, sizeof(rbuf))));
+  while (total < i * (int) sizeof(data)) {
+    pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test");
+    while (0 < (size = read(fds[1], rbuf, sizeof(rbuf)))) total += size;
+  }
+  assert(0 == pkc.out_buffer_pos);
+  pkc.status &= ~CONN_STATUS_CORKED;
+
+  /* Progress is reported in increments which grow with the window... */
+  memset(&be, 0, sizeof(struct pk_conn));
+  be.sockfd = -1;
+  pkc_reset_conn(&be, 0);
+  assert(CONN_REPORT_INCREMENT == pkc_report_increment(&be));
+  be.send_window_kb = 256;
+  assert(32 == pkc_report_increment(&be));
+  be.send_window_kb = CONN_WINDOW_SIZE_KB_CEILING;
+  assert(CONN_REPORT_INCREMENT_MAX == pkc_report_increment(&be));
+  be.send_window_kb = CONN_WINDOW_SIZE_KB_INITIAL;
+  be.wrote_bytes = 10 * 1024 + 5;
+  assert(1 == pkc_report_progress(&be, "s1", &pkc, 0));
+  assert(0 > read(fds[1], rbuf, sizeof(rbuf)));
+  /* ... leftovers are sent when flushed... */
+  assert(0 == pkc_report_progress(&be, "s1", &pkc, 1));
+  assert(10 == be.reported_kb && 5 == be.wrote_bytes);
+  assert(0 < (size = read(fds[1], rbuf, sizeof(rbuf))));
+  assert(NULL != memmem(rbuf, size, "SID: s1\r\nSKB: 10\r\n", 18));
+  assert(0 == pkc_report_progress(&be, "s1", &pkc, 1));
+  assert(-1 == pkc_take_progress(&be));
+  /* ... and never overtake one riding along on queued data. */
+  pkc.sockfd = -1;
+  assert(3 == pkc_write(&pkc, "<< ", 3));
+  pkc.status |= CONN_STATUS_SKB_QUEUED;
+  be.wrote_bytes = 2048;
+  assert(0 == pkc_report_progress(&be, "s1", &pkc, 1));
+  assert(0 == pkc.ctl_buffer_pos);
+  pkc.sockfd = fds[0];
+  total = pkc.out_buffer_pos;
+  assert(total == pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test"));
+  assert(total == read(fds[1], rbuf, sizeof(rbuf)));
+  assert(0 == strncmp(rbuf, "<< ", 3));
+  assert(NULL != memmem(rbuf, total, "SKB: 12\r\n", 9));
+  assert(!(pkc.status & CONN_STATUS_SKB_QUEUED));
+  close(fds[0]);
+  close(fds[1]);
+
+  fprintf(stderr, "pkc_buffer/queue tests passed\n");
+
+  /* The classic window controller can't fill a long, fat pipe... */
+  assert(1300 > pkc_window_simulate(PK_FLOW_CONTROL_CLASSIC,
+                                    CONN_WINDOW_SIZE_KB_MAXIMUM,
+                                    12500, 300, 20, NULL));
+  /* ... the delay based one fills it within seconds... */
+  assert(12000 < pkc_window_simulate(PK_FLOW_CONTROL_DELAY,
+                                     CONN_WINDOW_SIZE_KB_CEILING,
+                                     12500, 300, 10, &i));
+  assert(i < 2 * 3750);
+  assert(95000 < pkc_window_simulate(PK_FLOW_CONTROL_DELAY,
+                                     CONN_WINDOW_SIZE_KB_CEILING,
+                                     100000, 50, 30, &i));
+  assert(i < 2 * 5000);
+  /* ... respects its ceiling, and does not bloat short pipes. */
+  assert(1300 > pkc_window_simulate(PK_FLOW_CONTROL_DELAY,
+                                    CONN_WINDOW_SIZE_KB_MAXIMUM,
+                                    12500, 300, 20, &i));
+  assert(i == CONN_WINDOW_SIZE_KB_MAXIMUM);
+  assert(950 < pkc_window_simulate(PK_FLOW_CONTROL_DELAY,
+                                   CONN_WINDOW_SIZE_KB_CEILING,
+                                   1000, 20, 20, &i));
+  assert(i < CONN_WINDOW_SIZE_KB_INITIAL);
+  fprintf(stderr, "pkc_window tests passed\n");
+#endif
+  return 1;
+}
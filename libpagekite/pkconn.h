@@ -28,16 +28,36 @@ Note: For alternate license terms, see the file COPYING.md.
 #define CONN_WINDOW_SIZE_KB_MAXIMUM   384  /* 10Mbit/s at 300ms rtt */
 #define CONN_WINDOW_SIZE_KB_INITIAL   128  /* Send up 128KB before 1st ACK */
 #define CONN_WINDOW_SIZE_KB_MINIMUM     4  /* Kernels eat at least this */
-#define CONN_REPORT_INCREMENT          16
+#define CONN_WINDOW_SIZE_KB_CEILING 16384  /* 400Mbit/s at 300ms rtt */
+#define CONN_WINDOW_RTT_TTL_MS      10000  /* Re-learn the minimum RTT */
+#define CONN_WINDOW_QUEUE_KB_TARGET    48  /* Delay mode: keep this queued */
+#define CONN_REPORT_INCREMENT          16  /* Report delivery every 16KB */
+#define CONN_REPORT_INCREMENT_MAX      64  /* ... or less often, see below */
+#define CONN_REPORT_DELAY_MS           50  /* Leftovers wait this long */
 
 typedef enum {
   FLOW_OP_NONE,
   CONN_TUNNEL_BLOCKED,
   CONN_TUNNEL_UNBLOCKED,
   CONN_DEST_BLOCKED,
-  CONN_DEST_UNBLOCKED
+  CONN_DEST_UNBLOCKED,
+  CONN_REMOTE_ACKED,     /* SKB: the far end wrote this many KB */
+  CONN_REMOTE_THROTTLE   /* SPD: the far end wants us to slow down */
 } flow_op;
 
+/* What the window controllers know about a stream (see PK_FLOW_CONTROL_*).
+ * One RTT probe is in flight at a time: it times how long it takes for
+ * the data read up to probe_kb to be acknowledged. */
+struct pkc_window {
+  time_t64   probe_ms;       /* When the probe started, 0 if none */
+  size_t     probe_kb;       /* ... read_kb at the time */
+  int        rtt_ms;         /* Latest sample */
+  int        rtt_min_ms;
+  time_t64   rtt_min_at;
+  size_t     saved_kb;       /* Window to restore after re-measuring */
+  int        ramped;         /* Done with the exponential start */
+};
+
 typedef enum {
   CONN_CLEAR_DATA,
 #ifdef HAVE_OPENSSL
@@ -47,6 +67,24 @@ typedef enum {
 } io_state_t;
 
 #define CONN_IO_BUFFER_SIZE     PARSER_BYTES_MAX
+
+/* Conn I/O buffers are borrowed from a process-wide pool while there is
+ * data in flight and returned when drained, so memory use scales with
+ * traffic rather than the number of configured connection slots.  The
+ * pool hands out a few size classes; the largest is CONN_IO_BUFFER_SIZE. */
+#define PKC_BUFFER_CLASSES      3
+#define PKC_BUFFER_CLASS_SIZES  {1024, 4096, CONN_IO_BUFFER_SIZE}
+#define PKC_BUFFER_IDLE_MAX     64  /* Idle buffers kept around, per class */
+
+/* Writes never block: whatever the socket won't take right away is queued
+ * as a chain of pool segments and drained by the writable watcher.  The
+ * queue is unbounded, but once it grows past this mark the producers feeding
+ * it are throttled (see pkm_flow_control_tunnel). */
+#define CONN_OUT_QUEUE_HIGH_WATER (4*CONN_IO_BUFFER_SIZE)
+#define PKC_WRITEV_MAX          16  /* Vectors per pkc_writev() syscall */
+/* Corked conns queue small writes until somebody calls pkc_flush, unless
+ * that would leave more than this many bytes waiting. */
+#define CONN_CORK_BYTES         CONN_IO_BUFFER_SIZE
 #define CONN_STATUS_BITS        0x0000FFFF
 #define CONN_STATUS_UNKNOWN     0x00000000
 #define CONN_STATUS_END_READ    0x00000001 /* Don't want more data     */
@@ -62,10 +100,15 @@ typedef enum {
 #define CONN_STATUS_WANT_WRITE  0x00000200 /* Want null writes when available */
 #define CONN_STATUS_LISTENING   0x00000400 /* Listening socket */
 #define CONN_STATUS_CHANGING    0x00000800 /* This conn is being changed */
-#define PKC_OUT(c)      ((c).out_buffer + (c).out_buffer_pos)
-#define PKC_OUT_FREE(c) (CONN_IO_BUFFER_SIZE - (c).out_buffer_pos)
+#define CONN_STATUS_CONNECTING  0x00001000 /* connect() still in progress */
+#define CONN_STATUS_CTL_WRITE   0x00002000 /* Last write was a control frame */
+#define CONN_STATUS_CORKED      0x00004000 /* Batch small writes, see above */
+#define CONN_STATUS_SKB_QUEUED  0x00008000 /* Data lane carries an SKB */
+/* Note: PKC_IN is only valid once a buffer has been borrowed, see pkc_read().
+ * PKC_IN_FREE reports logical capacity. */
 #define PKC_IN(c)       ((c).in_buffer + (c).in_buffer_pos)
 #define PKC_IN_FREE(c)  (CONN_IO_BUFFER_SIZE - (c).in_buffer_pos)
+struct pkc_buffer;
 struct pk_conn {
   PK_MEMORY_CANARY
   int        status;
@@ -76,14 +119,22 @@ struct pk_conn {
   size_t     read_kb;
   size_t     sent_kb;
   size_t     send_window_kb;
+  struct pkc_window window;
   /* Data we have written locally, what we've reported to tunnel. */
   size_t     wrote_bytes;
   size_t     reported_kb;
-  /* Buffers, events */
+  /* Buffers (borrowed from the pool, NULL when empty), events.
+   * out_buffer_pos is the total number of bytes queued for output,
+   * ctl_buffer_pos the part of that which is control frames. */
   int        in_buffer_pos;
-  char       in_buffer[CONN_IO_BUFFER_SIZE];
+  char*      in_buffer;
   int        out_buffer_pos;
-  char       out_buffer[CONN_IO_BUFFER_SIZE];
+  struct pkc_buffer* out_head;
+  struct pkc_buffer* out_tail;
+  int        ctl_buffer_pos;
+  struct pkc_buffer* ctl_head;
+  struct pkc_buffer* ctl_tail;
+  time_t64   ctl_queued_ms;
   ev_io      watch_r;
   ev_io      watch_w;
   io_state_t state;
@@ -93,6 +144,10 @@ struct pk_conn {
 #endif
 };
 
+char*   pkc_buffer_get(int, int*);
+void    pkc_buffer_put(char*);
+void    pkc_release_buffers(struct pk_conn*);
+void    pkc_discard_output(struct pk_conn*);
 void    pkc_reset_conn(struct pk_conn*, unsigned int);
 int     pkc_connect(struct pk_conn*, struct addrinfo*);
 int     pkc_listen(struct pk_conn*, struct addrinfo*, int);
@@ -101,9 +156,18 @@ int     pkc_start_ssl(struct pk_conn*, SSL_CTX*, const char* hostname);
 #endif
 int     pkc_wait(struct pk_conn*, int);
 ssize_t pkc_read(struct pk_conn*);
+ssize_t pkc_read_into(struct pk_conn*, char*, ssize_t);
 int     pkc_pending(struct pk_conn*);
 ssize_t pkc_raw_write(struct pk_conn*, char*, ssize_t);
 ssize_t pkc_flush(struct pk_conn*, char*, ssize_t, int, char*);
 ssize_t pkc_write(struct pk_conn*, char*, ssize_t);
-void    pkc_report_progress(struct pk_conn*, char*, struct pk_conn*);
+ssize_t pkc_writev(struct pk_conn*, struct iovec*, int);
+ssize_t pkc_write_control(struct pk_conn*, char*, ssize_t);
+int     pkc_report_increment(struct pk_conn*);
+ssize_t pkc_take_progress(struct pk_conn*);
+int     pkc_report_progress(struct pk_conn*, char*, struct pk_conn*, int);
+void    pkc_window_probe(struct pk_conn*, time_t64);
+void    pkc_window_update(struct pk_conn*, int, int, flow_op, size_t, time_t64);
+
+int pkconn_test(void);
 
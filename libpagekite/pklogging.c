@@ -215,6 +215,8 @@ void pk_dump_conn(char* prefix, struct pk_conn* conn)
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/read_kb: %d", prefix, conn->read_kb);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/sent_kb: %d", prefix, conn->sent_kb);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/send_window_kb: %d", prefix, conn->send_window_kb);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/window_rtt_ms: %d (min %d)", prefix,
+                               conn->window.rtt_ms, conn->window.rtt_min_ms);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/wrote_bytes: %d", prefix, conn->wrote_bytes);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/reported_kb: %d", prefix, conn->reported_kb);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/in_buffer_pos: %d", prefix, conn->in_buffer_pos);
@@ -251,9 +253,9 @@ void pk_dump_be_conn(char* prefix, struct pk_backend_conn* bec)
     pk_log(LL, "%s/fe: %s", prefix, bec->tunnel->fe_hostname);
 
   if (bec->kite)
-    pk_log(LL, "%s/kite: %d <- %s://%s", prefix, bec->kite->local_port,
-                                                 bec->kite->protocol,
-                                                 bec->kite->public_domain);
+    pk_log(LL, "%s/kite: %d <- %s://%s", prefix,
+           bec->backend ? bec->backend->local_port : 0,
+           bec->kite->protocol, bec->kite->public_domain);
 
   sprintf(tmp, "%s/conn", prefix);
   pk_dump_conn(tmp, &(bec->conn));
@@ -263,6 +265,7 @@ void pk_dump_state(struct pk_manager* pkm)
 {
   int i;
   char prefix[1024];
+  struct pk_pagekite* kite;
   struct pk_tunnel* fe;
   struct pk_backend_conn* bec;
 
@@ -276,11 +279,23 @@ void pk_dump_state(struct pk_manager* pkm)
   pk_log(LL, "pk_global_state/have_ssl: %d", pk_state.have_ssl);
   pk_log(LL, "pk_global_state/live_streams: %d", pk_state.live_streams);
   pk_log(LL, "pk_global_state/live_tunnels: %d", pk_state.live_tunnels);
+  pk_log(LL, "pk_global_state/backend_breaker_trips: %d",
+             pk_state.backend_breaker_trips);
+  pk_log(LL, "pk_global_state/buffers_in_use: %u (%zu bytes)",
+             pk_state.buffers_in_use, pk_state.buffer_bytes_in_use);
+  pk_log(LL, "pk_global_state/buffers_idle: %u (%zu bytes)",
+             pk_state.buffers_idle, pk_state.buffer_bytes_idle);
+  pk_log(LL, "pk_global_state/ctl_frames_queued: %d (avg %lldms, max %lldms)",
+             pk_state.ctl_frames_queued,
+             pk_state.ctl_queue_drains
+               ? pk_state.ctl_queue_ms_total / pk_state.ctl_queue_drains : 0,
+             pk_state.ctl_queue_ms_max);
   pk_log(LL, "pk_manager/status: %d", pkm->status);
   pk_log(LL, "pk_manager/buffer_bytes_free: %d", pkm->buffer_bytes_free);
   pk_log(LL, "pk_manager/kite_max: %d", pkm->kite_max);
   pk_log(LL, "pk_manager/tunnel_max: %d", pkm->tunnel_max);
   pk_log(LL, "pk_manager/be_conn_max: %d", pkm->be_conn_max);
+  pk_log(LL, "pk_manager/be_conn_limit: %d", pkm->be_conn_limit);
   pk_log(LL, "pk_manager/last_world_update: %llx", pkm->last_world_update);
   pk_log(LL, "pk_manager/next_tick: %lld", pkm->next_tick);
   pk_log(LL, "pk_manager/enable_timer: %d", 0 < pkm->enable_timer);
@@ -288,11 +303,18 @@ void pk_dump_state(struct pk_manager* pkm)
   pk_log(LL, "pk_manager/want_spare_frontends: %d", pkm->want_spare_frontends);
   pk_log(LL, "pk_manager/dynamic_dns_url: %s", pkm->dynamic_dns_url);
 
+  for (i = 0, kite = pkm->kites; i < pkm->kite_max; i++, kite++) {
+    if (kite->protocol[0] != '\0')
+      pk_log(LL, "kite_%d: %s://%s:%d, backends=%d, breaker=%d (trips=%d)",
+                 i, kite->protocol, kite->public_domain, kite->public_port,
+                 kite->backend_count, kite->breaker, kite->breaker_trips);
+  }
   for (i = 0, fe = pkm->tunnels; i < pkm->tunnel_max; i++, fe++) {
     sprintf(prefix, "fe_%d", i);
     pk_dump_tunnel(prefix, fe);
   }
-  for (i = 0, bec = pkm->be_conns; i < pkm->be_conn_max; i++, bec++) {
+  for (i = 0; i < pkm->be_conn_max; i++) {
+    bec = pkm_be_conn_at(pkm, i);
     sprintf(prefix, "beconn_%d", i);
     pk_dump_be_conn(prefix, bec);
   }
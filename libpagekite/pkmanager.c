@@ -49,13 +49,25 @@ static void pkm_unblock(struct pk_manager *pkm);
 static void pkm_quit_cb(EV_P_ ev_async *w, int revents);
 static void pkm_quit(struct pk_manager* pkm);
 static void pkm_chunk_cb(struct pk_tunnel*, struct pk_chunk*);
+static void pkm_reject_stream(struct pk_tunnel*, char*, char*, char*);
 static struct pk_backend_conn* pkm_connect_be(struct pk_tunnel*,
                                               struct pk_chunk*);
+static int pkm_be_conn_connected(struct pk_backend_conn*);
+static struct pk_kite_backend* pkm_choose_backend(struct pk_manager*,
+                                                  struct pk_pagekite*);
+static void pkm_backend_result(struct pk_manager*, struct pk_pagekite*,
+                               struct pk_kite_backend*, int);
+static void pkm_kite_breaker(struct pk_manager*, struct pk_pagekite*, int);
+static void pkm_be_conn_release_backend(struct pk_backend_conn*);
+static void pkm_be_pool_flush(struct pk_kite_backend*);
+static int pkm_be_pool_take(struct pk_manager*, struct pk_kite_backend*);
+static void pkm_be_conn_connect_failed(struct pk_backend_conn*, int);
 static ssize_t pkm_write_chunked(struct pk_tunnel*, struct pk_backend_conn*,
                                  ssize_t, char*);
 static int pkm_update_io(struct pk_tunnel*, struct pk_backend_conn*, int);
 static void pkm_flow_control_tunnel(struct pk_tunnel*, flow_op, int);
 static void pkm_flow_control_conn(struct pk_conn*, flow_op);
+static void pkm_window_update(struct pk_backend_conn*, flow_op, size_t);
 static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof);
 static void pkm_tunnel_readable_cb(EV_P_ ev_io*, int);
 static void pkm_tunnel_writable_cb(EV_P_ ev_io*, int);
@@ -64,11 +76,37 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io*, int);
 static void pkm_listener_cb(EV_P_ ev_io*, int);
 static void pkm_tick_cb(EV_P_ ev_async*, int);
 static void pkm_timer_cb(EV_P_ ev_timer*, int);
+static void pkm_flush_cb(EV_P_ ev_prepare*, int);
+static void pkm_skb_timer_cb(EV_P_ ev_timer*, int);
 static void pkm_reset_timer(struct pk_manager*);
 static void pkm_reset_manager(struct pk_manager*);
 static struct pk_pagekite* pkm_find_kite(struct pk_manager*,
                                          const char*, const char*, int);
-static unsigned int pkm_sid_shift(char *);
+static struct pk_pagekite* pkm_kite_index_find(struct pk_manager*,
+                                               const char*, const char*, int);
+static void pkm_kite_index_add(struct pk_manager*, struct pk_pagekite*);
+static void pkm_kite_index_reset(struct pk_manager*);
+static unsigned int pkm_be_conn_hash(struct pk_tunnel*, const char*);
+static void pkm_be_conn_index_add(struct pk_manager*, struct pk_backend_conn*);
+static void pkm_be_conn_index_del(struct pk_backend_conn*);
+static void pkm_be_conn_index_reset(struct pk_manager*);
+static void pkm_be_conn_list_append(struct pk_backend_conn_list*,
+                                    struct pk_backend_conn*);
+static void pkm_be_conn_list_del(struct pk_backend_conn*);
+static void pkm_be_conn_touch(struct pk_backend_conn*);
+static void pkm_be_conn_tunnel_link(struct pk_backend_conn*);
+static int pkm_be_conn_on_tunnel(struct pk_backend_conn*);
+static void pkm_be_conn_tunnel_unlink(struct pk_backend_conn*);
+static void pkm_be_conn_throttle(struct pk_backend_conn*);
+static void pkm_be_conn_unthrottle(struct pk_backend_conn*);
+static void pkm_be_conn_ready(struct pk_backend_conn*);
+static void pkm_be_conn_unready(struct pk_backend_conn*);
+static void pkm_be_conn_connecting(struct pk_backend_conn*,
+                                   const char*, const char*);
+static void pkm_be_conn_connect_done(struct pk_backend_conn*);
+static void pkm_be_conn_lists_reset(struct pk_manager*);
+static void pkm_schedule_tunnel(struct pk_tunnel*);
+static void pkm_be_conn_table_shrink(struct pk_manager*);
 
 #ifndef HAVE_PTHREAD_YIELD
 #  ifdef HAVE_PTHREAD_YIELD_NP
@@ -83,6 +121,26 @@ static unsigned int pkm_sid_shift(char *);
 #  endif
 #endif
 
+/* Conn table segments are cache line aligned, like the base table. */
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#  define pkm_segment_free(s) _aligned_free(s)
+static void* pkm_segment_alloc(size_t bytes)
+{
+  void* segment = _aligned_malloc(bytes, PK_CACHE_LINE_BYTES);
+  if (segment != NULL) memset(segment, 0, bytes);
+  return segment;
+}
+#else
+#  define pkm_segment_free(s) free(s)
+static void* pkm_segment_alloc(size_t bytes)
+{
+  void* segment;
+  if (0 != posix_memalign(&segment, PK_CACHE_LINE_BYTES, bytes)) return NULL;
+  memset(segment, 0, bytes);
+  return segment;
+}
+#endif
+
 static void pkm_yield_start(struct pk_manager *pkm)
 {
   pthread_mutex_unlock(&(pkm->loop_lock));
@@ -166,7 +224,7 @@ static void pkm_quit(struct pk_manager* pkm)
 static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
 {
   struct pk_backend_conn* pkb; /* FIXME: What if we are a front-end? */
-  char reply[PK_REJECT_MAXSIZE], rej[PK_REJECT_MAXSIZE];
+  char reply[PK_REJECT_MAXSIZE];
   size_t bytes;
 
   PK_TRACE_FUNCTION;
@@ -185,27 +243,10 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
       chunk->request_host = NULL;
     }
     else {
+      /* Rejecting reads the fancy URL cache, so we still need the lock. */
+      pkm_reject_stream(fe, chunk->sid,
+                        chunk->request_proto, chunk->request_host);
       pkm_yield_start(fe->manager);
-
-      /* FIXME: Send back a nicer error */
-      if ((NULL != chunk->request_proto) &&
-          (0 == strncasecmp(chunk->request_proto, "https", 5))) {
-        bytes = pk_format_reply(reply, chunk->sid, PK_REJECT_TLS_LEN,
-                                                   PK_REJECT_TLS_DATA);
-        pkc_write(&(fe->conn), reply, bytes);
-      }
-      else {
-        bytes = pk_format_http_rejection(rej,
-          PK_REJECT_BACKEND,
-          fe->manager->fancy_pagekite_net_rejection_url,
-          chunk->request_proto,
-          chunk->request_host);
-        bytes = pk_format_reply(reply, chunk->sid, bytes, rej);
-        pkc_write(&(fe->conn), reply, bytes);
-      }
-
-      bytes = pk_format_eof(reply, chunk->sid, PK_EOF);
-      pkc_write(&(fe->conn), reply, bytes);
       pk_log(PK_LOG_TUNNEL_CONNS, "No stream found: %s, %s://%s", chunk->sid,
                                   chunk->request_proto, chunk->request_host);
     }
@@ -222,7 +263,7 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
   if (NULL != chunk->noop) {
     if (NULL != chunk->ping) {
       bytes = pk_format_pong(reply);
-      pkc_write(&(fe->conn), reply, bytes);
+      pkc_write_control(&(fe->conn), reply, bytes);
       pk_log(PK_LOG_TUNNEL_DATA, "> --- > Pong!");
       /* Record this ping, even if not initiated by us. This allows us to
        * use pings as a metric of whether a tunnel is in use, to prevent
@@ -248,44 +289,145 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
      * to track progress and tweak our sending window. */
 
     if (0 < chunk->throttle_spd) {
-      /* Integer-safe way to reduce by about 20% */
-      pkb->conn.send_window_kb -= (1 + pkb->conn.send_window_kb / 5);
+      pkm_window_update(pkb, CONN_REMOTE_THROTTLE, 0);
     }
-
     if (0 < chunk->remote_sent_kb) {
-      pkb->conn.sent_kb = chunk->remote_sent_kb;
-      if (pkb->conn.send_window_kb == CONN_WINDOW_SIZE_KB_INITIAL) {
-        int window_kb = pkb->conn.read_kb - pkb->conn.sent_kb;
-        pkb->conn.send_window_kb = window_kb + (window_kb / 8);
-      }
-      else {
-        /* Ramp up our sending speed by default. Push-back from the
-         * tunnel blocking will lower this if it gets too high. */
-        pkb->conn.send_window_kb += 1;
-      }
-    }
-
-    if (pkb->conn.send_window_kb > CONN_WINDOW_SIZE_KB_MAXIMUM) {
-      pkb->conn.send_window_kb = CONN_WINDOW_SIZE_KB_MAXIMUM;
-    }
-    else if (pkb->conn.send_window_kb < CONN_WINDOW_SIZE_KB_MINIMUM) {
-      pkb->conn.send_window_kb = CONN_WINDOW_SIZE_KB_MINIMUM;
+      pkm_window_update(pkb, CONN_REMOTE_ACKED, chunk->remote_sent_kb);
     }
 
     pkm_update_io(fe, pkb, 0);
   }
 }
 
+const char* pkm_fancy_rejection_url(struct pk_manager* pkm,
+                                    const char* host)
+{
+  /* Choose the base URL for a fancy rejection page, without waiting.
+   *
+   * The application gets to override the default per host, by answering
+   * PK_EV_CFG_FANCY_URL events. Those block until answered, so the
+   * answers are cached and fetched by the blocker threads; until one
+   * arrives (or while it is being refreshed) we use what we have. Only
+   * one question is outstanding at a time, so a slow application can
+   * tie up at most one blocker thread.
+   *
+   * The cache is shared with those threads, so this must be called from
+   * the event loop while it holds the loop lock (not after yielding it),
+   * and the URL is only valid until the lock is released. */
+  int i, pending;
+  time_t64 now;
+  struct pk_fancy_url* entry;
+  struct pk_fancy_url* victim;
+  const char* default_url = pkm->fancy_pagekite_net_rejection_url;
+
+  if ((NULL == default_url) || ('\0' == *default_url) || (NULL == host))
+    return default_url;
+  if ((pkm->events.event_mask != PK_EV_ALL) &&
+      (0 == (PK_EV_CFG_FANCY_URL & pkm->events.event_mask)))
+    return default_url;
+
+  now = pk_time();
+  pending = 0;
+  entry = victim = NULL;
+  for (i = 0; i < PK_FANCY_URL_CACHE_MAX; i++) {
+    struct pk_fancy_url* fu = pkm->fancy_urls + i;
+    if (fu->pending) pending = 1;
+    if ((fu->host != NULL) && (0 == strcasecmp(fu->host, host))) entry = fu;
+    else if ((!fu->pending) &&
+             ((victim == NULL) || (fu->expires < victim->expires))) victim = fu;
+  }
+
+  if (entry == NULL) {
+    if ((victim == NULL) || pending) return default_url;
+    if (victim->host != NULL) free(victim->host);
+    if (victim->url != NULL) free(victim->url);
+    victim->host = strdup(host);
+    victim->url = NULL;
+    victim->expires = 0;
+    entry = victim;
+  }
+
+  if ((entry->expires <= now) && !pending) {
+    entry->pending = 1;
+    if (0 > pkb_add_job(&(pkm->blocking_jobs), PK_LOOKUP_FANCY_URL,
+                        entry - pkm->fancy_urls, pkm))
+      entry->pending = 0;
+  }
+
+  return (entry->url != NULL) ? entry->url : default_url;
+}
+
+void pkm_lookup_fancy_url(struct pk_manager* pkm, int i)
+{
+  /* This blocks, so it must only be called from the blocker threads. */
+  char* host;
+  char* url;
+  struct pke_event* ev;
+  struct pk_fancy_url* entry = pkm->fancy_urls + i;
+
+  PK_TRACE_FUNCTION;
+
+  /* Pending entries are never evicted, so entry->host is stable. */
+  pkm_block(pkm);
+  host = strdup(entry->host);
+  pkm_unblock(pkm);
+
+  url = NULL;
+  ev = pke_post_blocking_event(&(pkm->events),
+                               PK_EV_CFG_FANCY_URL, 0, host, NULL, &url);
+  if (ev) pke_free_event(&(pkm->events), ev->event_code);
+
+  pkm_block(pkm);
+  if (entry->url != NULL) free(entry->url);
+  entry->url = url;
+  entry->expires = pk_time() + PK_FANCY_URL_TTL;
+  entry->pending = 0;
+  pkm_unblock(pkm);
+
+  pk_log(PK_LOG_MANAGER_DEBUG, "Rejection URL for %s: %s",
+         host, (url != NULL) ? url : "(default)");
+  free(host);
+}
+
+static void pkm_reject_stream(struct pk_tunnel* fe, char* sid,
+                              char* proto, char* host)
+{
+  char reply[PK_REJECT_MAXSIZE], rej[PK_REJECT_MAXSIZE];
+  size_t bytes;
+
+  /* FIXME: Send back a nicer error */
+  if ((NULL != proto) && (0 == strncasecmp(proto, "https", 5))) {
+    bytes = pk_format_reply(reply, sid, PK_REJECT_TLS_LEN,
+                                        PK_REJECT_TLS_DATA);
+    pkc_write(&(fe->conn), reply, bytes);
+  }
+  else {
+    bytes = pk_format_http_rejection(rej,
+      PK_REJECT_BACKEND,
+      pkm_fancy_rejection_url(fe->manager, host),
+      proto,
+      host);
+    bytes = pk_format_reply(reply, sid, bytes, rej);
+    pkc_write(&(fe->conn), reply, bytes);
+  }
+
+  bytes = pk_format_eof(reply, sid, PK_EOF);
+  pkc_write(&(fe->conn), reply, bytes);
+}
+
 struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
                                        struct pk_chunk* chunk)
 {
-  /* Connect to the backend, or free the conn object if we fail */
-  int sockfd;
-  struct sockaddr_in addr_buf;
-  struct sockaddr_in* addr;
-  struct hostent *backend;
+  /* Start connecting to the backend, or free the conn object if we fail.
+   * The connect() itself does not block; until it completes, data from
+   * the tunnel is queued on the conn and the writable watcher waits for
+   * the outcome (see pkm_be_conn_connected). */
+  int sockfd, connecting;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
   struct pk_backend_conn* pkb;
   struct pk_pagekite *kite;
+  struct pk_kite_backend *backend;
 
   PK_TRACE_FUNCTION;
 
@@ -308,6 +450,33 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
     return NULL;
   }
 
+  /* Pick one of the kite's origin servers; the address comes from the
+   * cache, as DNS lookups only ever happen on the blocking threads.
+   * Stale entries are still used, but we ask for a refresh. The same
+   * job tops up the connection pool. */
+  if (NULL == (backend = pkm_choose_backend(fe->manager, kite))) {
+    pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: %s for %s://%s",
+                                (kite->backend_count < 1) ? "No backends"
+                                                          : "Breaker open",
+                                kite->protocol, kite->public_domain);
+    return NULL;
+  }
+  if (!kite->check_pending &&
+      ((backend->local_addr_expires <= pk_time()) ||
+       ((fe->manager->be_pool_max > 0) &&
+        (backend->pool_size <= fe->manager->be_pool_min)))) {
+    kite->check_pending = 1;
+    pkb_add_job(&(fe->manager->blocking_jobs), PK_CHECK_BACKENDS,
+                0, fe->manager);
+  }
+  if (0 == (addrlen = backend->local_addrlen)) {
+    pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: No address for %s:%d",
+                                backend->local_domain, backend->local_port);
+    pkm_backend_result(fe->manager, kite, backend, 0);
+    return NULL;
+  }
+  memcpy(&addr, &(backend->local_addr), addrlen);
+
   /* Allocate a connection for this request or die... */
   if (NULL == (pkb = pkm_alloc_be_conn(fe->manager, fe, chunk->sid))) {
     pk_log(PK_LOG_TUNNEL_CONNS|PK_LOG_ERROR,
@@ -315,62 +484,48 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
            chunk->request_proto, chunk->request_host, chunk->request_port);
     return NULL;
   }
-  pkm_yield_start(fe->manager);
 
-  /* Look up the back-end... */
-  addr = NULL;
-  if (NULL != (backend = gethostbyname(kite->local_domain))) {
-    addr = &addr_buf;
-    memset((char *) addr, 0, sizeof(addr));
-    addr->sin_family = AF_INET;
-    memmove((char*) &(addr->sin_addr.s_addr),
-            (char*) backend->h_addr_list[0],
-            backend->h_length);
-    addr->sin_port = htons(kite->local_port);
-  }
+  /* A pre-connected socket from the pool saves us the round trip. */
+  sockfd = pkm_be_pool_take(fe->manager, backend);
+  pkm_yield_start(fe->manager);
 
-  /* Try to connect and set non-blocking. */
+  /* Set non-blocking first, then connect. Immediate failures (a local
+   * service which is not running) are reported right away, anything
+   * slower is left to the event loop. Unix sockets either connect
+   * at once or fail (EAGAIN means the listen queue is full).
+   * See also: http://developerweb.net/viewtopic.php?id=3196 */
   struct timeval to;
   to.tv_sec = pk_state.socket_timeout_s;
   to.tv_usec = 0;
   errno = 0;
-  sockfd = -1;
-  if ((NULL == addr) ||
-      (0 > (sockfd = PKS_socket(AF_INET, SOCK_STREAM, 0))) ||
-      PKS_fail(PKS_connect(sockfd, (struct sockaddr*) addr, sizeof(*addr))) ||
-      PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &to, sizeof(to))) ||
-      PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &to, sizeof(to))) ||
-      (0 > set_non_blocking(sockfd)))
+  connecting = 0;
+  if ((0 > sockfd) &&
+      ((0 > (sockfd = PKS_socket(addr.ss_family, SOCK_STREAM, 0))) ||
+       PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &to, sizeof(to))) ||
+       PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &to, sizeof(to))) ||
+       (0 > set_non_blocking(sockfd)) ||
+       (PKS_fail(PKS_connect(sockfd, (struct sockaddr*) &addr, addrlen)) &&
+        !(connecting = ((errno == EINPROGRESS) ||
+                        ((errno == EWOULDBLOCK) &&
+                         (addr.ss_family != AF_UNIX)))))))
   {
-    if ((errno != EINPROGRESS) || /* See comment below */
-        (sockfd < 0))             /* (NULL == addr) or PKS_socket() failed */
-    {
-      /* FIXME:
-       *   EINPROGRESS shouldn't happen until we swap connect/set_non_blocking
-       *   above - which would be desirable from a performance point of view.
-       *   Do that later once we've figured out error handling; see below.
-       */
-      if (sockfd > -1)
-        PKS_close(sockfd);
-
-      pkm_yield_stop(fe->manager);
-      pkm_free_be_conn(pkb);
-      pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d",
-                                  kite->local_domain, kite->local_port);
-      return NULL;
-    }
+    if (sockfd > -1)
+      PKS_close(sockfd);
+
+    pkm_yield_stop(fe->manager);
+    pkm_free_be_conn(pkb);
+    pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d",
+                                backend->local_domain, backend->local_port);
+    pkm_backend_result(fe->manager, kite, backend, 0);
+    return NULL;
   }
 
-  /* FIXME: The above should be non-blocking for high volume front-ends,
-   *        but that requires more buffering and fancy logic, so we're
-   *        lazy for now. Until that works, busy relays should probably
-   *        never configure any direct backends of their own.
-   *        See also: http://developerweb.net/viewtopic.php?id=3196 */
-
   pkm_yield_stop(fe->manager);
 
   chunk->first_chunk = 1;
   pkb->kite = kite;
+  pkb->backend = backend;
+  backend->active++;
   pkb->conn.sockfd = sockfd;
 
   int ev_sock = PKS_EV_FD(sockfd);
@@ -378,7 +533,17 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
   ev_io_init(&(pkb->conn.watch_w), pkm_be_conn_writable_cb, ev_sock, EV_WRITE);
 
   pkb->conn.watch_r.data = pkb->conn.watch_w.data = (void *) pkb;
-  ev_io_start(fe->manager->loop, &(pkb->conn.watch_r));
+  if (connecting) {
+    /* Writability tells us when the connection attempt is over. */
+    pkb->conn.status |= CONN_STATUS_CONNECTING;
+    pkm_be_conn_connecting(pkb, chunk->request_proto, chunk->request_host);
+    pk_log(PK_LOG_BE_CONNS, "%d: Connecting to %s:%d",
+           sockfd, backend->local_domain, backend->local_port);
+  }
+  else {
+    pkm_backend_result(fe->manager, kite, backend, 1);
+    ev_io_start(fe->manager->loop, &(pkb->conn.watch_r));
+  }
   ev_io_start(fe->manager->loop, &(pkb->conn.watch_w));
 
   pkb->conn.status &= ~CONN_STATUS_CHANGING;  /* Change complete */
@@ -387,27 +552,230 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
   return pkb;
 }
 
+static struct pk_kite_backend* pkm_choose_backend(struct pk_manager* pkm,
+                                                  struct pk_pagekite* kite)
+{
+  /* Backends which keep failing are skipped for a while; if they all
+   * are, the kite's circuit breaker opens and we return NULL. Otherwise
+   * we either pick the backend with the fewest active streams per unit
+   * of weight, or go round robin. Both use smooth weighted round robin
+   * (as in nginx) to spread the load, in the former case only to break
+   * ties. The round robin state only advances if we return a backend. */
+  int i, total, load;
+  time_t64 now = pk_time();
+  struct pk_kite_backend *b, *best;
+  #define _rr_next(b) ((b)->rr_current + (b)->weight)
+
+  total = 0;
+  best = NULL;
+  for (i = 0; i < kite->backend_count; i++) {
+    b = kite->backends + i;
+    if (b->down_until > now) continue;
+    total += b->weight;
+    if (best == NULL) {
+      best = b;
+    }
+    else if (pkm->be_balancing == PK_BALANCE_LEAST_CONNS) {
+      /* Compares active/weight, without dividing */
+      load = (b->active * best->weight) - (best->active * b->weight);
+      if ((load < 0) || ((load == 0) && (_rr_next(b) > _rr_next(best))))
+        best = b;
+    }
+    else if (_rr_next(b) > _rr_next(best)) {
+      best = b;
+    }
+  }
+  #undef _rr_next
+  if (best == NULL) {
+    if (kite->backend_count > 0) pkm_kite_breaker(pkm, kite, PK_BREAKER_OPEN);
+    return NULL;
+  }
+
+  /* A backend is due for another try after an outage: let one stream
+   * through as a probe, and reject the rest until we know how it went
+   * (or the attempt should have timed out). */
+  if (kite->breaker != PK_BREAKER_CLOSED) {
+    if ((kite->breaker_probe_at > 0) &&
+        (kite->breaker_probe_at + pk_state.socket_timeout_s > now))
+      return NULL;
+    kite->breaker_probe_at = now;
+    pkm_kite_breaker(pkm, kite, PK_BREAKER_HALF_OPEN);
+  }
+
+  for (i = 0; i < kite->backend_count; i++) {
+    b = kite->backends + i;
+    if (b->down_until <= now) b->rr_current += b->weight;
+  }
+  best->rr_current -= total;
+  return best;
+}
+
+static void pkm_kite_breaker(struct pk_manager* pkm,
+                             struct pk_pagekite* kite, int state)
+{
+  char info[PK_PROTOCOL_LENGTH + PK_DOMAIN_LENGTH + 64];
+
+  if (kite->breaker == state) return;
+  if ((state == PK_BREAKER_OPEN) && (kite->breaker == PK_BREAKER_CLOSED)) {
+    kite->breaker_trips++;
+    PKS_STATE(pk_state.backend_breaker_trips += 1);
+  }
+  if (state == PK_BREAKER_CLOSED) kite->breaker_probe_at = 0;
+  kite->breaker = state;
+
+  pk_log(PK_LOG_MANAGER_INFO, "%s://%s:%d: Backends %s (trips=%d)",
+         kite->protocol, kite->public_domain, kite->public_port,
+         (state == PK_BREAKER_CLOSED) ? "are back" :
+         (state == PK_BREAKER_OPEN) ? "are down, rejecting streams" :
+                                      "may be back, probing",
+         kite->breaker_trips);
+  sprintf(info, "%s:%s:%d %d", kite->protocol, kite->public_domain,
+                               kite->public_port, kite->breaker_trips);
+  pke_post_event(&(pkm->events), PK_EV_BACKEND_STATE, state, info);
+}
+
+static void pkm_backend_result(struct pk_manager* pkm,
+                               struct pk_pagekite* kite,
+                               struct pk_kite_backend* backend, int ok)
+{
+  /* Passive health checks: connections failing repeatedly put the
+   * backend on the sidelines for a bit. After that, a single failure
+   * is enough to send it back, until a connection succeeds again. */
+  kite->breaker_probe_at = 0;
+  if (ok) {
+    backend->failures = 0;
+    backend->down_until = 0;
+    pkm_kite_breaker(pkm, kite, PK_BREAKER_CLOSED);
+  }
+  else if (++backend->failures >= PK_BACKEND_FAILURES_MAX) {
+    backend->down_until = pk_time() + PK_BACKEND_DOWN_TIME;
+    pk_log(PK_LOG_MANAGER_INFO, "Backend %s:%d failed %d times, down for %ds",
+           backend->local_domain, backend->local_port,
+           backend->failures, PK_BACKEND_DOWN_TIME);
+  }
+}
+
+static void pkm_be_conn_release_backend(struct pk_backend_conn* pkb)
+{
+  if (pkb->backend != NULL) {
+    if (pkb->backend->active > 0) pkb->backend->active--;
+    pkb->backend = NULL;
+  }
+}
+
+static int pkm_be_conn_connected(struct pk_backend_conn* pkb)
+{
+  /* Called when a connecting socket becomes writable: returns 1 if the
+   * connection is up, 0 if we are still waiting, -1 if it failed. */
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (PKS_fail(PKS_getsockopt(pkb->conn.sockfd, SOL_SOCKET, SO_ERROR,
+                              (char *) &err, &errlen)))
+    err = errno;
+  if ((err == EINPROGRESS) || (err == EWOULDBLOCK) || (err == EINTR))
+    return 0;
+  if (err != 0) {
+    pkm_be_conn_connect_failed(pkb, err);
+    return -1;
+  }
+
+  pkb->conn.status &= ~CONN_STATUS_CONNECTING;
+  pkm_be_conn_connect_done(pkb);
+  pkm_be_conn_touch(pkb);
+  pkm_backend_result(pkb->manager, pkb->kite, pkb->backend, 1);
+  pk_log(PK_LOG_BE_CONNS, "%d: Connected to %s:%d (%d bytes queued)",
+         pkb->conn.sockfd, pkb->backend->local_domain,
+         pkb->backend->local_port, pkb->conn.out_buffer_pos);
+  return 1;
+}
+
+static void pkm_be_conn_connect_failed(struct pk_backend_conn* pkb, int err)
+{
+  struct pk_pagekite* kite = pkb->kite;
+
+  /* Anything the remote end sent us is lost, tell them the stream is
+   * rejected just like we would have if connect() had failed outright.
+   * The kite may be a wildcard, so we use what was actually requested. */
+  pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d (%s)",
+                              pkb->backend->local_domain,
+                              pkb->backend->local_port, strerror(err));
+  pkm_backend_result(pkb->manager, kite, pkb->backend, 0);
+  pkb->conn.status &= ~CONN_STATUS_CONNECTING;
+  pkc_discard_output(&(pkb->conn));
+  pkm_reject_stream(pkb->tunnel, pkb->sid,
+                    pkb->request_proto ? pkb->request_proto : kite->protocol,
+                    pkb->request_host ? pkb->request_host : kite->public_domain);
+  pkm_be_conn_connect_done(pkb);
+  pkb->conn.status |= (CONN_STATUS_END_READ | CONN_STATUS_END_WRITE |
+                       CONN_STATUS_CLS_READ | CONN_STATUS_CLS_WRITE);
+  pkm_update_io(pkb->tunnel, pkb, 0);
+}
+
 static ssize_t pkm_write_chunked(struct pk_tunnel* fe,
                                  struct pk_backend_conn* pkb,
                                  ssize_t length, char* data)
 {
-  ssize_t overhead = 0;
-  struct pk_conn* pkc = &(fe->conn);
+  char header[128];
+  struct iovec iov[2];
+  ssize_t skb, wrote;
 
   PK_TRACE_FUNCTION;
   /* FIXME: Better error handling */
 
-  /* Make sure there is space in our output buffer for the header. */
-  overhead = pk_reply_overhead(pkb->sid, length);
-  if (PKC_OUT_FREE(*pkc) < overhead)
-    if (0 > pkc_flush(pkc, NULL, 0, BLOCKING_FLUSH, "pkm_write_chunked"))
-      return -1;
+  /* Header and payload (and anything already queued) go out in a single
+   * gathered write, the payload is not copied unless the socket is full.
+   * Unreported progress for this stream rides along in the header. */
+  iov[0].iov_base = header;
+  if (0 < (skb = pkc_take_progress(&(pkb->conn)))) {
+    pkb->conn.status &= ~BE_STATUS_SKB_PENDING;
+    iov[0].iov_len = pk_format_reply_header_skb(header, pkb->sid_header,
+                                                pkb->sid_header_length,
+                                                skb, length);
+  }
+  else {
+    iov[0].iov_len = pk_format_reply_header(header, pkb->sid_header,
+                                            pkb->sid_header_length, length);
+  }
+  iov[1].iov_base = data;
+  iov[1].iov_len = length;
+  wrote = pkc_writev(&(fe->conn), iov, 2);
+  if ((0 < skb) && (0 < fe->conn.out_buffer_pos))
+    fe->conn.status |= CONN_STATUS_SKB_QUEUED;
+  return wrote;
+}
+
+/* Report what has been delivered to the backend. Anything short of a full
+ * increment waits a little, to ride along on data or go in a batch. */
+static void pkm_report_progress(struct pk_backend_conn* pkb)
+{
+  struct pk_manager* pkm = pkb->manager;
+
+  if (pkc_report_progress(&(pkb->conn), pkb->sid, &(pkb->tunnel->conn), 0)) {
+    pkb->conn.status |= BE_STATUS_SKB_PENDING;
+    if (!ev_is_active(&(pkm->skb_timer))) {
+      ev_timer_set(&(pkm->skb_timer), CONN_REPORT_DELAY_MS / 1000.0, 0.0);
+      ev_timer_start(pkm->loop, &(pkm->skb_timer));
+    }
+  }
+  else {
+    pkb->conn.status &= ~BE_STATUS_SKB_PENDING;
+  }
+}
 
-  /* Write the chunk header to the output buffer */
-  pkc->out_buffer_pos += pk_format_reply(PKC_OUT(*pkc), pkb->sid, length, NULL);
+static void pkm_watch_tunnel_output(struct pk_tunnel* fe, int recursion)
+{
+  struct pk_conn* pkc = &(fe->conn);
 
-  /* Write the data (will pick up the header automatically) */
-  return pkc_write(pkc, data, length);
+  /* Backend activity may have queued data on the tunnel, make sure it
+   * gets drained and throttle the backends if the queue is too deep. */
+  if ((0 > pkc->sockfd) || (pkc->status & CONN_STATUS_CLS_WRITE))
+    return;
+  if ((0 < pkc->out_buffer_pos) || (pkc->status & CONN_STATUS_WANT_WRITE) ||
+      (NULL != fe->ready.head))
+    ev_io_start(fe->manager->loop, &(pkc->watch_w));
+  if ((pkc->out_buffer_pos > CONN_OUT_QUEUE_HIGH_WATER) && !fe->output_blocked)
+    pkm_flow_control_tunnel(fe, CONN_TUNNEL_BLOCKED, recursion);
 }
 
 static int pkm_update_io(
@@ -415,13 +783,13 @@ static int pkm_update_io(
   struct pk_backend_conn* pkb,
   int recursion)
 {
-  int i;
   int bytes;
   int loglevel, loglevelclose;
   char buffer[1024];
   int eof = 0;
   int flows = 2;
   struct pk_conn* pkc;
+  struct pk_backend_conn* next;
   struct pk_manager* pkm = fe->manager;
   flow_op tunnel_flow_op = FLOW_OP_NONE;
 
@@ -442,17 +810,31 @@ static int pkm_update_io(
     loglevel = PK_LOG_TUNNEL_DATA;
     loglevelclose =  PK_LOG_TUNNEL_DATA | PK_LOG_MANAGER_INFO;
   }
+  pkc_release_buffers(pkc);  /* Idle conns should not hog memory */
   if (0 >= pkc->sockfd)
     return 0;
 
   if (pkb != NULL) {
-    pkc_report_progress(&(pkb->conn), pkb->sid, &(pkb->tunnel->conn));
+    pkm_report_progress(pkb);
     if (pkc->read_kb > pkc->sent_kb + pkc->send_window_kb)
       pkm_flow_control_conn(pkc, CONN_DEST_BLOCKED);
     else
       pkm_flow_control_conn(pkc, CONN_DEST_UNBLOCKED);
   }
 
+  if ((pkc->status & CONN_STATUS_CONNECTING) &&
+      !(pkc->status & (CONN_STATUS_CLS_READ|CONN_STATUS_CLS_WRITE)) &&
+      ((pkc->status & (CONN_STATUS_END_READ|CONN_STATUS_END_WRITE)) !=
+                      (CONN_STATUS_END_READ|CONN_STATUS_END_WRITE))) {
+    /* Nothing to do until connect() completes, just keep queueing. */
+    pk_log(loglevel, "%d: Connecting (%d bytes queued)",
+           pkc->sockfd, pkc->out_buffer_pos);
+    ev_io_stop(pkm->loop, &(pkc->watch_r));
+    ev_io_start(pkm->loop, &(pkc->watch_w));
+    pkm_watch_tunnel_output(fe, recursion);
+    return flows;
+  }
+
   if (pkc->status & (CONN_STATUS_CLS_READ|CONN_STATUS_END_READ)) {
     if (pkc->status & CONN_STATUS_END_READ) {
       /* They know, we know, we know they know... */
@@ -478,6 +860,11 @@ static int pkm_update_io(
     pk_log(loglevel, "%d: Throttled input.", pkc->sockfd);
     ev_io_stop(pkm->loop, &(pkc->watch_r));
   }
+  else if (pkc->status & BE_STATUS_SCHEDULED) {
+    /* The tunnel's scheduler will read this when it is our turn. */
+    pk_log(loglevel, "%d: Waiting for tunnel.", pkc->sockfd);
+    ev_io_stop(pkm->loop, &(pkc->watch_r));
+  }
   else {
     pk_log(loglevel, "%d: Watching for input.", pkc->sockfd);
     ev_io_start(pkm->loop, &(pkc->watch_r));
@@ -493,7 +880,7 @@ static int pkm_update_io(
       eof |= PK_EOF_WRITE;
     }
     pkc->status |= (CONN_STATUS_END_WRITE | CONN_STATUS_CLS_WRITE);
-    pkc->out_buffer_pos = 0;
+    pkc_discard_output(pkc);
     PKS_shutdown(pkc->sockfd, SHUT_WR);
     ev_io_stop(pkm->loop, &(pkc->watch_w));
     flows -= 1;
@@ -501,10 +888,18 @@ static int pkm_update_io(
   }
   else if ((0 < pkc->out_buffer_pos) ||
            (pkc->status & CONN_STATUS_WANT_WRITE)) {
-    /* Blocked: activate write listener */
+    /* Pending: activate write listener, throttle if we're falling behind */
     ev_io_start(pkm->loop, &(pkc->watch_w));
-    pk_log(loglevel, "%d: Blocked output!", pkc->sockfd);
-    if (NULL == pkb) tunnel_flow_op = CONN_TUNNEL_BLOCKED;
+    if (pkc->out_buffer_pos > CONN_OUT_QUEUE_HIGH_WATER) {
+      pk_log(loglevel, "%d: Blocked output! (%d bytes queued)",
+             pkc->sockfd, pkc->out_buffer_pos);
+      if (NULL == pkb) tunnel_flow_op = CONN_TUNNEL_BLOCKED;
+    }
+    else {
+      pk_log(loglevel, "%d: Output queued (%d bytes)",
+             pkc->sockfd, pkc->out_buffer_pos);
+      if (NULL == pkb) tunnel_flow_op = CONN_TUNNEL_UNBLOCKED;
+    }
   }
   else {
     if (pkc->status & CONN_STATUS_END_WRITE) {
@@ -518,7 +913,10 @@ static int pkm_update_io(
       pk_log(loglevel, "%d: Waiting for output.", pkc->sockfd);
       if (NULL == pkb) tunnel_flow_op = CONN_TUNNEL_UNBLOCKED;
     }
-    ev_io_stop(pkm->loop, &(pkc->watch_w));
+    if ((NULL == pkb) && (NULL != fe->ready.head))
+      ev_io_start(pkm->loop, &(pkc->watch_w));  /* Streams are waiting */
+    else
+      ev_io_stop(pkm->loop, &(pkc->watch_w));
   }
 
   if (eof) {
@@ -526,19 +924,21 @@ static int pkm_update_io(
       /* This is a backend conn, forcibly send EOF over tunnel. */
       bytes = pk_format_eof(buffer, pkb->sid, eof);
       pkc_write(&(fe->conn), buffer, bytes);
-      pkc_flush(&(fe->conn), NULL, 0, BLOCKING_FLUSH, "tunnel");
-      pk_log(loglevel, "%d: Sent and flushed EOF (0x%x)", pkc->sockfd, eof);
+      pk_log(loglevel, "%d: Sent EOF (0x%x)", pkc->sockfd, eof);
     }
     else {
-      /* This is a tunnel, send EOF to all backends, mark for reconnection. */
-      /* FIXME: This is O(n), but rare.  Maybe OK? */
+      /* This is a tunnel, send EOF to all backends, mark for reconnection.
+       * Updates may free more than the stream at hand, in which case we
+       * start over; streams we already got to are skipped. */
       pk_log(loglevel, "%d: Shutting down tunnel.", pkc->sockfd);
-      for (i = 0; i < pkm->be_conn_max; i++) {
-        pkb = (pkm->be_conns+i);
-        if ((pkb->tunnel == fe) && (pkb->conn.status != CONN_STATUS_UNKNOWN)) {
-          pkb->conn.status |= (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ);
-          pkm_update_io(fe, pkb, recursion);
-        }
+      for (pkb = fe->streams.head; pkb != NULL; pkb = next) {
+        next = pkb->tunnel_next;
+        if ((pkb->conn.status & (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ))
+            == (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ)) continue;
+        pkb->conn.status |= (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ);
+        pkm_update_io(fe, pkb, recursion);
+        if ((next != NULL) && !pkm_be_conn_on_tunnel(next))
+          next = fe->streams.head;
       }
       tunnel_flow_op = FLOW_OP_NONE;
       pkb = NULL;
@@ -560,6 +960,7 @@ static int pkm_update_io(
       PKS_STATE(pk_state.live_tunnels -= 1;
                 pkm->status = PK_STATUS_PROBLEMS);
       pkc_reset_conn(&(fe->conn), CONN_STATUS_ALLOCATED);
+      fe->output_blocked = 0;
       fe->request_count = 0;
       if (pk_state.live_tunnels < 1) {
         pkm->next_tick = 1 + pkm->housekeeping_interval_min;
@@ -572,50 +973,64 @@ static int pkm_update_io(
     pkm_flow_control_tunnel(fe, tunnel_flow_op, recursion);
   }
 
+  if (pkc != &(fe->conn))
+    pkm_watch_tunnel_output(fe, recursion);
+
   pkm_yield(pkm);
   return flows;
 }
 
 static void pkm_flow_control_tunnel(struct pk_tunnel* fe, flow_op op, int rec)
 {
-  int i;
   struct pk_backend_conn* pkb;
-  struct pk_manager* pkm = fe->manager;
+  struct pk_backend_conn* next;
 
   PK_TRACE_FUNCTION;
 
-  /* FIXME: This is inefficient.
-   *   1) we should only evaluate tunnels that are blocked / not blocked
-   *   2) we should only evaluate backends linked to this tunnel
-   */
-
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + i);
-    unsigned int old_status = pkb->conn.status;
-    if ((pkb->tunnel == fe) && (pkb->conn.sockfd >= 0)) {
-      if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
-        if (op == CONN_TUNNEL_UNBLOCKED) {
-          pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel unblocked.", pkb->conn.sockfd);
-          pkb->conn.status &= ~CONN_STATUS_TNL_BLOCKED;
-        }
-      }
-      else if (op == CONN_TUNNEL_BLOCKED) {
-        pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel blocked.", pkb->conn.sockfd);
-        pkb->conn.status |= CONN_STATUS_TNL_BLOCKED;
-      }
-    }
-    if (old_status != pkb->conn.status) {
-      if (op == CONN_TUNNEL_BLOCKED) {
-        /* Oops, writing too fast! Reduce window size by about a third */
-        pkb->conn.send_window_kb -= (1 + pkb->conn.send_window_kb / 3);
-        if (pkb->conn.send_window_kb < CONN_WINDOW_SIZE_KB_MINIMUM)
-          pkb->conn.send_window_kb = CONN_WINDOW_SIZE_KB_MINIMUM;
-      }
+  /* Only evaluate the backends if the tunnel state actually changed. */
+  if ((op == CONN_TUNNEL_BLOCKED) == (fe->output_blocked != 0))
+    return;
+  fe->output_blocked = (op == CONN_TUNNEL_BLOCKED);
+
+  /* Only this tunnel's streams are visited. Updating one may recurse and
+   * change the tunnel state again, or free other streams; so unblocking
+   * drains the throttled list and blocking starts over if the stream it
+   * was about to visit went away. */
+  if (op == CONN_TUNNEL_UNBLOCKED) {
+    while (!fe->output_blocked && (NULL != (pkb = fe->throttled.head))) {
+      pkm_be_conn_unthrottle(pkb);
+      pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel unblocked.", pkb->conn.sockfd);
+      pkb->conn.status &= ~CONN_STATUS_TNL_BLOCKED;
       pkm_update_io(fe, pkb, rec);
     }
+    return;
+  }
+
+  for (pkb = fe->streams.head; fe->output_blocked && (pkb != NULL); pkb = next) {
+    next = pkb->tunnel_next;
+    if ((pkb->conn.sockfd < 0) || (pkb->conn.status & CONN_STATUS_TNL_BLOCKED))
+      continue;
+
+    pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel blocked.", pkb->conn.sockfd);
+    pkb->conn.status |= CONN_STATUS_TNL_BLOCKED;
+    pkm_be_conn_throttle(pkb);
+
+    pkm_window_update(pkb, CONN_TUNNEL_BLOCKED, 0);
+
+    pkm_update_io(fe, pkb, rec);
+    if ((next != NULL) && !pkm_be_conn_on_tunnel(next))
+      next = fe->streams.head;
   }
 }
 
+static void pkm_window_update(struct pk_backend_conn* pkb, flow_op op,
+                              size_t kb)
+{
+  struct pk_manager* pkm = pkb->manager;
+  pkc_window_update(&(pkb->conn), pkm->flow_control, pkm->flow_window_max_kb,
+                    op, kb, pk_time_ms());
+}
+
 static void pkm_flow_control_conn(struct pk_conn* pkc, flow_op op)
 {
   PK_TRACE_FUNCTION;
@@ -666,34 +1081,41 @@ static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof)
 
 static void pkm_tunnel_readable_cb(EV_P_ ev_io *w, int revents)
 {
-  int rv, read_bytes;
+  int rv, read_bytes, space, total;
+  char* buffer;
   struct pk_tunnel* fe = (struct pk_tunnel*) w->data;
   PK_TRACE_FUNCTION;
 
   fe->conn.status &= ~CONN_STATUS_WANT_READ;
+  total = 0;
   do {
-    if (0 < (read_bytes = pkc_read(&(fe->conn)))) {
-      if (0 > (rv = pk_parser_parse(fe->parser,
-                                    fe->conn.in_buffer_pos,
-                                    (char *) fe->conn.in_buffer)))
-      {
-        /* Parse failed: remote is borked: should kill this conn. */
-        fe->conn.status |= CONN_STATUS_BROKEN;
-        pk_log(PK_LOG_TUNNEL_HEADERS,
-               "pkm_tunnel_readable_cb(): parse error = %d", rv);
-        pk_dump_state(fe->manager);
-        if (pk_state.log_mask & PK_LOG_TUNNEL_DATA) {
-          int bytes = fe->conn.in_buffer_pos;
-          pk_log_raw_data(PK_LOG_TUNNEL_DATA, "data",
-                          fe->conn.sockfd, fe->conn.in_buffer, bytes);
-        }
+    /* Read straight into the parser's free space, parse it in place. */
+    rv = read_bytes = 0;
+    if (NULL == (buffer = pk_parser_buffer(fe->parser, &space))) {
+      rv = pk_error;
+    }
+    else if (0 < (read_bytes = pkc_read_into(&(fe->conn), buffer, space))) {
+      total += read_bytes;
+      rv = pk_parser_parse_in_place(fe->parser, read_bytes);
+    }
+    if (0 > rv) {
+      /* Parse failed: remote is borked: should kill this conn. */
+      fe->conn.status |= CONN_STATUS_BROKEN;
+      pk_log(PK_LOG_TUNNEL_HEADERS,
+             "pkm_tunnel_readable_cb(): parse error = %d", rv);
+      pk_dump_state(fe->manager);
+      if ((pk_state.log_mask & PK_LOG_TUNNEL_DATA) && (read_bytes > 0)) {
+        pk_log_raw_data(PK_LOG_TUNNEL_DATA, "data",
+                        fe->conn.sockfd, buffer, read_bytes);
       }
+      break;
     }
-    /* pk_parser_parse always processes the entire buffer. */
-    fe->conn.in_buffer_pos = 0;
 
-  /* Keep processing while OpenSSL has more data buffered and waiting */
-  } while ((read_bytes > 0) && (pkc_pending(&(fe->conn)) > 0));
+  /* Keep processing while OpenSSL has more data buffered and waiting, or
+   * the parser's space filled up and the socket probably has more. */
+  } while ((read_bytes > 0) &&
+           ((pkc_pending(&(fe->conn)) > 0) ||
+            ((read_bytes == space) && (total < CONN_IO_BUFFER_SIZE))));
 
   PK_CHECK_MEMORY_CANARIES;
   pkm_update_io(fe, NULL, 0);
@@ -715,35 +1137,94 @@ static void pkm_tunnel_writable_cb(EV_P_ ev_io* w, int revents)
   pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "tunnel");
   PK_CHECK_MEMORY_CANARIES;
 
+  pkm_schedule_tunnel(fe);
   pkm_update_io(fe, NULL, 0);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
 }
 
+static ssize_t pkm_be_conn_read(struct pk_backend_conn* pkb)
+{
+  ssize_t bytes;
+
+  pkb->conn.status &= ~CONN_STATUS_WANT_READ;
+  bytes = pkc_read(&(pkb->conn));
+  if (0 < bytes) pkm_be_conn_touch(pkb);
+  if ((0 < bytes) &&
+      (0 <= pkm_write_chunked(pkb->tunnel, pkb,
+                              pkb->conn.in_buffer_pos,
+                              pkb->conn.in_buffer))) {
+    pkb->conn.in_buffer_pos = 0;
+    pk_log(PK_LOG_BE_DATA, ">%5.5s> DATA: %d bytes", pkb->sid, bytes);
+  }
+  else if (bytes == 0) {
+    pk_log(PK_LOG_BE_DATA, ">%5.5s> EOF: read", pkb->sid);
+  }
+  return bytes;
+}
+
+/* Deficit round robin: while the tunnel has room, the stream at the head
+ * of the ready list reads until it has used up its quantum (times the
+ * kite's weight), then goes to the back of the line. A read may overdraw
+ * the deficit by up to one buffer, the overdraft is paid back next round.
+ * Streams which read less than a full buffer are drained and leave the
+ * list, their socket watcher takes over again. */
+static void pkm_schedule_tunnel(struct pk_tunnel* fe)
+{
+  struct pk_backend_conn* pkb;
+  ssize_t bytes;
+  int weight, deficit;
+
+  PK_TRACE_FUNCTION;
+
+  while ((NULL != (pkb = fe->ready.head)) &&
+         !fe->output_blocked &&
+         (fe->conn.out_buffer_pos < PK_SCHED_TUNNEL_BUSY)) {
+    if (pkb->conn.status & CONN_STATUS_BLOCKED) {
+      pkm_be_conn_unready(pkb);
+      pkm_update_io(fe, pkb, 0);
+      continue;
+    }
+    if (pkb->deficit <= 0) {
+      weight = (pkb->kite != NULL) ? pkb->kite->weight : 1;
+      if (weight < 1) weight = 1;
+      if (weight > PK_SCHED_WEIGHT_MAX) weight = PK_SCHED_WEIGHT_MAX;
+      pkb->deficit += PK_SCHED_QUANTUM * weight;
+    }
+
+    bytes = pkm_be_conn_read(pkb);
+    if (bytes < CONN_IO_BUFFER_SIZE) {
+      pkm_be_conn_unready(pkb);
+      pkm_update_io(fe, pkb, 0);
+    }
+    else if (0 >= (pkb->deficit -= bytes)) {
+      deficit = pkb->deficit;
+      pkm_be_conn_unready(pkb);
+      pkm_be_conn_ready(pkb);
+      pkb->deficit = deficit;
+    }
+  }
+}
+
 static void pkm_be_conn_readable_cb(EV_P_ ev_io* w, int revents)
 {
   struct pk_backend_conn* pkb = (struct pk_backend_conn*) w->data;
-  size_t bytes;
+  struct pk_tunnel* fe = pkb->tunnel;
 
   PK_TRACE_FUNCTION;
 
   if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
     pk_log(PK_LOG_BE_DATA, ">%5.5s> BLOCKED: Tunnel is blocked.", pkb->sid);
   }
+  else if ((NULL != fe->ready.head) ||
+           (fe->conn.out_buffer_pos >= PK_SCHED_TUNNEL_BUSY)) {
+    /* The tunnel is busy, wait in line so everyone gets a fair share. */
+    pk_log(PK_LOG_BE_DATA, ">%5.5s> WAIT: Tunnel is busy.", pkb->sid);
+    pkm_be_conn_ready(pkb);
+  }
   else {
-    pkb->conn.status &= ~CONN_STATUS_WANT_READ;
-    bytes = pkc_read(&(pkb->conn));
-    if ((0 < bytes) &&
-        (0 <= pkm_write_chunked(pkb->tunnel, pkb,
-                                pkb->conn.in_buffer_pos,
-                                pkb->conn.in_buffer))) {
-      pkb->conn.in_buffer_pos = 0;
-      pk_log(PK_LOG_BE_DATA, ">%5.5s> DATA: %d bytes", pkb->sid, bytes);
-    }
-    else if (bytes == 0) {
-      pk_log(PK_LOG_BE_DATA, ">%5.5s> EOF: read", pkb->sid);
-    }
+    pkm_be_conn_read(pkb);
   }
 
   PK_CHECK_MEMORY_CANARIES;
@@ -759,6 +1240,13 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
 
   PK_TRACE_FUNCTION;
 
+  if ((pkb->conn.status & CONN_STATUS_CONNECTING) &&
+      (1 != pkm_be_conn_connected(pkb))) {
+    /* Still waiting, or failed and cleaned up already. */
+    PK_CHECK_MEMORY_CANARIES;
+    return;
+  }
+
   /* This is necessary for SSL handshakes and the like. */
   if (pkb->conn.status & CONN_STATUS_WANT_WRITE) {
     pkb->conn.status &= ~CONN_STATUS_WANT_WRITE;
@@ -770,11 +1258,11 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
   if (pkb->conn.out_buffer_pos == 0)
   {
     pk_log(PK_LOG_BE_DATA, "Flushed: %s:%d (done)",
-           pkb->kite->local_domain, pkb->kite->local_port);
+           pkb->backend->local_domain, pkb->backend->local_port);
   }
   else {
     pk_log(PK_LOG_BE_DATA, "Flushed: %s:%d\n",
-           pkb->kite->local_domain, pkb->kite->local_port);
+           pkb->backend->local_domain, pkb->backend->local_port);
   }
   PK_CHECK_MEMORY_CANARIES;
   pkm_update_io(pkb->tunnel, pkb, 0);
@@ -918,6 +1406,9 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
         fe->conn.watch_r.data = fe->conn.watch_w.data = (void *) fe;
         ev_io_start(pkm->loop, &(fe->conn.watch_r));
 
+        /* Small frames get batched up, see pkm_flush_cb. */
+        fe->conn.status |= CONN_STATUS_CORKED;
+
         PKS_STATE(pk_state.live_tunnels += 1);
         fe->conn.status &= ~CONN_STATUS_CHANGING;  /* Change complete */
         fe->error_count = 0;
@@ -962,7 +1453,7 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
   struct pk_backend_conn* pkb;
   char buffer[1025];
   unsigned int status;
-  int i, j, pass, disconnect, disconnected, live, ping_window;
+  int i, pass, disconnect, disconnected, live, ping_window;
 
   PK_TRACE_FUNCTION;
   ping_window = pk_time() - 4*pkm->housekeeping_interval_min;
@@ -1004,9 +1495,8 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
 
       /* Check if there are any live streams... */
       disconnect++;
-      for (j = 0; j < pkm->be_conn_max; j++) {
-        pkb = (pkm->be_conns + j);
-        if (pkb->conn.sockfd > 0 && pkb->tunnel == fe) {
+      for (pkb = fe->streams.head; pkb != NULL; pkb = pkb->tunnel_next) {
+        if (pkb->conn.sockfd > 0) {
           disconnect--;
           break;
         }
@@ -1047,8 +1537,10 @@ void pkm_tick(struct pk_manager* pkm)
 }
 static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
 {
-  int i, pingsize;
+  int pingsize;
   char ping[PK_REJECT_MAXSIZE];
+  struct pk_backend_conn* pkb;
+  struct pk_backend_conn* next;
   struct pk_manager* pkm = (struct pk_manager*) w->data;
   time_t64 next_tick = pkm->next_tick;
   time_t64 max_tick;
@@ -1120,7 +1612,8 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
         else if (fe->conn.activity < inactive) {
           if (pingsize == 0) pingsize = pk_format_ping(ping);
           fe->last_ping = now;
-          pkc_write(&(fe->conn), ping, pingsize);
+          pkc_write_control(&(fe->conn), ping, pingsize);
+          pkm_watch_tunnel_output(fe, 0);
           pk_log(PK_LOG_TUNNEL_DATA,
               "%d: Sent PING (idle=%llds>%llds)",
               fe->conn.sockfd, (now - fe->conn.activity), (now - inactive));
@@ -1130,6 +1623,15 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
     }
     pkm_reconfig_stop(pkm);
   }
+
+  /* Give up on backends which have taken too long to accept a connection. */
+  for (pkb = pkm->be_conn_connecting.head; pkb != NULL; pkb = next) {
+    next = pkb->connecting_next;
+    if (pkb->conn.activity < now - pk_state.socket_timeout_s) {
+      pkm_be_conn_connect_failed(pkb, ETIMEDOUT);
+    }
+  }
+  pkm_be_conn_table_shrink(pkm);
   pkm_yield_start(pkm);
 
   /* Finally, trigger the tunnel check on the blocking thread. */
@@ -1153,6 +1655,51 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
   (void) revents;
 }
 
+/* Frames written to corked tunnels while handling this round of events
+ * were queued, send them off together before the loop waits again. This
+ * saves syscalls, and on TLS tunnels sends one record instead of many. */
+static void pkm_flush_cb(EV_P_ ev_prepare* w, int revents)
+{
+  struct pk_manager* pkm = (struct pk_manager*) w->data;
+
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((0 <= fe->conn.sockfd) &&
+        (0 < fe->conn.out_buffer_pos) &&
+        (fe->conn.status & CONN_STATUS_CORKED) &&
+        !(fe->conn.status & (CONN_STATUS_CHANGING|CONN_STATUS_CLS_WRITE))) {
+      pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "corked");
+      pkm_update_io(fe, NULL, 0);
+    }
+  }
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
+/* Send whatever progress reports were left waiting, all tunnels' worth
+ * at once. Corked tunnels send theirs in one go, see pkm_flush_cb. */
+static void pkm_skb_timer_cb(EV_P_ ev_timer* w, int revents)
+{
+  struct pk_manager* pkm = (struct pk_manager*) w->data;
+  struct pk_backend_conn* pkb;
+
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((0 > fe->conn.sockfd) ||
+        (fe->conn.status & (CONN_STATUS_CHANGING|CONN_STATUS_CLS_WRITE)))
+      continue;
+    for (pkb = fe->streams.head; pkb != NULL; pkb = pkb->tunnel_next) {
+      if (pkb->conn.status & BE_STATUS_SKB_PENDING) {
+        pkb->conn.status &= ~BE_STATUS_SKB_PENDING;
+        pkc_report_progress(&(pkb->conn), pkb->sid, &(fe->conn), 1);
+      }
+    }
+    pkm_watch_tunnel_output(fe, 0);
+  }
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
 static void pkm_timer_cb(EV_P_ ev_timer* w, int revents)
 {
   struct pk_manager* pkm = (struct pk_manager*) w->data;
@@ -1176,14 +1723,29 @@ void pkm_set_timer_enabled(struct pk_manager* pkm, int enabled) {
   pkm_unblock(pkm);
 }
 
+void pkm_set_elastic_conns(struct pk_manager* pkm, int max_conns)
+{
+  int ceiling;
+  pkm_block(pkm);
+  ceiling = pkm->be_conn_base + PK_BE_CONN_SEGMENT * PK_BE_CONN_SEGMENTS_MAX;
+  if (max_conns > ceiling) max_conns = ceiling;
+  if (max_conns < pkm->be_conn_max) max_conns = pkm->be_conn_max;
+  pkm->be_conn_limit = max_conns;
+  pkm_unblock(pkm);
+}
+
 static void pkm_reset_manager(struct pk_manager* pkm) {
   struct pk_conn* pkc;
+  struct pk_backend_conn* pkb;
 
   PK_TRACE_FUNCTION;
 
   PK_KITE_ITER(pkm, kite) {
+    for (int i = 0; i < kite->backend_count; i++)
+      pkm_be_pool_flush(kite->backends + i);
     pk_reset_pagekite(kite);
   }
+  pkm_kite_index_reset(pkm);
   PK_TUNNEL_ITER(pkm, fe) {
     pkc = &(fe->conn);
     if (pkc->status != CONN_STATUS_UNKNOWN) {
@@ -1194,15 +1756,95 @@ static void pkm_reset_manager(struct pk_manager* pkm) {
     }
   }
   for (int i = 0; i < pkm->be_conn_max; i++) {
-    pkc = &((pkm->be_conns+i)->conn);
+    pkb = pkm_be_conn_at(pkm, i);
+    pkc = &(pkb->conn);
     if (pkc->status != CONN_STATUS_UNKNOWN) {
+      pkm_be_conn_connect_done(pkb);
       ev_io_stop(pkm->loop, &(pkc->watch_r));
       ev_io_stop(pkm->loop, &(pkc->watch_w));
       pkc->status = 0;  /* Avoid bogus change detection in reset_conn */
       pkc_reset_conn(pkc, 0);
     }
+    pkb->backend = NULL;
   }
+  pkm_be_conn_index_reset(pkm);
+  pkm_be_conn_lists_reset(pkm);
   ev_async_stop(pkm->loop, &(pkm->quit));
+  ev_prepare_stop(pkm->loop, &(pkm->flush));
+  ev_timer_stop(pkm->loop, &(pkm->skb_timer));
+}
+
+static unsigned int pkm_kite_hash(const char* protocol,
+                                  const char* domain, int port)
+{
+  /* FNV-1a over the lower-cased names; kite names are case-insensitive. */
+  unsigned int h = 2166136261u;
+  const unsigned char* p;
+  for (p = (const unsigned char*) protocol; *p; p++)
+    h = (h ^ tolower(*p)) * 16777619u;
+  h = (h ^ ':') * 16777619u;
+  for (p = (const unsigned char*) domain; *p; p++)
+    h = (h ^ tolower(*p)) * 16777619u;
+  return (h ^ (unsigned int) ((port > 0) ? port : 0)) * 16777619u;
+}
+
+static void pkm_kite_index_reset(struct pk_manager* pkm)
+{
+  /* Clear the index and put every unused kite on the free list, lowest
+   * slot first. */
+  memset(pkm->kite_index, 0,
+         sizeof(struct pk_pagekite*) * (pkm->kite_index_mask + 1));
+  pkm->kite_free = NULL;
+  pkm->kite_wildcards = 0;
+  for (int i = pkm->kite_max - 1; i >= 0; i--) {
+    struct pk_pagekite* kite = pkm->kites + i;
+    if (kite->protocol[0] == '\0') {
+      kite->next_free = pkm->kite_free;
+      pkm->kite_free = kite;
+    }
+    else {
+      pkm_kite_index_add(pkm, kite);
+    }
+  }
+}
+
+static void pkm_kite_index_add(struct pk_manager* pkm,
+                               struct pk_pagekite* kite)
+{
+  /* The index has at least twice as many slots as there are kites, so
+   * there is always an empty one. */
+  unsigned int i, mask;
+
+  mask = pkm->kite_index_mask;
+  i = pkm_kite_hash(kite->protocol, kite->public_domain,
+                    kite->public_port) & mask;
+  while (pkm->kite_index[i] != NULL) i = (i + 1) & mask;
+  pkm->kite_index[i] = kite;
+
+  if (0 == strncmp(kite->public_domain, "*.", 2)) pkm->kite_wildcards++;
+}
+
+static struct pk_pagekite* pkm_kite_index_find(struct pk_manager* pkm,
+                                               const char* protocol,
+                                               const char* domain,
+                                               int port)
+{
+  /* Exact matches only; ports of zero or less all mean "any port". */
+  unsigned int i, mask;
+  struct pk_pagekite* kite;
+
+  if (port < 0) port = 0;
+  mask = pkm->kite_index_mask;
+  i = pkm_kite_hash(protocol, domain, port) & mask;
+  while (NULL != (kite = pkm->kite_index[i])) {
+    if ((((kite->public_port > 0) ? kite->public_port : 0) == port) &&
+        (0 == strcasecmp(domain, kite->public_domain)) &&
+        (0 == strcasecmp(protocol, kite->protocol))) {
+      return kite;
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
 }
 
 static struct pk_pagekite* pkm_find_kite(struct pk_manager* pkm,
@@ -1210,75 +1852,451 @@ static struct pk_pagekite* pkm_find_kite(struct pk_manager* pkm,
                                          const char* domain,
                                          int port)
 {
+  char wildcard[PK_DOMAIN_LENGTH+2];
+  const char* dot;
   struct pk_pagekite* found;
 
   PK_TRACE_FUNCTION;
 
-  /* NOTE: This is O(N), which we deem OK since backends should rarely
-   *       have a huge number of kites configured. */
-  found = NULL;
-  PK_KITE_ITER(pkm, kite) {
-    if (kite->protocol[0] != '\0') {
-      if ((0 == strcasecmp(domain, kite->public_domain)) &&
-          (0 == strcasecmp(protocol, kite->protocol))) {
-        if (kite->public_port <= 0)
-          found = kite;
-        else if (kite->public_port == port)
-          return kite;
-      }
-    }
+  /* Kites on the requested port win over kites listening on any port,
+   * and the most specific wildcard kite (*.domain) is the last resort. */
+  if ((NULL != (found = pkm_kite_index_find(pkm, protocol, domain, port))) ||
+      (NULL != (found = pkm_kite_index_find(pkm, protocol, domain, 0))) ||
+      (0 == pkm->kite_wildcards))
+    return found;
+
+  for (dot = strchr(domain, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+    if (strlen(dot) > PK_DOMAIN_LENGTH) continue;
+    sprintf(wildcard, "*%s", dot);
+    if ((NULL != (found = pkm_kite_index_find(pkm, protocol, wildcard, port))) ||
+        (NULL != (found = pkm_kite_index_find(pkm, protocol, wildcard, 0))))
+      return found;
   }
-  return found;
+  return NULL;
 }
 
-struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
-                                 const char* protocol,
-                                 const char* public_domain, int public_port,
-                                 const char* auth_secret,
-                                 const char* local_domain, int local_port)
+static socklen_t pkm_unix_backend_addr(const char* backend,
+                                       struct sockaddr_storage* addr)
 {
-  char *pp;
-  int which = 0;
-  struct pk_pagekite* kite = NULL;
+  /* Parse "unix:/path/to/socket" or "unix:@name" (abstract) into addr.
+   * Returns the length of the address, or 0 if the path is unusable. */
+#ifdef HAVE_AF_UNIX
+  struct sockaddr_un* sun = (struct sockaddr_un*) addr;
+  socklen_t base = sizeof(struct sockaddr_un) - sizeof(sun->sun_path);
+  const char* path = backend + strlen(PK_BACKEND_UNIX);
+  size_t len = strlen(path);
+
+  if ((len < 2) || (len >= sizeof(sun->sun_path))) return 0;
+  memset(sun, 0, sizeof(struct sockaddr_un));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, path, len);
+  if (path[0] == '@') {
+    /* Abstract names are not NUL terminated, the length is what counts. */
+    sun->sun_path[0] = '\0';
+    return base + len;
+  }
+  return base + len + 1;
+#else
+  (void) backend;
+  (void) addr;
+  return 0;
+#endif
+}
 
-  PK_TRACE_FUNCTION;
+int pkm_resolve_backend(struct pk_manager* pkm,
+                        struct pk_kite_backend* backend)
+{
+  /* This blocks, so it must only be called from the blocker threads. */
+  int rv;
+  char port[16];
+  const char* error;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct addrinfo hints;
+  struct addrinfo *result, *rp, *best;
 
-  if ((strcasecmp(protocol, "raw") == 0) && (public_port < 1))
-    return pk_err_null(ERR_RAW_NEEDS_PUBPORT);
+  PK_TRACE_FUNCTION;
 
-  /* FIXME: This is O(N), we'll need a nicer data structure for tunnels */
-  PK_KITE_ITER(pkm, k) {
-    which++;
-    if (k->protocol[0] == '\0') {
-      kite = k;
-      break;
-    }
+  rv = 0;
+  addrlen = 0;
+  error = "No usable address";
+  best = result = NULL;
+  if (0 == strncasecmp(backend->local_domain, PK_BACKEND_UNIX,
+                       strlen(PK_BACKEND_UNIX))) {
+    /* Unix domain sockets need no lookups. */
+    addrlen = pkm_unix_backend_addr(backend->local_domain, &addr);
+    if (0 == addrlen) error = "Invalid Unix socket path";
+  }
+  else {
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port, "%d", backend->local_port);
+
+    /* IPv4 addresses are preferred, as that is all we ever used before
+     * and many local services only listen on 127.0.0.1. */
+    if (0 == (rv = getaddrinfo(backend->local_domain, port,
+                               &hints, &result))) {
+      for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if ((rp->ai_family == AF_INET) ||
+            ((rp->ai_family == AF_INET6) && (best == NULL))) best = rp;
+        if ((best != NULL) && (best->ai_family == AF_INET)) break;
+      }
+    }
+    else {
+      error = gai_strerror(rv);
+    }
+    if (best != NULL) {
+      memcpy(&addr, best->ai_addr, best->ai_addrlen);
+      addrlen = best->ai_addrlen;
+    }
+    if (result != NULL)
+      freeaddrinfo(result);
+  }
+
+  pkm_block(pkm);
+  if (addrlen > 0) {
+    /* Pooled connections to an old address are no good. */
+    if ((backend->local_addrlen != addrlen) ||
+        (0 != memcmp(&(backend->local_addr), &addr, addrlen)))
+      pkm_be_pool_flush(backend);
+    memcpy(&(backend->local_addr), &addr, addrlen);
+    backend->local_addrlen = addrlen;
+    backend->local_addr_expires = pk_time() + PK_BACKEND_DNS_TTL;
+  }
+  else {
+    /* Temporary failures keep the old address (if any) for a bit. */
+    if (rv != EAI_AGAIN) backend->local_addrlen = 0;
+    backend->local_addr_expires = pk_time() + PK_BACKEND_DNS_NEGATIVE_TTL;
+  }
+  pkm_unblock(pkm);
+
+  if (addrlen == 0)
+    pk_log(PK_LOG_MANAGER_ERROR, "pkm_resolve_backend: %s: %s",
+           backend->local_domain, error);
+
+  PK_CHECK_MEMORY_CANARIES;
+  return (addrlen == 0) ? -1 : 0;
+}
+
+static void pkm_be_pool_flush(struct pk_kite_backend* backend)
+{
+  while (backend->pool_size > 0)
+    PKS_close(backend->pool_fds[--backend->pool_size]);
+}
+
+static int pkm_be_pool_alive(int sockfd)
+{
+  /* Backends closing idle connections is how pooled sockets usually die,
+   * which a non-blocking peek will reveal. Pending data is fine, some
+   * protocols have the server speak first. */
+  char c;
+  ssize_t rv = PKS_peek(sockfd, &c, 1);
+  return ((rv > 0) ||
+          ((rv < 0) &&
+           ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))));
+}
+
+static int pkm_be_pool_take(struct pk_manager* pkm,
+                            struct pk_kite_backend* backend)
+{
+  /* Hand out the newest live pooled socket, or -1 if there are none. */
+  int sockfd;
+  time_t64 too_old = pk_time() - pkm->be_pool_idle_s;
+
+  while (backend->pool_size > 0) {
+    sockfd = backend->pool_fds[--backend->pool_size];
+    if ((backend->pool_since[backend->pool_size] >= too_old) &&
+        pkm_be_pool_alive(sockfd)) {
+      backend->pool_taken++;
+      pk_log(PK_LOG_BE_CONNS, "%d: Using pooled connection to %s:%d",
+             sockfd, backend->local_domain, backend->local_port);
+      return sockfd;
+    }
+    PKS_close(sockfd);
+  }
+  return -1;
+}
+
+static int pkm_be_connect_blocking(struct sockaddr_storage* addr,
+                                   socklen_t addrlen)
+{
+  /* Connect, waiting at most socket_timeout_s, for use on the blocker
+   * threads. Returns a non-blocking socket, or -1 on failure. */
+  int sockfd = -1;
+  struct timeval to;
+  to.tv_sec = pk_state.socket_timeout_s;
+  to.tv_usec = 0;
+  if ((0 == addrlen) ||
+      (0 > (sockfd = PKS_socket(addr->ss_family, SOCK_STREAM, 0))) ||
+      PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &to, sizeof(to))) ||
+      PKS_fail(PKS_setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &to, sizeof(to))) ||
+      PKS_fail(PKS_connect(sockfd, (struct sockaddr*) addr, addrlen)) ||
+      (0 > set_non_blocking(sockfd)))
+  {
+    if (sockfd > -1) PKS_close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+int pkm_be_pool_fill(struct pk_manager* pkm, struct pk_kite_backend* backend)
+{
+  /* This blocks, so it must only be called from the blocker threads.
+   *
+   * Idle or dead sockets are closed, then the pool is topped up: to
+   * be_pool_min, or to however many were used since the last refill if
+   * that is more, but never past be_pool_max. */
+  int i, j, k, sockfd, want, added, probed;
+  int fds[PK_BACKEND_POOL_MAX];
+  unsigned int gens[PK_BACKEND_POOL_MAX];
+  int dead[PK_BACKEND_POOL_MAX];
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  time_t64 too_old;
+
+  PK_TRACE_FUNCTION;
+
+  /* Probing is a syscall per socket, so it happens on a copy of the pool
+   * without holding the lock. Sockets taken meanwhile are just skipped;
+   * the generation tells a recycled fd number apart from the one probed. */
+  pkm_block(pkm);
+  probed = backend->pool_size;
+  memcpy(fds, backend->pool_fds, probed * sizeof(int));
+  memcpy(gens, backend->pool_gen, probed * sizeof(unsigned int));
+  pkm_unblock(pkm);
+  for (k = 0; k < probed; k++) dead[k] = !pkm_be_pool_alive(fds[k]);
+
+  pkm_block(pkm);
+  too_old = pk_time() - pkm->be_pool_idle_s;
+  for (i = j = 0; i < backend->pool_size; i++) {
+    for (k = 0; k < probed; k++) {
+      if ((fds[k] == backend->pool_fds[i]) &&
+          (gens[k] == backend->pool_gen[i])) break;
+    }
+    if ((i >= backend->pool_size - pkm->be_pool_max) &&
+        (backend->pool_since[i] >= too_old) &&
+        ((k == probed) || !dead[k])) {
+      backend->pool_fds[j] = backend->pool_fds[i];
+      backend->pool_gen[j] = backend->pool_gen[i];
+      backend->pool_since[j++] = backend->pool_since[i];
+    }
+    else {
+      PKS_close(backend->pool_fds[i]);
+    }
+  }
+  backend->pool_size = j;
+  want = (backend->pool_taken > pkm->be_pool_min) ? backend->pool_taken
+                                                   : pkm->be_pool_min;
+  if (want > pkm->be_pool_max) want = pkm->be_pool_max;
+  want -= backend->pool_size;
+  backend->pool_taken = 0;
+  addrlen = backend->local_addrlen;
+  memcpy(&addr, &(backend->local_addr), addrlen);
+  pkm_unblock(pkm);
+
+  for (added = 0; added < want; added++) {
+    if (0 > (sockfd = pkm_be_connect_blocking(&addr, addrlen))) {
+      pk_log(PK_LOG_BE_CONNS, "pkm_be_pool_fill: Failed to connect %s:%d",
+                              backend->local_domain, backend->local_port);
+      break;
+    }
+
+    pkm_block(pkm);
+    if ((backend->pool_size < pkm->be_pool_max) &&
+        (backend->pool_size < PK_BACKEND_POOL_MAX)) {
+      backend->pool_fds[backend->pool_size] = sockfd;
+      backend->pool_gen[backend->pool_size] = backend->pool_next_gen++;
+      backend->pool_since[backend->pool_size++] = pk_time();
+      sockfd = -1;
+    }
+    pkm_unblock(pkm);
+    if (sockfd > -1) {
+      PKS_close(sockfd);
+      break;
+    }
   }
-  if (which >= pkm->kite_max)
-    return pk_err_null(ERR_NO_MORE_KITES);
 
-  if (kite == NULL)
-    return pk_err_null(ERR_NO_KITE);
+  if (added > 0)
+    pk_log(PK_LOG_BE_CONNS, "Pooled %d connections to %s:%d (%d idle)",
+           added, backend->local_domain, backend->local_port,
+           backend->pool_size);
+  PK_CHECK_MEMORY_CANARIES;
+  return added;
+}
+
+int pkm_kites_to_check(struct pk_manager* pkm, struct pk_pagekite** kites)
+{
+  /* Blocker threads check backends on a snapshot of the kite table, as
+   * it may change under them. The array must hold kite_max entries. */
+  int count = 0;
+
+  pkm_block(pkm);
+  PK_KITE_ITER(pkm, kite) {
+    if (kite->protocol[0] != '\0') kites[count++] = kite;
+  }
+  pkm_unblock(pkm);
+  return count;
+}
+
+void pkm_kites_checked(struct pk_manager* pkm,
+                       struct pk_pagekite** kites, int count)
+{
+  /* The event loop reads check_pending, and more than one blocker
+   * thread may be checking at the same time. */
+  pkm_block(pkm);
+  for (int i = 0; i < count; i++) kites[i]->check_pending = 0;
+  pkm_unblock(pkm);
+}
+
+int pkm_probe_backends(struct pk_manager* pkm, struct pk_pagekite* kite)
+{
+  /* This blocks, so it must only be called from the blocker threads.
+   *
+   * While the kite's circuit breaker is open, check whether backends
+   * that are due for another try are back, so it can close without
+   * sacrificing a real request. Returns how many were. */
+  int i, due, sockfd, up;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct pk_kite_backend* backend;
+
+  PK_TRACE_FUNCTION;
+
+  for (i = up = 0; i < kite->backend_count; i++) {
+    backend = kite->backends + i;
+    pkm_block(pkm);
+    due = ((kite->breaker != PK_BREAKER_CLOSED) &&
+           (backend->down_until <= pk_time()));
+    addrlen = backend->local_addrlen;
+    memcpy(&addr, &(backend->local_addr), addrlen);
+    pkm_unblock(pkm);
+    if (!due) continue;
+
+    if (0 <= (sockfd = pkm_be_connect_blocking(&addr, addrlen))) {
+      PKS_close(sockfd);
+      up++;
+    }
+    pk_log(PK_LOG_BE_CONNS, "Probed %s:%d: %s",
+           backend->local_domain, backend->local_port,
+           (sockfd < 0) ? "still down" : "OK");
+
+    pkm_block(pkm);
+    pkm_backend_result(pkm, kite, backend, (sockfd >= 0));
+    pkm_unblock(pkm);
+  }
+  return up;
+}
+
+static int pkm_kite_backend_init(struct pk_pagekite* kite,
+                                 const char* local_domain, int local_port,
+                                 int weight)
+{
+  struct pk_kite_backend* backend;
+
+  if (kite->backend_count >= PK_KITE_BACKENDS_MAX)
+    return (pk_error = ERR_NO_MORE_BACKENDS);
+
+  backend = kite->backends + kite->backend_count++;
+  pk_reset_kite_backend(backend);
+  strncpyz(backend->local_domain, local_domain, PK_DOMAIN_LENGTH);
+  backend->local_port = local_port;
+  backend->weight = (weight > 0) ? weight : 1;
+  return 0;
+}
+
+struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
+                                 const char* protocol,
+                                 const char* public_domain, int public_port,
+                                 const char* auth_secret,
+                                 const char* local_domain, int local_port)
+{
+  char *pp;
+  struct pk_pagekite* kite = NULL;
+
+  PK_TRACE_FUNCTION;
+
+  if ((strcasecmp(protocol, "raw") == 0) && (public_port < 1))
+    return pk_err_null(ERR_RAW_NEEDS_PUBPORT);
+
+  if (NULL == (kite = pkm->kite_free))
+    return pk_err_null(ERR_NO_MORE_KITES);
+  pkm->kite_free = kite->next_free;
+  kite->next_free = NULL;
 
   strncpyz(kite->protocol, protocol, PK_PROTOCOL_LENGTH);
   strncpyz(kite->auth_secret, auth_secret, PK_SECRET_LENGTH);
   strncpyz(kite->public_domain, public_domain, PK_DOMAIN_LENGTH);
   kite->public_port = public_port;
-  kite->local_domain[0] = '\0';
+  kite->check_pending = 0;
+  kite->breaker = PK_BREAKER_CLOSED;
+  kite->breaker_trips = 0;
+  kite->breaker_probe_at = 0;
+  kite->weight = 1;
+  kite->backend_count = 0;
   if (local_domain != NULL)
-    strncpyz(kite->local_domain, local_domain, PK_DOMAIN_LENGTH);
-  kite->local_port = local_port;
+    pkm_kite_backend_init(kite, local_domain, local_port, 1);
 
   /* Allow the public port to be specified as part of the protocol */
   if ((0 == public_port) && (NULL != (pp = strchr(kite->protocol, '-')))) {
     *pp++ = '\0';
     sscanf(pp, "%d", &(kite->public_port));
   }
+  pkm_kite_index_add(pkm, kite);
 
   PK_CHECK_MEMORY_CANARIES;
   return kite;
 }
 
+int pkm_add_kite_backend(struct pk_manager* pkm,
+                         const char* protocol,
+                         const char* public_domain, int public_port,
+                         const char* local_domain, int local_port,
+                         int weight)
+{
+  /* Add another origin server to a kite configured by pkm_add_kite. */
+  char proto[PK_PROTOCOL_LENGTH+1];
+  char *pp;
+  struct pk_pagekite* kite;
+
+  PK_TRACE_FUNCTION;
+
+  strncpyz(proto, protocol, PK_PROTOCOL_LENGTH);
+  if ((0 == public_port) && (NULL != (pp = strchr(proto, '-')))) {
+    *pp++ = '\0';
+    sscanf(pp, "%d", &public_port);
+  }
+
+  if (NULL != (kite = pkm_kite_index_find(pkm, proto, public_domain,
+                                           public_port)))
+    return pkm_kite_backend_init(kite, local_domain, local_port, weight);
+  return (pk_error = ERR_NO_KITE);
+}
+
+int pkm_set_kite_weight(struct pk_manager* pkm,
+                        const char* protocol,
+                        const char* public_domain, int public_port,
+                        int weight)
+{
+  char proto[PK_PROTOCOL_LENGTH+1];
+  char *pp;
+  struct pk_pagekite* kite;
+
+  strncpyz(proto, protocol, PK_PROTOCOL_LENGTH);
+  if ((0 == public_port) && (NULL != (pp = strchr(proto, '-')))) {
+    *pp++ = '\0';
+    sscanf(pp, "%d", &public_port);
+  }
+  if (NULL == (kite = pkm_kite_index_find(pkm, proto, public_domain,
+                                          public_port)))
+    return (pk_error = ERR_NO_KITE);
+
+  if (weight < 1) weight = 1;
+  if (weight > PK_SCHED_WEIGHT_MAX) weight = PK_SCHED_WEIGHT_MAX;
+  kite->weight = weight;
+  return 0;
+}
+
 int pkm_add_listener(struct pk_manager* pkm,
                      const char* hostname,
                      int port,
@@ -1321,6 +2339,7 @@ int pkm_add_listener(struct pk_manager* pkm,
                (0 > set_non_blocking(pkl->conn.sockfd)))) {
         pkl->conn.status &= ~CONN_STATUS_CHANGING;  /* Change failed */
         pkc_reset_conn(&(pkl->conn), 0);
+        pkm_free_be_conn(pkl);
         pk_log(PK_LOG_BE_CONNS|PK_LOG_ERROR,
                "pkm_add_listener: pkc_listen() failed for %s",
                in_addr_to_str(rp->ai_addr, printip, 128));
@@ -1333,6 +2352,7 @@ int pkm_add_listener(struct pk_manager* pkm,
         pkl->callback_func = callback_func;
         pkl->callback_data = callback_data;
         ev_io_start(pkm->loop, &(pkl->conn.watch_r));
+        pkm_be_conn_list_del(pkl);  /* Listeners are never evicted */
         pk_log(PK_LOG_MANAGER_INFO,
                "Listening on %s (port %d, sockfd %d)",
                in_addr_to_str(rp->ai_addr, printip, 128), lport,
@@ -1452,53 +2472,419 @@ struct pk_tunnel* pkm_add_frontend_ai(struct pk_manager* pkm,
   return adding;
 }
 
-static unsigned int pkm_sid_shift(char *sid)
+static unsigned int pkm_be_conn_hash(struct pk_tunnel* fe, const char *sid)
 {
-  return murmur3_32(sid, strlen(sid));
+  /* SIDs are only significant up to BE_MAX_SID_SIZE chars, see below. */
+  uintptr_t fep = (uintptr_t) fe;
+  size_t len = 0;
+  while ((len < BE_MAX_SID_SIZE) && sid[len]) len++;
+  return (murmur3_32((uint8_t*) sid, len)
+          ^ (unsigned int) ((fep >> 4) * 0x9e3779b1));
+}
+
+static void pkm_be_conn_index_reset(struct pk_manager* pkm)
+{
+  memset(pkm->be_conn_index, 0,
+         sizeof(struct pk_backend_conn*) * (pkm->be_conn_index_mask + 1));
+  pkm->be_conn_index_used = 0;
+  for (int i = 0; i < pkm->be_conn_max; i++) {
+    pkm_be_conn_at(pkm, i)->index_slot = -1;
+  }
+}
+
+static void pkm_be_conn_index_rebuild(struct pk_manager* pkm)
+{
+  struct pk_backend_conn* pkb;
+
+  /* Drop all the tombstones and re-add whatever is still indexed. */
+  pkm->be_conn_index_used = 0;
+  memset(pkm->be_conn_index, 0,
+         sizeof(struct pk_backend_conn*) * (pkm->be_conn_index_mask + 1));
+  for (int i = 0; i < pkm->be_conn_max; i++) {
+    pkb = pkm_be_conn_at(pkm, i);
+    if (pkb->index_slot >= 0) {
+      pkb->index_slot = -1;
+      pkm_be_conn_index_add(pkm, pkb);
+    }
+  }
+}
+
+static void pkm_be_conn_index_add(struct pk_manager* pkm,
+                                  struct pk_backend_conn* pkb)
+{
+  unsigned int i, mask;
+  struct pk_backend_conn* slot;
+
+  if (pkb->index_slot >= 0) pkm_be_conn_index_del(pkb);
+
+  /* Keep at least a quarter of the table empty, so misses terminate fast.
+   * Live entries never exceed half the table, so a rebuild always helps. */
+  mask = pkm->be_conn_index_mask;
+  if (4 * (pkm->be_conn_index_used + 1) > 3 * (mask + 1)) {
+    pkm_be_conn_index_rebuild(pkm);
+  }
+
+  i = pkm_be_conn_hash(pkb->tunnel, pkb->sid) & mask;
+  while (1) {
+    slot = pkm->be_conn_index[i];
+    if (slot == NULL) pkm->be_conn_index_used++;
+    if ((slot == NULL) || (slot == BE_CONN_INDEX_TOMBSTONE)) break;
+    i = (i + 1) & mask;
+  }
+  pkm->be_conn_index[i] = pkb;
+  pkb->index_slot = i;
+}
+
+static void pkm_be_conn_index_del(struct pk_backend_conn* pkb)
+{
+  if (pkb->index_slot >= 0) {
+    pkb->manager->be_conn_index[pkb->index_slot] = BE_CONN_INDEX_TOMBSTONE;
+    pkb->index_slot = -1;
+  }
+}
+
+static void pkm_be_conn_list_append(struct pk_backend_conn_list* list,
+                                    struct pk_backend_conn* pkb)
+{
+  pkb->list = list;
+  pkb->list_next = NULL;
+  pkb->list_prev = list->tail;
+  if (list->tail != NULL) list->tail->list_next = pkb;
+  else list->head = pkb;
+  list->tail = pkb;
+}
+
+static void pkm_be_conn_list_del(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* list = pkb->list;
+  if (list == NULL) return;
+
+  if (pkb->list_prev != NULL) pkb->list_prev->list_next = pkb->list_next;
+  else list->head = pkb->list_next;
+  if (pkb->list_next != NULL) pkb->list_next->list_prev = pkb->list_prev;
+  else list->tail = pkb->list_prev;
+  pkb->list = NULL;
+  pkb->list_prev = pkb->list_next = NULL;
+}
+
+/* Record activity on a conn. The LRU list is kept ordered by activity,
+ * so this must be used instead of bumping conn.activity directly. */
+static void pkm_be_conn_touch(struct pk_backend_conn* pkb)
+{
+  pkb->conn.activity = pk_time();
+  if (pkb->list == &(pkb->manager->be_conn_lru)) {
+    pkm_be_conn_list_del(pkb);
+    pkm_be_conn_list_append(&(pkb->manager->be_conn_lru), pkb);
+  }
+}
+
+static void pkm_be_conn_tunnel_link(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* streams;
+
+  if (pkb->tunnel == NULL) return;  /* Listeners and relayed conns */
+  streams = &(pkb->tunnel->streams);
+  pkb->tunnel_next = NULL;
+  pkb->tunnel_prev = streams->tail;
+  if (streams->tail != NULL) streams->tail->tunnel_next = pkb;
+  else streams->head = pkb;
+  streams->tail = pkb;
+}
+
+static int pkm_be_conn_on_tunnel(struct pk_backend_conn* pkb)
+{
+  return ((pkb->tunnel != NULL) &&
+          ((pkb->tunnel_prev != NULL) || (pkb->tunnel->streams.head == pkb)));
+}
+
+static void pkm_be_conn_tunnel_unlink(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* streams;
+
+  if (!pkm_be_conn_on_tunnel(pkb)) return;
+  pkm_be_conn_unthrottle(pkb);
+  pkm_be_conn_unready(pkb);
+
+  streams = &(pkb->tunnel->streams);
+  if (pkb->tunnel_prev != NULL) pkb->tunnel_prev->tunnel_next = pkb->tunnel_next;
+  else streams->head = pkb->tunnel_next;
+  if (pkb->tunnel_next != NULL) pkb->tunnel_next->tunnel_prev = pkb->tunnel_prev;
+  else streams->tail = pkb->tunnel_prev;
+  pkb->tunnel_prev = pkb->tunnel_next = NULL;
+}
+
+static void pkm_be_conn_throttle(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* throttled = &(pkb->tunnel->throttled);
+
+  if ((pkb->throttled_prev != NULL) || (throttled->head == pkb)) return;
+  pkb->throttled_next = NULL;
+  pkb->throttled_prev = throttled->tail;
+  if (throttled->tail != NULL) throttled->tail->throttled_next = pkb;
+  else throttled->head = pkb;
+  throttled->tail = pkb;
+}
+
+static void pkm_be_conn_unthrottle(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* throttled = &(pkb->tunnel->throttled);
+
+  if ((pkb->throttled_prev == NULL) && (throttled->head != pkb)) return;
+  if (pkb->throttled_prev != NULL)
+    pkb->throttled_prev->throttled_next = pkb->throttled_next;
+  else
+    throttled->head = pkb->throttled_next;
+  if (pkb->throttled_next != NULL)
+    pkb->throttled_next->throttled_prev = pkb->throttled_prev;
+  else
+    throttled->tail = pkb->throttled_prev;
+  pkb->throttled_prev = pkb->throttled_next = NULL;
+}
+
+static void pkm_be_conn_ready(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* ready = &(pkb->tunnel->ready);
+
+  if (!(pkb->conn.status & BE_STATUS_SCHEDULED)) pkb->deficit = 0;
+  pkb->conn.status |= BE_STATUS_SCHEDULED;
+  if ((pkb->ready_prev != NULL) || (ready->head == pkb)) return;
+  pkb->ready_next = NULL;
+  pkb->ready_prev = ready->tail;
+  if (ready->tail != NULL) ready->tail->ready_next = pkb;
+  else ready->head = pkb;
+  ready->tail = pkb;
+}
+
+static void pkm_be_conn_unready(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* ready = &(pkb->tunnel->ready);
+
+  pkb->conn.status &= ~BE_STATUS_SCHEDULED;
+  if ((pkb->ready_prev == NULL) && (ready->head != pkb)) return;
+  if (pkb->ready_prev != NULL)
+    pkb->ready_prev->ready_next = pkb->ready_next;
+  else
+    ready->head = pkb->ready_next;
+  if (pkb->ready_next != NULL)
+    pkb->ready_next->ready_prev = pkb->ready_prev;
+  else
+    ready->tail = pkb->ready_prev;
+  pkb->ready_prev = pkb->ready_next = NULL;
+}
+
+static void pkm_be_conn_connecting(struct pk_backend_conn* pkb,
+                                   const char* proto, const char* host)
+{
+  struct pk_backend_conn_list* connecting = &(pkb->manager->be_conn_connecting);
+
+  if ((pkb->connecting_prev != NULL) || (connecting->head == pkb)) return;
+  pkb->request_proto = strdup(proto);
+  pkb->request_host = strdup(host);
+  pkb->connecting_next = NULL;
+  pkb->connecting_prev = connecting->tail;
+  if (connecting->tail != NULL) connecting->tail->connecting_next = pkb;
+  else connecting->head = pkb;
+  connecting->tail = pkb;
+}
+
+static void pkm_be_conn_connect_done(struct pk_backend_conn* pkb)
+{
+  struct pk_backend_conn_list* connecting = &(pkb->manager->be_conn_connecting);
+
+  if ((pkb->connecting_prev == NULL) && (connecting->head != pkb)) return;
+  if (pkb->connecting_prev != NULL)
+    pkb->connecting_prev->connecting_next = pkb->connecting_next;
+  else
+    connecting->head = pkb->connecting_next;
+  if (pkb->connecting_next != NULL)
+    pkb->connecting_next->connecting_prev = pkb->connecting_prev;
+  else
+    connecting->tail = pkb->connecting_prev;
+  pkb->connecting_prev = pkb->connecting_next = NULL;
+  if (pkb->request_proto != NULL) free(pkb->request_proto);
+  if (pkb->request_host != NULL) free(pkb->request_host);
+  pkb->request_proto = pkb->request_host = NULL;
+}
+
+static void pkm_be_conn_lists_reset(struct pk_manager* pkm)
+{
+  struct pk_backend_conn* pkb;
+
+  pkm->be_conn_free.head = pkm->be_conn_free.tail = NULL;
+  pkm->be_conn_lru.head = pkm->be_conn_lru.tail = NULL;
+  PK_TUNNEL_ITER(pkm, fe) {
+    fe->streams.head = fe->streams.tail = NULL;
+    fe->throttled.head = fe->throttled.tail = NULL;
+    fe->ready.head = fe->ready.tail = NULL;
+  }
+  pkm->be_conn_connecting.head = pkm->be_conn_connecting.tail = NULL;
+  for (int i = pkm->be_conn_max-1; i >= 0; i--) {
+    pkb = pkm_be_conn_at(pkm, i);
+    pkb->list = NULL;
+    pkb->tunnel_prev = pkb->tunnel_next = NULL;
+    pkb->throttled_prev = pkb->throttled_next = NULL;
+    pkb->ready_prev = pkb->ready_next = NULL;
+    pkb->connecting_prev = pkb->connecting_next = NULL;
+    pkm_be_conn_list_append(&(pkm->be_conn_free), pkb);
+  }
+}
+
+struct pk_backend_conn* pkm_be_conn_at(struct pk_manager* pkm, int i)
+{
+  /* The first be_conn_base conns live in the manager's buffer, any more
+   * than that live in malloced segments of PK_BE_CONN_SEGMENT each. */
+  if (i < pkm->be_conn_base) return (pkm->be_conns + i);
+  i -= pkm->be_conn_base;
+  return (pkm->be_conn_segments[i / PK_BE_CONN_SEGMENT]
+          + (i % PK_BE_CONN_SEGMENT));
+}
+
+static void pkm_be_conn_used(struct pk_manager* pkm,
+                             struct pk_backend_conn* pkb)
+{
+  /* Shrinking waits until the newest segment has been unused for a while,
+   * so note whenever one of its conns is allocated or freed. */
+  struct pk_backend_conn* segment;
+  if (pkm->be_conn_segment_count < 1) return;
+  segment = pkm->be_conn_segments[pkm->be_conn_segment_count-1];
+  if ((pkb >= segment) && (pkb < segment + PK_BE_CONN_SEGMENT))
+    pkm->be_conn_last_used = pk_time();
+}
+
+static int pkm_be_conn_table_grow(struct pk_manager* pkm)
+{
+  int i, slots;
+  struct pk_backend_conn* segment;
+  struct pk_backend_conn** index;
+  struct pk_backend_conn* pkb;
+
+  if ((pkm->be_conn_max + PK_BE_CONN_SEGMENT > pkm->be_conn_limit) ||
+      (pkm->be_conn_segment_count >= PK_BE_CONN_SEGMENTS_MAX))
+    return -1;
+
+  /* The index must stay at least twice as big as the table, or probes
+   * for missing SIDs would stop terminating quickly. */
+  index = NULL;
+  for (slots = 1; slots < 2 * (pkm->be_conn_max + PK_BE_CONN_SEGMENT); slots <<= 1);
+  if (slots > (int) pkm->be_conn_index_mask + 1) {
+    index = calloc(slots, sizeof(struct pk_backend_conn*));
+    if (index == NULL) return -1;
+  }
+  segment = pkm_segment_alloc(PK_BE_CONN_SEGMENT
+                              * sizeof(struct pk_backend_conn));
+  if (segment == NULL) {
+    if (index != NULL) free(index);
+    return -1;
+  }
+
+  for (i = 0; i < PK_BE_CONN_SEGMENT; i++) {
+    pkb = (segment + i);
+    pkb->manager = pkm;
+    pkb->index_slot = -1;
+    pkb->conn.sockfd = -1;
+    pkc_reset_conn(&(pkb->conn), 0);
+  }
+  pkm->be_conn_segments[pkm->be_conn_segment_count++] = segment;
+  pkm->be_conn_max += PK_BE_CONN_SEGMENT;
+  pkm->be_conn_last_used = pk_time();
+
+  /* Same order as pkm_be_conn_lists_reset: lowest slot is used first. */
+  for (i = PK_BE_CONN_SEGMENT-1; i >= 0; i--) {
+    pkm_be_conn_list_append(&(pkm->be_conn_free), segment + i);
+  }
+
+  if (index != NULL) {
+    if (pkm->be_conn_index_malloced) free(pkm->be_conn_index);
+    pkm->be_conn_index = index;
+    pkm->be_conn_index_mask = slots - 1;
+    pkm->be_conn_index_malloced = 1;
+    pkm_be_conn_index_rebuild(pkm);
+  }
+
+  pk_log(PK_LOG_MANAGER_INFO, "Grew connection table to %d slots",
+         pkm->be_conn_max);
+  return 0;
+}
+
+static void pkm_be_conn_table_shrink(struct pk_manager* pkm)
+{
+  int i;
+  struct pk_backend_conn* segment;
+
+  /* Only the newest segment is ever released, once it has been idle for a
+   * while, so we don't thrash when load hovers around a segment boundary.
+   * The index keeps its size, it is cheap compared to the conns. */
+  if ((pkm->be_conn_segment_count < 1) ||
+      (pkm->be_conn_last_used + PK_BE_CONN_SHRINK_IDLE > pk_time()))
+    return;
+
+  segment = pkm->be_conn_segments[pkm->be_conn_segment_count-1];
+  for (i = 0; i < PK_BE_CONN_SEGMENT; i++) {
+    if ((segment+i)->list != &(pkm->be_conn_free)) return;
+  }
+
+  for (i = 0; i < PK_BE_CONN_SEGMENT; i++) {
+    pkm_be_conn_list_del(segment + i);
+    pkc_reset_conn(&((segment+i)->conn), 0);
+  }
+  pkm->be_conn_segments[--pkm->be_conn_segment_count] = NULL;
+  pkm->be_conn_max -= PK_BE_CONN_SEGMENT;
+  pkm->be_conn_last_used = pk_time();
+  pkm_segment_free(segment);
+
+  pk_log(PK_LOG_MANAGER_INFO, "Shrank connection table to %d slots",
+         pkm->be_conn_max);
 }
 
 struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
                                           struct pk_tunnel* fe, char *sid)
 {
-  int i, evicting;
+  int evicting;
   time_t64 max_age;
-  unsigned int shift;
   struct pk_backend_conn* pkb;
-  struct pk_backend_conn* pkb_oldest;
+  struct pk_backend_conn* idlest;
 
   PK_TRACE_FUNCTION;
 
-  /* FIXME: This becomes a bottleneck when we start to hit our connection
-   *        limits; it goes suddenly from O(1) to O(n). We might want to
-   *        replace this with a data structure degrades a bit more
-   *        gracefully.
-   */
-
-  max_age = pk_time();
-  pkb_oldest = NULL;
-  shift = pkm_sid_shift(sid);
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
-    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
-      pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
-      pkb->tunnel = fe;
-      /* Note: Do not merge this into the pkc_reset_conn call, as that
-       *       could suppress errors. We expect whatever allocated this
-       *       conn to reset the changing flag whan it's done working. */
-      pkb->conn.status |= CONN_STATUS_CHANGING;
-      strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE);
-      return pkb;
-    }
-    if ((pkb->conn.activity <= max_age) &&
-        !(pkb->conn.status & (CONN_STATUS_CHANGING|CONN_STATUS_LISTENING))) {
-      max_age = pkb->conn.activity;
-      pkb_oldest = pkb;
-    }
+  /* Out of free conns? Grow the table if we're allowed to. */
+  if (pkm->be_conn_free.tail == NULL) pkm_be_conn_table_grow(pkm);
+
+  /* Free conns are reused most-recently-freed first, they're warmer. */
+  if (NULL != (pkb = pkm->be_conn_free.tail)) {
+    pkm_be_conn_list_del(pkb);
+    pkm_be_conn_list_append(&(pkm->be_conn_lru), pkb);
+    pkm_be_conn_used(pkm, pkb);
+    pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
+    pkb->tunnel = fe;
+    pkm_be_conn_tunnel_link(pkb);
+    /* Note: Do not merge this into the pkc_reset_conn call, as that
+     *       could suppress errors. We expect whatever allocated this
+     *       conn to reset the changing flag whan it's done working. */
+    pkb->conn.status |= CONN_STATUS_CHANGING;
+    strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE);
+    pkb->sid_header_length = pk_format_sid_header(pkb->sid_header, pkb->sid);
+    pkm_be_conn_index_add(pkm, pkb);
+    return pkb;
+  }
+
+  /* The LRU list is ordered by activity, so the first conn that is not
+   * busy changing state is the idlest one. Activity is also bumped by
+   * pkc_read, so if that one is not idle enough to evict, we keep looking
+   * rather than trust the order blindly. */
+  idlest = NULL;
+  for (pkb = pkm->be_conn_lru.head; pkb != NULL; pkb = pkb->list_next) {
+    if (pkb->conn.status & (CONN_STATUS_CHANGING|CONN_STATUS_LISTENING))
+      continue;
+    if (idlest == NULL) idlest = pkb;
+    if ((0 == pk_state.conn_eviction_idle_s) ||
+        (pk_state.conn_eviction_idle_s < pk_time(0) - pkb->conn.activity))
+      break;
   }
+  if (pkb == NULL) pkb = idlest;
 
   /* If we get this far, we found no empty slots. Let's complain to the
    * log and, if so configured, kick out the oldest idle connection. */
-  if (NULL != (pkb = pkb_oldest)) {
+  if (pkb != NULL) {
     max_age = pk_time(0) - pkb->conn.activity;
     evicting = (pk_state.conn_eviction_idle_s &&
                (pk_state.conn_eviction_idle_s < max_age));
@@ -1513,9 +2899,18 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
     if (evicting) {
       pkb->conn.status |= (CONN_STATUS_CLS_WRITE|CONN_STATUS_CLS_READ);
       pkm_update_io(pkb->tunnel, pkb, 0);
+      pkm_be_conn_connect_done(pkb);
+      pkm_be_conn_release_backend(pkb);
+      pkm_be_conn_tunnel_unlink(pkb);
+      pkm_be_conn_list_del(pkb);
+      pkm_be_conn_list_append(&(pkm->be_conn_lru), pkb);
       pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
       pkb->tunnel = fe;
+      pkm_be_conn_tunnel_link(pkb);
       strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE);
+      pkb->sid_header_length = pk_format_sid_header(pkb->sid_header,
+                                                    pkb->sid);
+      pkm_be_conn_index_add(pkm, pkb);
       return pkb;
     }
   }
@@ -1526,26 +2921,36 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
 
 void pkm_free_be_conn(struct pk_backend_conn* pkb)
 {
+  pkm_be_conn_connect_done(pkb);
+  pkm_be_conn_release_backend(pkb);
+  pkm_be_conn_index_del(pkb);
+  pkm_be_conn_tunnel_unlink(pkb);
+  pkm_be_conn_list_del(pkb);
+  pkm_be_conn_list_append(&(pkb->manager->be_conn_free), pkb);
+  pkm_be_conn_used(pkb->manager, pkb);
   pkb->conn.status = CONN_STATUS_UNKNOWN;
 }
 
 struct pk_backend_conn* pkm_find_be_conn(struct pk_manager* pkm,
                                          struct pk_tunnel* fe, char* sid)
 {
-  int i;
-  unsigned int shift;
+  unsigned int i, mask;
   struct pk_backend_conn* pkb;
 
   PK_TRACE_FUNCTION;
 
-  shift = pkm_sid_shift(sid) % pkm->be_conn_max;
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
-    if ((pkb->conn.status & CONN_STATUS_ALLOCATED) &&
+  /* Probe until we hit an empty slot; the index is never allowed to fill
+   * up completely, so this always terminates. */
+  mask = pkm->be_conn_index_mask;
+  i = pkm_be_conn_hash(fe, sid) & mask;
+  while (NULL != (pkb = pkm->be_conn_index[i])) {
+    if ((pkb != BE_CONN_INDEX_TOMBSTONE) &&
+        (pkb->conn.status & CONN_STATUS_ALLOCATED) &&
         (pkb->tunnel == fe) &&
         (0 == strncmp(pkb->sid, sid, BE_MAX_SID_SIZE))) {
       return pkb;
     }
+    i = (i + 1) & mask;
   }
   return NULL;
 }
@@ -1635,6 +3040,15 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->kite_max = kites;
   pkm->buffer += sizeof(struct pk_pagekite) * kites;
 
+  /* Allocate space for the kite index */
+  for (i = 1; i < 2 * kites; i <<= 1);
+  pkm->buffer_bytes_free -= sizeof(struct pk_pagekite*) * i;
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_KITES);
+  pkm->kite_index = (struct pk_pagekite **) pkm->buffer;
+  pkm->kite_index_mask = i - 1;
+  pkm->buffer += sizeof(struct pk_pagekite*) * i;
+  pkm_kite_index_reset(pkm);
+
   /* Allocate space for the tunnels */
   pkm->buffer_bytes_free -= (sizeof(struct pk_tunnel) * tunnels);
   pkm->buffer_bytes_free -= (sizeof(struct pk_kite_request) * kites * tunnels);
@@ -1653,12 +3067,17 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
     pkm->buffer += (sizeof(struct pk_kite_request) * kites);
   }
 
-  /* Allocate space for the backend connections */
+  /* Allocate space for the backend connections, cache line aligned */
+  i = (PK_CACHE_LINE_BYTES - ((uintptr_t) pkm->buffer % PK_CACHE_LINE_BYTES))
+      % PK_CACHE_LINE_BYTES;
+  pkm->buffer += i;
+  pkm->buffer_bytes_free -= i;
   pkm->buffer_bytes_free -= sizeof(struct pk_backend_conn) * conns;
   if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
   pkm->be_conns = (struct pk_backend_conn *) pkm->buffer;
-  pkm->be_conn_max = conns;
+  pkm->be_conn_max = pkm->be_conn_base = pkm->be_conn_limit = conns;
   for (i = 0; i < conns; i++) {
+    (pkm->be_conns+i)->manager = pkm;
     (pkm->be_conns+i)->conn.sockfd = -1;
 #ifdef HAVE_OPENSSL
     (pkm->be_conns+i)->conn.ssl = NULL;
@@ -1668,6 +3087,16 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   }
   pkm->buffer += sizeof(struct pk_backend_conn) * conns;
 
+  /* Allocate space for the backend connection index */
+  for (i = 1; i < 2 * conns; i <<= 1);
+  pkm->buffer_bytes_free -= sizeof(struct pk_backend_conn*) * i;
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
+  pkm->be_conn_index = (struct pk_backend_conn **) pkm->buffer;
+  pkm->be_conn_index_mask = i - 1;
+  pkm->buffer += sizeof(struct pk_backend_conn*) * i;
+  pkm_be_conn_index_reset(pkm);
+  pkm_be_conn_lists_reset(pkm);
+
   /* Allocate space for the blocking job queue */
   pkm->buffer_bytes_free -= sizeof(struct pk_job) * (conns+tunnels);
   if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
@@ -1707,6 +3136,11 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->housekeeping_interval_min = PK_HOUSEKEEPING_INTERVAL_MIN;
   pkm->housekeeping_interval_max = PK_HOUSEKEEPING_INTERVAL_MAX_DEF;
   pkm->check_world_interval = PK_CHECK_WORLD_INTERVAL;
+  pkm->be_pool_min = pkm->be_pool_max = 0;
+  pkm->be_pool_idle_s = PK_BACKEND_POOL_IDLE_DEF;
+  pkm->be_balancing = PK_BALANCE_LEAST_CONNS;
+  pkm->flow_control = PK_FLOW_CONTROL_CLASSIC;
+  pkm->flow_window_max_kb = CONN_WINDOW_SIZE_KB_MAXIMUM;
   pkm->interval_fudge_factor = 2 * (rand() % PK_HOUSEKEEPING_INTERVAL_MIN);
 
   pkm->last_world_update = (time_t64) 0;
@@ -1726,6 +3160,15 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   ev_async_init(&(pkm->quit), pkm_quit_cb);
   ev_async_start(loop, &(pkm->quit));
 
+  /* Flush batched up tunnel writes once per loop iteration */
+  ev_prepare_init(&(pkm->flush), pkm_flush_cb);
+  pkm->flush.data = (void *) pkm;
+  ev_prepare_start(loop, &(pkm->flush));
+
+  /* Batch up small progress reports, started on demand */
+  ev_timer_init(&(pkm->skb_timer), pkm_skb_timer_cb, 0, 0);
+  pkm->skb_timer.data = (void *) pkm;
+
   /* Let external threads control our "periodic housekeeping" */
   ev_async_init(&(pkm->tick), pkm_tick_cb);
   pkm->tick.data = (void *) pkm;
@@ -1767,6 +3210,12 @@ void pkm_manager_free(struct pk_manager* pkm)
     free(pkm->dynamic_dns_url);
   }
 
+  for (int i = 0; i < PK_FANCY_URL_CACHE_MAX; i++) {
+    if (pkm->fancy_urls[i].host != NULL) free(pkm->fancy_urls[i].host);
+    if (pkm->fancy_urls[i].url != NULL) free(pkm->fancy_urls[i].url);
+    pkm->fancy_urls[i].host = pkm->fancy_urls[i].url = NULL;
+  }
+
   PK_TUNNEL_ITER(pkm, fe) {
     if (fe->fe_uuid != NULL) free(fe->fe_uuid);
     if (fe->fe_hostname != NULL) free(fe->fe_hostname);
@@ -1774,6 +3223,14 @@ void pkm_manager_free(struct pk_manager* pkm)
     fe->fe_uuid = fe->fe_hostname = NULL;
   }
 
+  while (pkm->be_conn_segment_count > 0) {
+    pkm_segment_free(pkm->be_conn_segments[--pkm->be_conn_segment_count]);
+  }
+  if (pkm->be_conn_index_malloced) {
+    free(pkm->be_conn_index);
+    pkm->be_conn_index_malloced = 0;
+  }
+
   if (pkm->was_malloced) {
     free(pkm);
   }
@@ -1824,15 +3281,103 @@ int pkm_stop_thread(struct pk_manager* pkm)
   return pthread_join(pkm->main_thread, NULL);
 }
 
+#if PK_TESTS
+void* pkm_fancy_url_test_responder(void* void_pkm)
+{
+  struct pk_manager* pkm = (struct pk_manager*) void_pkm;
+  struct pke_event* ev = pke_await_event(&(pkm->events), 10);
+  assert(PK_EV_CFG_FANCY_URL == (ev->event_code & PK_EV_TYPE_MASK));
+  assert(0 == strcmp(ev->event_str, "foo.example.com"));
+  pke_post_response(&(pkm->events), ev->event_code, PK_EV_RESPOND_OK,
+                    0, "https://example.com/offline/");
+  return void_pkm;
+}
+
+/* Queue 64 KB on a bulk stream and a few bytes on a small one, let the
+ * scheduler drain both and count how many bulk chunks the small stream
+ * had to wait for. */
+int pkm_schedule_tunnel_test(struct pk_manager* pkm,
+                             struct pk_pagekite* kite, int weight)
+{
+  int tfds[2], bfds[2], sfds[2], waited = 0;
+  char *data, *p;
+  ssize_t bytes = 0, r;
+  struct pk_tunnel* fe = pkm->tunnels;
+  struct pk_backend_conn *bulk, *small;
+
+  assert(NULL != (data = malloc(128 * 1024)));
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, tfds));
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, bfds));
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sfds));
+  set_non_blocking(tfds[0]);
+  set_non_blocking(tfds[1]);
+  set_non_blocking(bfds[0]);
+  set_non_blocking(sfds[0]);
+
+  fe->conn.sockfd = tfds[0];
+  ev_io_init(&(fe->conn.watch_w), pkm_tunnel_writable_cb, tfds[0], EV_WRITE);
+  fe->conn.watch_w.data = (void *) fe;
+
+  assert(NULL != (bulk = pkm_alloc_be_conn(pkm, fe, "bulk")));
+  assert(NULL != (small = pkm_alloc_be_conn(pkm, fe, "small")));
+  bulk->conn.sockfd = bfds[0];
+  small->conn.sockfd = sfds[0];
+  bulk->kite = kite;
+  kite->weight = weight;
+  ev_io_init(&(bulk->conn.watch_r), pkm_be_conn_readable_cb, bfds[0], EV_READ);
+  ev_io_init(&(small->conn.watch_r), pkm_be_conn_readable_cb, sfds[0], EV_READ);
+  bulk->conn.watch_r.data = (void *) bulk;
+  small->conn.watch_r.data = (void *) small;
+
+  memset(data, 'x', 64 * 1024);
+  assert(64 * 1024 == write(bfds[1], data, 64 * 1024));
+  assert(100 == write(sfds[1], data, 100));
+  pkm_be_conn_ready(bulk);
+  pkm_be_conn_ready(small);
+  assert(fe->ready.head == bulk && fe->ready.tail == small);
+  pkm_schedule_tunnel(fe);
+  assert(NULL == fe->ready.head);
+  assert(!(bulk->conn.status & BE_STATUS_SCHEDULED));
+
+  while (0 < (r = read(tfds[1], data + bytes, 128 * 1024 - 1 - bytes)))
+    bytes += r;
+  data[bytes] = '\0';
+  assert(bytes > 64 * 1024);
+  for (p = data; NULL != (p = strstr(p, "SID: ")); p++) {
+    if (0 == strncmp(p, "SID: small\r\n\r\n", 14)) break;
+    if (0 == strncmp(p, "SID: bulk\r\n\r\n", 13)) waited++;
+  }
+  assert(p != NULL);
+
+  ev_io_stop(pkm->loop, &(fe->conn.watch_w));
+  ev_io_stop(pkm->loop, &(bulk->conn.watch_r));
+  ev_io_stop(pkm->loop, &(small->conn.watch_r));
+  bulk->conn.sockfd = small->conn.sockfd = fe->conn.sockfd = -1;
+  pkm_free_be_conn(bulk);
+  pkm_free_be_conn(small);
+  kite->weight = 1;
+  close(tfds[0]); close(tfds[1]);
+  close(bfds[0]); close(bfds[1]);
+  close(sfds[0]); close(sfds[1]);
+  free(data);
+  return waited;
+}
+#endif
+
 int pkmanager_test(void)
 {
 #if PK_TESTS
   void *N = NULL;
   char buffer[PK_MANAGER_MINSIZE];
   struct pk_manager* m;
-  struct pk_backend_conn* c;
+  struct pk_backend_conn *c, *c2, *c3;
+  struct pk_tunnel* fe;
+  struct pk_pagekite* kite;
+  struct pk_kite_backend* be;
   struct pk_job j;
   struct addrinfo ai;
+  pthread_t responder;
+  const char* url;
   int i;
 
   /* Are too-small buffers handled correctly? */
@@ -1857,6 +3402,8 @@ int pkmanager_test(void)
   assert(m->tunnel_max == MIN_FE_ALLOC);
   assert(m->kite_max == MIN_KITE_ALLOC);
   assert(m->be_conn_max == MIN_CONN_ALLOC);
+  assert(0 == (uintptr_t) m->be_conns % PK_CACHE_LINE_BYTES);
+  assert(0 == sizeof(struct pk_backend_conn) % PK_CACHE_LINE_BYTES);
   fprintf(stderr, "pkm_manager_init tests passed (3/3)\n");
 
   /* Ensure memory regions don't overlap */
@@ -1883,6 +3430,32 @@ int pkmanager_test(void)
   assert(j.job == PK_QUIT);
   fprintf(stderr, "pk_add_job and pk_get_job tests passed\n");
 
+  /* Rejection URLs are cached, the app is asked on a blocker thread */
+  url = m->fancy_pagekite_net_rejection_url;
+  assert(url == pkm_fancy_rejection_url(m, "foo.example.com"));
+  assert(0 == m->blocking_jobs.count);  /* Nobody is listening */
+  m->events.event_mask = PK_EV_MASK_MISC;
+  assert(url == pkm_fancy_rejection_url(m, "foo.example.com"));
+  assert(1 == m->blocking_jobs.count);
+  assert(url == pkm_fancy_rejection_url(m, "bar.example.com"));
+  assert(1 == m->blocking_jobs.count);  /* One question at a time */
+  assert(0 < pkb_get_job(&(m->blocking_jobs), &j));
+  assert(j.job == PK_LOOKUP_FANCY_URL);
+  pthread_create(&responder, NULL, pkm_fancy_url_test_responder, m);
+  pkm_lookup_fancy_url(m, j.int_data);
+  pthread_join(responder, NULL);
+  url = pkm_fancy_rejection_url(m, "FOO.example.com");
+  assert(0 == strcmp(url, "https://example.com/offline/"));
+  assert(0 == m->blocking_jobs.count);
+  /* Expired answers are still used while they are being refreshed */
+  m->fancy_urls[j.int_data].expires = pk_time() - 1;
+  assert(url == pkm_fancy_rejection_url(m, "foo.example.com"));
+  assert(0 < pkb_get_job(&(m->blocking_jobs), &j));
+  assert(j.job == PK_LOOKUP_FANCY_URL);
+  m->fancy_urls[j.int_data].pending = 0;
+  m->events.event_mask = PK_EV_NONE;
+  fprintf(stderr, "fancy rejection URL tests passed\n");
+
   /* Test pk_add_frontend_ai */
   memset(&ai, 0, sizeof(struct addrinfo));
   for (i = 0; i < MIN_FE_ALLOC; i++)
@@ -1892,14 +3465,237 @@ int pkmanager_test(void)
   fprintf(stderr, "pk_add_frontend_ai tests passed\n");
 
   /* Test pk_add_kite */
-  for (i = 0; i < MIN_KITE_ALLOC; i++)
+  assert(NULL != pkm_add_kite(m, "http", "*.example.com", 0, "sec", "lh", 80));
+  assert(NULL != pkm_add_kite(m, "http", "*.b.example.com", 80, "s", "lh", 80));
+  assert(NULL != pkm_add_kite(m, "https-8443", "a.example.com", 0, "s", N, 0));
+  for (i = 3; i < MIN_KITE_ALLOC; i++)
     assert(NULL != pkm_add_kite(m, "http", "foo", 80, "sec", "localhost", 80));
   assert(NULL == pkm_add_kite(m, "http", "foo", 80, "sec", "localhost", 80));
   assert(ERR_NO_MORE_KITES == pk_error);
-  assert(NULL != pkm_find_kite(m, "http", "foo", 80));
+  assert(NULL != (kite = pkm_find_kite(m, "http", "foo", 80)));
+  assert(kite == pkm_find_kite(m, "HTTP", "Foo", 80));
+  assert(NULL == pkm_find_kite(m, "http", "foo", 8080));
   assert(NULL == pkm_find_kite(m, "http", "bar", 80));
   fprintf(stderr, "pk_add_kite tests passed\n");
 
+  /* Test wildcard and port matching */
+  assert(m->kites == pkm_find_kite(m, "http", "x.example.com", 8080));
+  assert(m->kites == pkm_find_kite(m, "http", "x.y.example.com", 80));
+  assert(m->kites + 1 == pkm_find_kite(m, "http", "x.B.example.com", 80));
+  assert(m->kites == pkm_find_kite(m, "http", "x.b.example.com", 81));
+  assert(NULL == pkm_find_kite(m, "http", "example.com", 80));
+  assert(NULL == pkm_find_kite(m, "https", "x.example.com", 443));
+  assert(m->kites + 2 == pkm_find_kite(m, "https", "a.example.com", 8443));
+  assert(NULL == pkm_find_kite(m, "https", "a.example.com", 443));
+  assert(2 == m->kite_wildcards);
+  fprintf(stderr, "pkm_find_kite tests passed\n");
+
+  /* Test backend address caching */
+  be = kite->backends;
+  assert(1 == kite->backend_count);
+  assert(0 == be->local_addrlen);
+  strcpy(be->local_domain, "127.0.0.1");
+  assert(0 == pkm_resolve_backend(m, be));
+  assert(sizeof(struct sockaddr_in) == be->local_addrlen);
+  assert(AF_INET == be->local_addr.ss_family);
+  assert(htons(80) == ((struct sockaddr_in*) &(be->local_addr))->sin_port);
+  assert(be->local_addr_expires > pk_time() + PK_BACKEND_DNS_NEGATIVE_TTL);
+  strcpy(be->local_domain, "::1");
+  if (0 == pkm_resolve_backend(m, be))
+    assert(AF_INET6 == be->local_addr.ss_family);
+  else  /* No IPv6 on this host */
+    fprintf(stderr, "pkm_resolve_backend: skipped IPv6 test\n");
+  strcpy(be->local_domain, "");
+  assert(0 > pkm_resolve_backend(m, be));
+  assert(0 == be->local_addrlen);
+  assert(be->local_addr_expires <= pk_time() + PK_BACKEND_DNS_NEGATIVE_TTL);
+  strcpy(be->local_domain, "localhost");
+  fprintf(stderr, "pkm_resolve_backend tests passed\n");
+
+  /* Test the pool of pre-connected backend sockets */
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  int lfd, pfd;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(0 <= (lfd = socket(AF_INET, SOCK_STREAM, 0)));
+  assert(0 == bind(lfd, (struct sockaddr*) &sin, sizeof(sin)));
+  assert(0 == listen(lfd, 8));
+  assert(0 == getsockname(lfd, (struct sockaddr*) &sin, &sinlen));
+  strcpy(be->local_domain, "127.0.0.1");
+  be->local_port = ntohs(sin.sin_port);
+  assert(0 == pkm_resolve_backend(m, be));
+  m->be_pool_min = 2;
+  m->be_pool_max = 4;
+  assert(2 == pkm_be_pool_fill(m, be));
+  assert(2 == be->pool_size);
+  assert(be->pool_gen[0] + 1 == be->pool_gen[1]);
+  /* Backend closes the oldest: it is skipped, the newest is handed out */
+  assert(0 <= (pfd = accept(lfd, NULL, NULL)));
+  close(pfd);
+  assert(be->pool_fds[1] == (pfd = pkm_be_pool_take(m, be)));
+  close(pfd);
+  assert(0 > pkm_be_pool_take(m, be));
+  assert(0 == be->pool_size);
+  assert(1 == be->pool_taken);
+  /* Refills to the minimum, then disabling the pool empties it */
+  assert(2 == pkm_be_pool_fill(m, be));
+  assert(0 == be->pool_taken);
+  /* Refilling drops dead sockets and replaces them */
+  assert(0 <= (pfd = accept(lfd, NULL, NULL)));  /* Taken above */
+  close(pfd);
+  assert(0 <= (pfd = accept(lfd, NULL, NULL)));  /* Oldest pooled */
+  close(pfd);
+  pfd = be->pool_fds[1];
+  i = be->pool_gen[1];
+  assert(1 == pkm_be_pool_fill(m, be));
+  assert((2 == be->pool_size) && (pfd == be->pool_fds[0]));
+  assert((i == be->pool_gen[0]) && (i + 1 == be->pool_gen[1]));
+  m->be_pool_min = m->be_pool_max = 0;
+  assert(0 == pkm_be_pool_fill(m, be));
+  assert(0 == be->pool_size);
+  close(lfd);
+  strcpy(be->local_domain, "localhost");
+  be->local_port = 80;
+  fprintf(stderr, "pkm_be_pool tests passed\n");
+
+#ifdef HAVE_AF_UNIX
+  /* Test Unix domain socket backends */
+  struct sockaddr_un sun;
+  char rbuf[16];
+  strcpy(be->local_domain, "unix:@pk-test");
+  assert(0 == pkm_resolve_backend(m, be));
+  assert(AF_UNIX == be->local_addr.ss_family);
+  assert('\0' == ((struct sockaddr_un*) &(be->local_addr))->sun_path[0]);
+  assert(be->local_addrlen == sizeof(sun) - sizeof(sun.sun_path) + 8);
+  strcpy(be->local_domain, "unix:");
+  assert(0 > pkm_resolve_backend(m, be));
+  assert(0 == be->local_addrlen);
+
+  sprintf(be->local_domain, "unix:/tmp/pk-test-%d.sock", getpid());
+  assert(0 == pkm_resolve_backend(m, be));
+  memcpy(&sun, &(be->local_addr), sizeof(sun));
+  unlink(sun.sun_path);
+  assert(0 <= (lfd = socket(AF_UNIX, SOCK_STREAM, 0)));
+  assert(0 == bind(lfd, (struct sockaddr*) &sun, be->local_addrlen));
+  assert(0 == listen(lfd, 8));
+  m->be_pool_min = m->be_pool_max = 1;
+  assert(1 == pkm_be_pool_fill(m, be));
+  assert(0 <= (pfd = pkm_be_pool_take(m, be)));
+  assert(5 == write(pfd, "hello", 5));
+  close(pfd);
+  assert(0 <= (pfd = accept(lfd, NULL, NULL)));
+  assert(5 == read(pfd, rbuf, sizeof(rbuf)));
+  close(pfd);
+  m->be_pool_min = m->be_pool_max = 0;
+  close(lfd);
+  unlink(sun.sun_path);
+  strcpy(be->local_domain, "localhost");
+  fprintf(stderr, "Unix socket backend tests passed\n");
+#endif
+
+  /* Test multiple backends per kite */
+  assert(0 == pkm_add_kite_backend(m, "http", "foo", 80, "localhost", 81, 2));
+  assert(0 > pkm_add_kite_backend(m, "http", "bar", 80, "localhost", 81, 1));
+  assert(ERR_NO_KITE == pk_error);
+  for (i = kite->backend_count; i < PK_KITE_BACKENDS_MAX; i++)
+    assert(0 == pkm_add_kite_backend(m, "http-80", "foo", 0, "::1", 80, 0));
+  assert(0 > pkm_add_kite_backend(m, "http", "foo", 80, "localhost", 81, 1));
+  assert(ERR_NO_MORE_BACKENDS == pk_error);
+  assert(1 == kite->backends[PK_KITE_BACKENDS_MAX-1].weight);
+  kite->backend_count = 2;
+  assert(2 == kite->backends[1].weight);
+  assert(81 == kite->backends[1].local_port);
+
+  /* Round robin follows the weights, without bunching up */
+  char picks[8];
+  m->be_balancing = PK_BALANCE_ROUND_ROBIN;
+  for (i = 0; i < 6; i++)
+    picks[i] = (kite->backends == pkm_choose_backend(m, kite)) ? 'a' : 'b';
+  picks[6] = '\0';
+  assert(0 == strcmp(picks, "babbab"));
+
+  /* Least connections compares active streams per unit of weight */
+  m->be_balancing = PK_BALANCE_LEAST_CONNS;
+  kite->backends[0].active = 1;
+  kite->backends[1].active = 1;
+  assert(kite->backends + 1 == pkm_choose_backend(m, kite));
+  kite->backends[1].active = 3;
+  assert(kite->backends == pkm_choose_backend(m, kite));
+
+  /* Failing backends are skipped for a while */
+  for (i = 0; i < PK_BACKEND_FAILURES_MAX; i++) {
+    assert(kite->backends == pkm_choose_backend(m, kite));
+    pkm_backend_result(m, kite, kite->backends, 0);
+  }
+  assert(kite->backends[0].down_until > pk_time());
+  assert(kite->backends + 1 == pkm_choose_backend(m, kite));
+  assert(PK_BREAKER_CLOSED == kite->breaker);
+
+  /* ... if all of them are, the circuit breaker opens */
+  kite->backends[1].down_until = kite->backends[0].down_until;
+  assert(NULL == pkm_choose_backend(m, kite));
+  assert(PK_BREAKER_OPEN == kite->breaker);
+  assert(NULL == pkm_choose_backend(m, kite));
+  assert(1 == kite->breaker_trips);
+
+  /* Once a backend is due, one stream is let through as a probe */
+  kite->backends[0].down_until = pk_time() - 1;
+  assert(kite->backends == pkm_choose_backend(m, kite));
+  assert(PK_BREAKER_HALF_OPEN == kite->breaker);
+  i = kite->backends[0].rr_current;
+  assert(NULL == pkm_choose_backend(m, kite));
+  assert(i == kite->backends[0].rr_current);  /* No pick, no turn used */
+
+  /* If the probe fails, the breaker opens again; success closes it */
+  pkm_backend_result(m, kite, kite->backends, 0);
+  assert(kite->backends[0].down_until > pk_time());
+  assert(NULL == pkm_choose_backend(m, kite));
+  assert(PK_BREAKER_OPEN == kite->breaker);
+  kite->backends[0].down_until = pk_time() - 1;
+  assert(kite->backends == pkm_choose_backend(m, kite));
+  pkm_backend_result(m, kite, kite->backends, 1);
+  assert(PK_BREAKER_CLOSED == kite->breaker);
+  assert(1 == kite->breaker_trips);
+  assert(0 == kite->backends[0].failures);
+  assert(0 == kite->backends[0].down_until);
+  assert(kite->backends == pkm_choose_backend(m, kite));
+
+  /* The blocker threads probe backends while the breaker is open */
+  be = kite->backends + 1;
+  sin.sin_port = 0;
+  assert(0 <= (lfd = socket(AF_INET, SOCK_STREAM, 0)));
+  assert(0 == bind(lfd, (struct sockaddr*) &sin, sizeof(sin)));
+  assert(0 == listen(lfd, 8));
+  assert(0 == getsockname(lfd, (struct sockaddr*) &sin, &sinlen));
+  strcpy(be->local_domain, "127.0.0.1");
+  be->local_port = ntohs(sin.sin_port);
+  assert(0 == pkm_resolve_backend(m, be));
+  kite->breaker = PK_BREAKER_OPEN;
+  kite->backends[0].down_until = be->down_until = pk_time() + 60;
+  assert(0 == pkm_probe_backends(m, kite));  /* Not due yet */
+  be->down_until = pk_time();
+  assert(1 == pkm_probe_backends(m, kite));
+  assert(PK_BREAKER_CLOSED == kite->breaker);
+  assert(0 == be->down_until);
+  assert(0 == kite->backends[0].failures);
+  kite->backends[0].down_until = 0;
+  close(lfd);
+  fprintf(stderr, "circuit breaker tests passed\n");
+
+  /* Freeing a conn stops counting it against its backend */
+  kite->backends[0].active = 0;
+  assert(NULL != (c = pkm_alloc_be_conn(m, NULL, "lb")));
+  c->backend = kite->backends;
+  kite->backends[0].active++;
+  pkm_free_be_conn(c);
+  assert(0 == kite->backends[0].active);
+  assert(NULL == c->backend);
+  kite->backends[1].down_until = kite->backends[1].active = 0;
+  kite->backend_count = 1;
+  fprintf(stderr, "pkm_choose_backend tests passed\n");
+
   /* Test pk_*_be_conn */
   assert(NULL == pkm_find_be_conn(m, NULL, "abc"));
   assert(NULL != pkm_alloc_be_conn(m, NULL, "abc"));
@@ -1910,11 +3706,168 @@ int pkmanager_test(void)
   assert(0 == c->conn.read_kb);
   assert(0 == c->conn.read_bytes);
   assert(CONN_IO_BUFFER_SIZE == PKC_IN_FREE(c->conn));
-  assert(CONN_IO_BUFFER_SIZE == PKC_OUT_FREE(c->conn));
+  assert(0 == c->conn.out_buffer_pos);
+  assert(NULL == c->conn.in_buffer);
+  assert(NULL == c->conn.out_head);
   pkm_free_be_conn(c);
   assert(NULL == pkm_find_be_conn(m, NULL, "abc"));
+  assert(NULL != pkm_find_be_conn(m, NULL, "abcd"));
+  assert(NULL == pkm_find_be_conn(m, m->tunnels, "abcd"));
+  assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, "abcd")));
+  assert(c == pkm_find_be_conn(m, m->tunnels, "abcd"));
+  assert(c != pkm_find_be_conn(m, NULL, "abcd"));
   fprintf(stderr, "pk_*_be_conn tests passed\n");
 
+  /* Churn through lots of SIDs; tombstones must not fill up the index. */
+  for (i = 0; i < 100 * MIN_CONN_ALLOC; i++) {
+    char sid[BE_MAX_SID_SIZE+1];
+    sprintf(sid, "%x", i);
+    assert(NULL != (c = pkm_alloc_be_conn(m, NULL, sid)));
+    c->conn.status &= ~CONN_STATUS_CHANGING;
+    assert(c == pkm_find_be_conn(m, NULL, sid));
+    pkm_free_be_conn(c);
+    assert(NULL == pkm_find_be_conn(m, NULL, sid));
+    assert(m->be_conn_index_used <= (int) m->be_conn_index_mask);
+  }
+  assert(NULL != pkm_find_be_conn(m, NULL, "abcef"));
+  assert(NULL != pkm_find_be_conn(m, m->tunnels, "abcd"));
+  fprintf(stderr, "pk_*_be_conn index tests passed\n");
+
+  /* Fill the table up, then make sure the idlest conn gets evicted. */
+  pkm_reset_manager(m);
+  for (i = 0; i < MIN_CONN_ALLOC; i++) {
+    char sid[BE_MAX_SID_SIZE+1];
+    sprintf(sid, "lru%d", i);
+    assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, sid)));
+    c->conn.status &= ~CONN_STATUS_CHANGING;
+    c->conn.activity = pk_time() - 1000 + i;
+  }
+  assert(NULL == m->be_conn_free.head);
+  assert(0 == strcmp(m->be_conn_lru.head->sid, "lru0"));
+  pk_state.conn_eviction_idle_s = 0;
+  assert(NULL == pkm_alloc_be_conn(m, m->tunnels, "nope"));
+  pk_state.conn_eviction_idle_s = 1;
+  (c = pkm_find_be_conn(m, m->tunnels, "lru0"))->conn.status |= CONN_STATUS_CHANGING;
+  assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, "evict")));
+  assert(c == pkm_find_be_conn(m, m->tunnels, "evict"));
+  assert(NULL == pkm_find_be_conn(m, m->tunnels, "lru1"));
+  assert(NULL != pkm_find_be_conn(m, m->tunnels, "lru0"));
+  assert(c == m->be_conn_lru.tail);
+  pkm_free_be_conn(c);
+  assert(c == m->be_conn_free.tail);
+  /* Touching a conn makes it the busiest... */
+  c = pkm_find_be_conn(m, m->tunnels, "lru2");
+  c->conn.status &= ~CONN_STATUS_CHANGING;
+  pkm_be_conn_touch(c);
+  assert((c == m->be_conn_lru.tail) && (pk_time() == c->conn.activity));
+  /* ... but if activity was bumped behind our back, we look past it */
+  assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, "fill")));
+  c->conn.status &= ~CONN_STATUS_CHANGING;
+  pkm_find_be_conn(m, m->tunnels, "lru0")->conn.status &= ~CONN_STATUS_CHANGING;
+  pkm_find_be_conn(m, m->tunnels, "lru0")->conn.activity = pk_time();
+  assert(m->be_conn_lru.head == pkm_find_be_conn(m, m->tunnels, "lru0"));
+  assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, "evict2")));
+  assert(NULL != pkm_find_be_conn(m, m->tunnels, "lru0"));
+  assert(NULL == pkm_find_be_conn(m, m->tunnels, "lru3"));
+  pk_state.conn_eviction_idle_s = 0;
+  fprintf(stderr, "pk_*_be_conn eviction tests passed\n");
+
+  /* Streams are listed on their tunnel, throttled ones twice */
+  pkm_reset_manager(m);
+  fe = m->tunnels;
+  assert(NULL != (c = pkm_alloc_be_conn(m, fe, "s1")));
+  assert(NULL != (c2 = pkm_alloc_be_conn(m, fe + 1, "s2")));
+  assert(NULL != (c3 = pkm_alloc_be_conn(m, fe, "s3")));
+  assert((fe->streams.head == c) && (c->tunnel_next == c3));
+  assert((fe->streams.tail == c3) && (c3->tunnel_prev == c));
+  assert((fe[1].streams.head == c2) && (fe[1].streams.tail == c2));
+  pkm_be_conn_throttle(c);
+  pkm_be_conn_throttle(c3);
+  pkm_be_conn_throttle(c);
+  assert((fe->throttled.head == c) && (fe->throttled.tail == c3));
+  pkm_free_be_conn(c);
+  assert(!pkm_be_conn_on_tunnel(c));
+  assert((fe->streams.head == c3) && (NULL == c3->tunnel_prev));
+  assert((fe->throttled.head == c3) && (fe->throttled.tail == c3));
+  pkm_free_be_conn(c3);
+  assert((NULL == fe->streams.head) && (NULL == fe->throttled.head));
+  assert(pkm_be_conn_on_tunnel(c2));
+  pkm_free_be_conn(c2);
+  assert(NULL == fe[1].streams.tail);
+
+  /* Connecting streams remember what was requested, until done */
+  assert(NULL != (c = pkm_alloc_be_conn(m, fe, "s1")));
+  assert(NULL != (c2 = pkm_alloc_be_conn(m, fe, "s2")));
+  pkm_be_conn_connecting(c, "http", "a.example.com");
+  pkm_be_conn_connecting(c2, "https", "b.example.com");
+  assert((m->be_conn_connecting.head == c) && (c->connecting_next == c2));
+  assert(0 == strcmp(c2->request_host, "b.example.com"));
+  pkm_be_conn_connect_done(c);
+  assert((NULL == c->request_host) && (m->be_conn_connecting.head == c2));
+  pkm_free_be_conn(c2);
+  assert((NULL == m->be_conn_connecting.head) && (NULL == c2->request_proto));
+  pkm_free_be_conn(c);
+  fprintf(stderr, "pk_*_be_conn tunnel list tests passed\n");
+
+  /* With a higher limit, a full table grows instead of evicting... */
+  pkm_reset_manager(m);
+  m->be_conn_limit = MIN_CONN_ALLOC + PK_BE_CONN_SEGMENT;
+  for (i = 0; i <= MIN_CONN_ALLOC; i++) {
+    char sid[BE_MAX_SID_SIZE+1];
+    sprintf(sid, "grow%d", i);
+    assert(NULL != (c = pkm_alloc_be_conn(m, fe, sid)));
+    c->conn.status &= ~CONN_STATUS_CHANGING;
+  }
+  assert(m->be_conn_max == MIN_CONN_ALLOC + PK_BE_CONN_SEGMENT);
+  assert(1 == m->be_conn_segment_count);
+  assert(c == pkm_be_conn_at(m, MIN_CONN_ALLOC));
+  assert(0 == (uintptr_t) m->be_conn_segments[0] % PK_CACHE_LINE_BYTES);
+  assert(2 * m->be_conn_max <= (int) m->be_conn_index_mask + 1);
+  for (i = 0; i <= MIN_CONN_ALLOC; i++) {
+    char sid[BE_MAX_SID_SIZE+1];
+    sprintf(sid, "grow%d", i);
+    assert(NULL != pkm_find_be_conn(m, fe, sid));
+  }
+  assert(NULL == pkm_find_be_conn(m, fe, "nope"));
+
+  /* ... and shrinks again once the extra conns have been idle a while:
+   * a segment that was busy until just now is not idle, however long ago
+   * it was grown. */
+  m->be_conn_last_used = pk_time() - PK_BE_CONN_SHRINK_IDLE - 1;
+  pkm_be_conn_table_shrink(m);
+  assert(1 == m->be_conn_segment_count);
+  for (i = 0; i <= MIN_CONN_ALLOC; i++) {
+    char sid[BE_MAX_SID_SIZE+1];
+    sprintf(sid, "grow%d", i);
+    pkm_free_be_conn(pkm_find_be_conn(m, fe, sid));
+  }
+  assert(m->be_conn_last_used >= pk_time() - 1);
+  pkm_be_conn_table_shrink(m);
+  assert(1 == m->be_conn_segment_count);
+  m->be_conn_last_used = pk_time() - PK_BE_CONN_SHRINK_IDLE - 1;
+  pkm_be_conn_table_shrink(m);
+  assert(0 == m->be_conn_segment_count);
+  assert(m->be_conn_max == MIN_CONN_ALLOC);
+  assert(NULL != (c = pkm_alloc_be_conn(m, fe, "after")));
+  assert(c == pkm_find_be_conn(m, fe, "after"));
+  pkm_free_be_conn(c);
+  m->be_conn_limit = m->be_conn_base;
+  fprintf(stderr, "elastic be_conn table tests passed\n");
+
+  /* Busy tunnels take turns, weighted by kite */
+  pkm_reset_manager(m);
+  assert(NULL != (kite = pkm_add_kite(m, "http", "foo", 80, "s", "lh", 80)));
+  assert(1 == kite->weight);
+  assert(0 == pkm_set_kite_weight(m, "http", "foo", 80, 1000));
+  assert(PK_SCHED_WEIGHT_MAX == kite->weight);
+  assert(0 == pkm_set_kite_weight(m, "http-80", "FOO", 0, -1));
+  assert(1 == kite->weight);
+  assert(0 > pkm_set_kite_weight(m, "http", "bar", 80, 2));
+  assert(ERR_NO_KITE == pk_error);
+  assert(1 == pkm_schedule_tunnel_test(m, kite, 1));
+  assert(2 == pkm_schedule_tunnel_test(m, kite, 2));
+  fprintf(stderr, "tunnel scheduler tests passed\n");
+
   /* Cleanup */
   pkm_manager_free(m);
 #endif
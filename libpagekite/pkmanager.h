@@ -24,6 +24,16 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_CHECK_WORLD_INTERVAL          3600 /* 1 hour */
 #define PK_DDNS_UPDATE_INTERVAL_MIN       360 /* Less than 300 makes no sense,
                                                  due to DNS caching TTLs. */
+#define PK_BACKEND_DNS_TTL                300 /* Re-resolve backends this often */
+#define PK_BACKEND_DNS_NEGATIVE_TTL        15 /* ... or this, if lookups fail */
+#define PK_BACKEND_POOL_IDLE_DEF           30 /* Close idle pooled sockets */
+#define PK_BACKEND_FAILURES_MAX             3 /* Failed connects in a row */
+#define PK_BACKEND_DOWN_TIME               10 /* ... sideline backend this long */
+#define PK_BE_CONN_SEGMENT                 64 /* Conns added when growing */
+#define PK_BE_CONN_SEGMENTS_MAX           256 /* ... at most this many times */
+#define PK_BE_CONN_SHRINK_IDLE             60 /* Release idle segments after */
+#define PK_FANCY_URL_CACHE_MAX             16 /* Rejection URLs, per host */
+#define PK_FANCY_URL_TTL                  300 /* Ask the app again this often */
 
 struct pk_tunnel;
 struct pk_backend_conn;
@@ -31,6 +41,18 @@ struct pk_manager;
 struct pk_job;
 struct pk_job_pile;
 
+/* Backend conns are kept on intrusive lists: free conns on a free list,
+ * allocated conns on an LRU list ordered by activity (idlest first), so
+ * allocation and eviction are both O(1). Listeners are on neither.
+ * Streams are also on their tunnel's list of streams, and while the
+ * tunnel is blocking them, on its list of throttled streams. Streams
+ * waiting for connect() to complete are on the manager's connecting list,
+ * along with the request details needed to reject them if it fails. */
+struct pk_backend_conn_list {
+  struct pk_backend_conn* head;
+  struct pk_backend_conn* tail;
+};
+
 /* These are also written to the conn.status field, using the fourth byte. */
 #define FE_STATUS_BITS      0xFF000000
 #define FE_STATUS_AUTO      0x00000000  /* For use in pkm_add_tunnel       */
@@ -51,6 +73,10 @@ struct pk_tunnel {
   /* These apply to all tunnels (frontend or backend) */
   struct addrinfo         ai;
   struct pk_conn          conn;
+  int                     output_blocked; /* Backends throttled by queue */
+  struct pk_backend_conn_list streams;
+  struct pk_backend_conn_list throttled;
+  struct pk_backend_conn_list ready;      /* Streams waiting for their turn */
   int                     error_count;
   char                    fe_session[PK_HANDSHAKE_SESSIONID_MAX+1];
   time_t64                last_ping;
@@ -68,34 +94,104 @@ struct pk_tunnel {
 #define BE_STATUS_EOF_READ       0x00010000
 #define BE_STATUS_EOF_WRITE      0x00020000
 #define BE_STATUS_EOF_THROTTLED  0x00040000
+#define BE_STATUS_SCHEDULED      0x00080000 /* On tunnel->ready, see below */
+#define BE_STATUS_SKB_PENDING    0x00100000 /* Progress waiting on skb_timer */
 #define BE_MAX_SID_SIZE          8
-struct pk_backend_conn {
+/* Walks over the whole conn table only look at the tunnel, index_slot
+ * and the first few fields of conn (status, sockfd, activity), so those
+ * come first: one cache line per conn. The struct is padded to a whole
+ * number of lines, so with an aligned table each conn starts on a line of
+ * its own. I/O buffers are borrowed from the buffer pool, so they do not
+ * bloat the table either. */
+#define PK_CACHE_LINE_BYTES      64
+#if defined(__GNUC__)
+#  define PK_CACHE_ALIGNED       __attribute__((aligned(PK_CACHE_LINE_BYTES)))
+#elif defined(_MSC_VER)
+#  define PK_CACHE_ALIGNED       __declspec(align(PK_CACHE_LINE_BYTES))
+#else
+#  define PK_CACHE_ALIGNED
+#endif
+struct PK_CACHE_ALIGNED pk_backend_conn {
   PK_MEMORY_CANARY
-  char                 sid[BE_MAX_SID_SIZE+1];
   struct pk_tunnel*    tunnel;
-  struct pk_pagekite*  kite;
+  int                  index_slot;   /* Position in be_conn_index, or -1 */
   struct pk_conn       conn;
+  char                 sid[BE_MAX_SID_SIZE+1];
+  char                 sid_header[BE_MAX_SID_SIZE+8]; /* "SID: %s\r\n" */
+  size_t               sid_header_length;
+  struct pk_manager*   manager;
+  struct pk_pagekite*  kite;
+  struct pk_kite_backend* backend;   /* Counted in backend->active */
+  struct pk_backend_conn_list* list;
+  struct pk_backend_conn*      list_prev;
+  struct pk_backend_conn*      list_next;
+  struct pk_backend_conn*      tunnel_prev;     /* tunnel->streams */
+  struct pk_backend_conn*      tunnel_next;
+  struct pk_backend_conn*      throttled_prev;  /* tunnel->throttled */
+  struct pk_backend_conn*      throttled_next;
+  struct pk_backend_conn*      ready_prev;      /* tunnel->ready */
+  struct pk_backend_conn*      ready_next;
+  int                          deficit;         /* Bytes, may go negative */
+  struct pk_backend_conn*      connecting_prev; /* be_conn_connecting */
+  struct pk_backend_conn*      connecting_next;
+  char*                        request_proto;   /* Malloced, while on it */
+  char*                        request_host;
   pagekite_callback_t* callback_func;
   void*                callback_data;
 };
 
+/* When a tunnel is busy, readable streams wait on tunnel->ready and are
+ * read in deficit round robin order as the tunnel drains, so one bulk
+ * transfer can't push everything else to the back of a deep queue. Each
+ * turn a stream may read PK_SCHED_QUANTUM bytes times its kite's weight. */
+#define PK_SCHED_QUANTUM         CONN_IO_BUFFER_SIZE
+#define PK_SCHED_TUNNEL_BUSY     CONN_IO_BUFFER_SIZE /* Bytes queued */
+#define PK_SCHED_WEIGHT_MAX      64
+
 #define MIN_KITE_ALLOC        4
 #define MIN_FE_ALLOC          2
 #define MIN_CONN_ALLOC       16
 #define MAX_BLOCKING_THREADS 16
+
+/* The (tunnel, SID) -> backend conn index is an open-addressing hash table
+ * with a power-of-two size of at least twice the number of conns, so it
+ * never needs more than 4 pointers per conn.  Freed entries are replaced
+ * by a tombstone so probe chains stay intact; the table is rebuilt when
+ * tombstones start to crowd out empty slots. */
+#define BE_CONN_INDEX_TOMBSTONE  ((struct pk_backend_conn*) -1)
+#define BE_CONN_INDEX_MAX(c)     (4 * (c))
+
+/* Kites are indexed the same way, by (protocol, domain, port). Kites are
+ * only ever removed all at once, so this one needs no tombstones. */
+#define PK_KITE_INDEX_MAX(k)     (4 * (k))
+
 #define PK_MANAGER_BUFSIZE(k, f, c, ps) \
                            (1 + sizeof(struct pk_manager) \
                             + sizeof(struct pk_pagekite) * k \
+                            + sizeof(struct pk_pagekite*) \
+                                                  * PK_KITE_INDEX_MAX(k) \
                             + sizeof(struct pk_tunnel) * f \
                             + sizeof(struct pk_kite_request) * f * k \
                             + ps * f \
+                            + PK_CACHE_LINE_BYTES \
                             + sizeof(struct pk_backend_conn) * c \
+                            + sizeof(struct pk_backend_conn*) \
+                                                  * BE_CONN_INDEX_MAX(c) \
                             + sizeof(struct pk_job) * (c+f))
 #define PK_MANAGER_MINSIZE PK_MANAGER_BUFSIZE(MIN_KITE_ALLOC, MIN_FE_ALLOC, \
                                               MIN_CONN_ALLOC, PARSER_BYTES_MIN)
 #define PK_TUNNEL_ITER(pkm, fe) for (struct pk_tunnel* fe = pkm->tunnels; fe < (pkm->tunnels + pkm->tunnel_max); fe++)
 #define PK_KITE_ITER(pkm, kite) for (struct pk_pagekite* kite = pkm->kites; kite < (pkm->kites + pkm->kite_max); kite++)
 
+/* Answers to PK_EV_CFG_FANCY_URL events, so rejecting a stream never
+ * has to wait for the application.  A NULL url means "use the default". */
+struct pk_fancy_url {
+  char*                    host;
+  char*                    url;
+  time_t64                 expires;
+  int                      pending;
+};
+
 struct pk_manager {
   pk_status_t              status;
 
@@ -103,8 +199,23 @@ struct pk_manager {
   char*                    buffer;
   char*                    buffer_base;
   struct pk_pagekite*      kites;
+  struct pk_pagekite**     kite_index;
+  unsigned int             kite_index_mask;
+  struct pk_pagekite*      kite_free;
+  int                      kite_wildcards;       /* Kites named *.domain */
   struct pk_tunnel*        tunnels;
-  struct pk_backend_conn*  be_conns;
+  struct pk_backend_conn*  be_conns;              /* In the buffer */
+  int                      be_conn_base;          /* ... this many */
+  struct pk_backend_conn*  be_conn_segments[PK_BE_CONN_SEGMENTS_MAX];
+  int                      be_conn_segment_count; /* Malloced, see below */
+  time_t64                 be_conn_last_used;     /* Newest segment */
+  struct pk_backend_conn** be_conn_index;
+  unsigned int             be_conn_index_mask;
+  int                      be_conn_index_used;   /* Live + tombstones */
+  unsigned int             be_conn_index_malloced:1;
+  struct pk_backend_conn_list be_conn_free;
+  struct pk_backend_conn_list be_conn_lru;
+  struct pk_backend_conn_list be_conn_connecting;
 
   PK_MEMORY_CANARY
 
@@ -117,6 +228,8 @@ struct pk_manager {
   ev_async                 quit;
   ev_async                 tick;
   ev_timer                 timer;
+  ev_prepare               flush;
+  ev_timer                 skb_timer;
 
   time_t64                 last_world_update;
   time_t64                 next_tick;
@@ -132,18 +245,26 @@ struct pk_manager {
   /* Settings */
   int                      kite_max;
   int                      tunnel_max;
-  int                      be_conn_max;
+  int                      be_conn_max;          /* Current table size */
+  int                      be_conn_limit;        /* Grow up to this */
   unsigned int             was_malloced:1;
   unsigned int             ev_loop_malloced:1;
   unsigned int             enable_watchdog:1;
   unsigned int             enable_http_forwarding_headers:1;
   int                      want_spare_frontends;
   char*                    fancy_pagekite_net_rejection_url;
+  struct pk_fancy_url      fancy_urls[PK_FANCY_URL_CACHE_MAX];
   char*                    dynamic_dns_url;
   time_t64                 interval_fudge_factor;
   time_t64                 housekeeping_interval_min;
   time_t64                 housekeeping_interval_max;
   time_t64                 check_world_interval;
+  int                      be_pool_min;
+  int                      be_pool_max;
+  time_t64                 be_pool_idle_s;
+  int                      be_balancing;
+  int                      flow_control;         /* PK_FLOW_CONTROL_* */
+  int                      flow_window_max_kb;
 };
 
 
@@ -162,10 +283,29 @@ struct pk_tunnel*    pkm_add_frontend_ai(struct pk_manager*, struct addrinfo*,
 struct pk_pagekite*  pkm_add_kite(struct pk_manager*,
                                   const char*, const char*, int, const char*,
                                   const char*, int);
+int                  pkm_add_kite_backend(struct pk_manager*,
+                                          const char*, const char*, int,
+                                          const char*, int, int);
+int                  pkm_set_kite_weight(struct pk_manager*,
+                                         const char*, const char*, int, int);
+int                  pkm_resolve_backend(struct pk_manager*,
+                                         struct pk_kite_backend*);
+int                  pkm_be_pool_fill(struct pk_manager*,
+                                      struct pk_kite_backend*);
+int                  pkm_probe_backends(struct pk_manager*,
+                                        struct pk_pagekite*);
+int                  pkm_kites_to_check(struct pk_manager*,
+                                        struct pk_pagekite**);
+void                 pkm_kites_checked(struct pk_manager*,
+                                       struct pk_pagekite**, int);
+const char*          pkm_fancy_rejection_url(struct pk_manager*,
+                                             const char*);
+void                 pkm_lookup_fancy_url(struct pk_manager*, int);
 
 int                 pkm_add_listener(struct pk_manager*, const char*, int,
                                      pagekite_callback_t*, void*);
 
+struct pk_backend_conn* pkm_be_conn_at(struct pk_manager*, int);
 struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager*,
                                           struct pk_tunnel*, char *);
 void pkm_free_be_conn(struct pk_backend_conn* pkb);
@@ -184,6 +324,7 @@ int pkm_reconnect_all               (struct pk_manager*, int);
 int pkm_disconnect_unused           (struct pk_manager*);
 
 void pkm_set_timer_enabled          (struct pk_manager*, int);
+void pkm_set_elastic_conns          (struct pk_manager*, int);
 void pkm_tick                       (struct pk_manager*);
 
 int pkmanager_test(void);
@@ -38,15 +38,37 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pd_sha1.h"
 #endif
 
+void pk_reset_kite_backend(struct pk_kite_backend* backend)
+{
+  backend->local_domain[0] = '\0';
+  backend->local_port = 0;
+  backend->weight = 1;
+  backend->local_addrlen = 0;
+  backend->local_addr_expires = 0;
+  backend->pool_size = 0;
+  backend->pool_taken = 0;
+  backend->active = 0;
+  backend->rr_current = 0;
+  backend->failures = 0;
+  backend->down_until = 0;
+}
+
 void pk_reset_pagekite(struct pk_pagekite* kite)
 {
+  int i;
   PK_ADD_MEMORY_CANARY(kite);
   kite->protocol[0] = '\0';
   kite->public_domain[0] = '\0';
   kite->public_port = 0;
-  kite->local_domain[0] = '\0';
-  kite->local_port = 0;
   kite->auth_secret[0] = '\0';
+  kite->check_pending = 0;
+  kite->breaker = PK_BREAKER_CLOSED;
+  kite->breaker_trips = 0;
+  kite->breaker_probe_at = 0;
+  kite->weight = 1;
+  kite->backend_count = 0;
+  for (i = 0; i < PK_KITE_BACKENDS_MAX; i++)
+    pk_reset_kite_backend(kite->backends + i);
 }
 
 void frame_reset_values(struct pk_frame* frame)
@@ -110,7 +132,8 @@ struct pk_parser* pk_parser_init(int buf_length, char* buf,
   parser_size += sizeof(struct pk_chunk);
   pk_chunk_reset(parser->chunk);
 
-  parser->chunk->frame.raw_frame = (char *) (buf + parser_size);
+  parser->buffer = (char *) (buf + parser_size);
+  parser->chunk->frame.raw_frame = parser->buffer;
 
   parser->chunk_callback = chunk_cb;
   parser->chunk_callback_data = chunk_cb_data;
@@ -122,12 +145,71 @@ struct pk_parser* pk_parser_init(int buf_length, char* buf,
 
 void pk_parser_reset(struct pk_parser *parser)
 {
+  struct pk_frame *frame = &(parser->chunk->frame);
   PK_ADD_MEMORY_CANARY(parser);
-  parser->buffer_bytes_left += parser->chunk->frame.raw_length;
-  frame_reset_values(&(parser->chunk->frame));
+  parser->buffer_bytes_left += (frame->raw_frame - parser->buffer);
+  parser->buffer_bytes_left += frame->raw_length;
+  frame->raw_frame = parser->buffer;
+  frame_reset_values(frame);
   pk_chunk_reset_values(parser->chunk);
 }
 
+/* Move a partial frame back to the start of the buffer, reclaiming the
+ * space of frames already consumed. Fragmented chunks always start at the
+ * beginning of the buffer, so only the frame header pointer needs fixing. */
+static void pk_parser_compact(struct pk_parser *parser)
+{
+  struct pk_frame *frame = &(parser->chunk->frame);
+  int consumed = frame->raw_frame - parser->buffer;
+
+  if ((consumed <= 0) || (parser->chunk->data != NULL)) return;
+
+  PK_TRACE_LOOP("compacting");
+  if (frame->raw_length > 0)
+    memmove(parser->buffer, frame->raw_frame, frame->raw_length);
+  frame->raw_frame = parser->buffer;
+  if (frame->data != NULL)
+    frame->data = frame->raw_frame + frame->hdr_length;
+  parser->buffer_bytes_left += consumed;
+}
+
+/* Inline number parsing, these run for every frame we receive. Like
+ * sscanf(), leading whitespace is skipped and trailing garbage ignored. */
+static int parse_hex(const char* p, ssize_t* value)
+{
+  ssize_t v = 0;
+  int digits = 0;
+  while ((*p == ' ') || (*p == '\t')) p++;
+  for (;; p++, digits++) {
+    if ((*p >= '0') && (*p <= '9')) v = (v << 4) | (*p - '0');
+    else if ((*p >= 'a') && (*p <= 'f')) v = (v << 4) | (*p - 'a' + 10);
+    else if ((*p >= 'A') && (*p <= 'F')) v = (v << 4) | (*p - 'A' + 10);
+    else break;
+  }
+  if (digits) *value = v;
+  return digits;
+}
+
+static int parse_dec(const char* p, ssize_t* value)
+{
+  ssize_t v = 0;
+  int digits = 0;
+  int negative = 0;
+  while ((*p == ' ') || (*p == '\t')) p++;
+  if ((*p == '-') || (*p == '+')) negative = (*p++ == '-');
+  for (; (*p >= '0') && (*p <= '9'); p++, digits++) v = (v * 10) + (*p - '0');
+  if (digits) *value = negative ? -v : v;
+  return digits;
+}
+
+static int parse_int(const char* p, int* value)
+{
+  ssize_t v;
+  if (!parse_dec(p, &v)) return 0;
+  *value = (int) v;
+  return 1;
+}
+
 int parse_frame_header(struct pk_frame* frame)
 {
   int hdr_len;
@@ -137,19 +219,8 @@ int parse_frame_header(struct pk_frame* frame)
   {
     frame->hdr_length = hdr_len;
     frame->data = frame->raw_frame + hdr_len;
-    if (sizeof(frame->length) == sizeof(long unsigned int)) {
-      if (1 != sscanf(frame->raw_frame,
-                      "%lx", (long unsigned int *) &(frame->length))) {
-        return (pk_error = ERR_PARSE_BAD_FRAME);
-      }
-    }
-    else {
-      assert(sizeof(frame->length) == sizeof(unsigned int));
-      if (1 != sscanf(frame->raw_frame,
-                      "%x", (unsigned int *) &(frame->length))) {
-        return (pk_error = ERR_PARSE_BAD_FRAME);
-      }
-    }
+    if (!parse_hex(frame->raw_frame, &(frame->length)))
+      return (pk_error = ERR_PARSE_BAD_FRAME);
   }
   return 0;
 }
@@ -157,72 +228,109 @@ int parse_frame_header(struct pk_frame* frame)
 int parse_chunk_header(struct pk_frame* frame, struct pk_chunk* chunk,
                        size_t bytes)
 {
-  int len, pos = 0;
-  char first;
+  int len, nlen, pos = 0;
+  char *line, *colon, *value;
   chunk->header_count = 0;
   while (2 < (len = zero_first_crlf(bytes - pos, frame->data + pos)))
   {
     PK_TRACE_LOOP("chunk-header-lines");
+    line = frame->data + pos;
+    value = NULL;
+    nlen = 0;
+    if ((NULL != (colon = memchr(line, ':', len - 2))) && (colon[1] == ' ')) {
+      nlen = colon - line;
+      value = colon + 2;
+    }
 
-    /* This gives us an upper-case (US-ASCII) of the first character. */
-    first = *(frame->data + pos) & (0xff - 32);
-
-    /* Cases ordered roughly by frequency, without too much obfuscation. */
-    if (first == 'S') {
-      if (0 == strncasecmp(frame->data + pos, "SID: ", 5))
-        chunk->sid = frame->data + pos + 5;
-      else if (0 == strncasecmp(frame->data + pos, "SKB: ", 5)) {
-        if (sizeof(chunk->remote_sent_kb) == sizeof(long int)) {
-          sscanf(frame->data + pos + 5,
-                 "%ld", (long int *) &(chunk->remote_sent_kb));
+    /* Dispatch on the length and first character of the header name, so
+     * each line costs at most one string comparison. */
+    #define _is(name) ((nlen == sizeof(name)-1) && \
+                       (0 == strncasecmp(line, name, sizeof(name)-1)))
+    switch ((value == NULL) ? 0 : nlen) {
+      case 3:
+        switch (*line & (0xff - 32)) {
+          case 'S':
+            if (_is("SID"))
+              chunk->sid = value;
+            else if (_is("SKB"))
+              parse_dec(value, &(chunk->remote_sent_kb));
+            else if (_is("SPD"))
+              parse_int(value, &(chunk->throttle_spd));
+            else
+              goto other;
+            break;
+          case 'E':
+            if (_is("EOF")) chunk->eof = value; else goto other;
+            break;
+          case 'R':
+            if (_is("RIP")) chunk->remote_ip = value; else goto other;
+            break;
+          default:
+            goto other;
         }
-        else {
-          assert(sizeof(chunk->remote_sent_kb) == sizeof(unsigned int));
-          sscanf(frame->data + pos + 5,
-                 "%d", (int *) &(chunk->remote_sent_kb));
+        break;
+      case 4:
+        switch (*line & (0xff - 32)) {
+          case 'N':
+            if (_is("NOOP")) chunk->noop = value; else goto other;
+            break;
+          case 'P':
+            if (_is("PING"))
+              chunk->ping = value;
+            else if (_is("Port"))
+              parse_int(value, &(chunk->request_port));
+            else
+              goto other;
+            break;
+          case 'H':
+            if (_is("Host")) chunk->request_host = value; else goto other;
+            break;
+          case 'R':
+            if (_is("RTLS")) chunk->remote_tls = value; else goto other;
+            break;
+          default:
+            goto other;
+        }
+        break;
+      case 5:
+        if (_is("Proto"))
+          chunk->request_proto = value;
+        else if (_is("RPort"))
+          parse_int(value, &(chunk->remote_port));
+        else if (_is("QDays")) {
+          if (parse_int(value, &(chunk->quota_days)))
+            pk_state.quota_days = chunk->quota_days;
+        }
+        else if (_is("Quota")) {
+          if (parse_int(value, &(chunk->quota_mb)))
+            pk_state.quota_mb = chunk->quota_mb;
+        }
+        else
+          goto other;
+        break;
+      case 6:
+        if (_is("QConns")) {
+          if (parse_int(value, &(chunk->quota_conns)))
+            pk_state.quota_conns = chunk->quota_conns;
+        }
+        else
+          goto other;
+        break;
+      default:
+      other:
+        switch (*line & (0xff - 32)) {
+          case 'S': case 'P': case 'R': case 'Q':
+            /* Unrecognized S/P/R/Q headers have always been ignored. */
+            break;
+          default:
+            if (chunk->header_count < PK_MAX_CHUNK_HEADERS) {
+              /* Just store pointers to any other headers, for later
+               * processing. */
+              chunk->headers[chunk->header_count++] = line;
+            }
         }
-      }
-      else if (0 == strncasecmp(frame->data + pos, "SPD: ", 5))
-        sscanf(frame->data + pos + 5, "%d", &(chunk->throttle_spd));
-    }
-    else if (0 == strncasecmp(frame->data + pos, "NOOP: ", 6))
-      chunk->noop = frame->data + pos + 6;
-    else if (first == 'P') {
-      if (0 == strncasecmp(frame->data + pos, "PING: ", 6))
-        chunk->ping = frame->data + pos + 6;
-      else if (0 == strncasecmp(frame->data + pos, "Proto: ", 7))
-        chunk->request_proto = frame->data + pos + 7;
-      else if (0 == strncasecmp(frame->data + pos, "Port: ", 6))
-        sscanf(frame->data + pos + 6, "%d", &(chunk->request_port));
-    }
-    else if (0 == strncasecmp(frame->data + pos, "EOF: ", 5))
-      chunk->eof = frame->data + pos + 5;
-    else if (first == 'R') {
-      if (0 == strncasecmp(frame->data + pos, "RIP: ", 5))
-        chunk->remote_ip = frame->data + pos + 5;
-      else if (0 == strncasecmp(frame->data + pos, "RPort: ", 7))
-        sscanf(frame->data + pos + 7, "%d", &(chunk->remote_port));
-      else if (0 == strncasecmp(frame->data + pos, "RTLS: ", 6))
-        chunk->remote_tls = frame->data + pos + 6;
-    }
-    else if (0 == strncasecmp(frame->data + pos, "Host: ", 6))
-      chunk->request_host = frame->data + pos + 6;
-    else if (first == 'Q') {
-      if (0 == strncasecmp(frame->data + pos, "QDays: ", 7)) {
-        if (1 == sscanf(frame->data + pos + 7, "%d", &(chunk->quota_days)))
-          pk_state.quota_days = chunk->quota_days;
-      } else if (0 == strncasecmp(frame->data + pos, "QConns: ", 8)) {
-        if (1 == sscanf(frame->data + pos + 8, "%d", &(chunk->quota_conns)))
-          pk_state.quota_conns = chunk->quota_conns;
-      } else if (0 == strncasecmp(frame->data + pos, "Quota: ", 7)) {
-        if (1 == sscanf(frame->data + pos + 7, "%d", &(chunk->quota_mb)))
-          pk_state.quota_mb = chunk->quota_mb;
-      }
-    }
-    else if (chunk->header_count < PK_MAX_CHUNK_HEADERS) {
-      /* Just store pointers to any other headers, for later processing. */
-      chunk->headers[chunk->header_count++] = frame->data + pos;
     }
+    #undef _is
 
     pos += len;
   }
@@ -241,62 +349,79 @@ int parse_chunk_header(struct pk_frame* frame, struct pk_chunk* chunk,
   }
 }
 
-int pk_parser_parse_new_data(struct pk_parser *parser, int length)
+/* Check whether a complete block of chunk headers (ending in a blank
+ * line) is available, without modifying the data. */
+static int chunk_headers_complete(int bytes, char* data)
+{
+  int i;
+  if ((bytes >= 2) && (data[0] == '\r') && (data[1] == '\n')) return 1;
+  for (i = 0; i < bytes-3; i++) {
+    if ((data[i] == '\r') && (data[i+1] == '\n') &&
+        (data[i+2] == '\r') && (data[i+3] == '\n'))
+      return 1;
+  }
+  return 0;
+}
+
+/* Process as many frames as the buffer allows.
+ *
+ * Chunks which fit in the buffer are delivered whole. Larger chunks are
+ * streamed: once their headers are in, every bit of payload that arrives
+ * is handed to the callback as a fragment and dropped, so the headers stay
+ * at the front of the buffer and frames of any size can be parsed. */
+static int pk_parser_process(struct pk_parser *parser)
 {
   int leftovers = 0;
-  int fragmenting = 0;
+  int capacity = 0;
   int wanted_length = 0;
   int parse_length = 0;
+  ssize_t available = 0;
   struct pk_chunk *chunk = parser->chunk;
   struct pk_frame *frame = &(parser->chunk->frame);
 
-  /* No data, nothing to do. */
-  if (length <= 0) return length;
-
-  /* Update counters. */
-  frame->raw_length += length;
-  parser->buffer_bytes_left -= length;
-
-  /* If we don't have enough data for useful work, finish here. */
-  if (frame->raw_length < 3) return length;
-
-  /* Do we have still need to parse the frame header? */
-  if (frame->length < 0) {
-    if (0 != parse_frame_header(frame))
-      return pk_error;
-  }
-  if (frame->length < 0) return length;
-
-  wanted_length = frame->length + frame->hdr_length;
-  parse_length = frame->length;
+  for (;;) {
+    PK_TRACE_LOOP("frames");
 
-  /* If the buffer is full, start fragmenting... */
-  if ((parser->buffer_bytes_left < 1) &&
-       (wanted_length > frame->raw_length)) {
-    fragmenting = 1;
-    parse_length = frame->raw_length - frame->hdr_length;
-    PK_TRACE_LOOP("fragmenting");
-  }
-
-  /* Do we have enough data? */
-  if (fragmenting ||
-      (parser->chunk->data != NULL) ||
-      (frame->raw_length >= wanted_length))
-  {
-    /* Only parse the chunk header once, if we're fragmenting. */
-    if (parser->chunk->data == NULL) {
-      if (ERR_PARSE_BAD_CHUNK == parse_chunk_header(frame, chunk, parse_length))
-        return (pk_error = ERR_PARSE_BAD_CHUNK);
+    /* Do we have still need to parse the frame header? */
+    if (frame->length < 0) {
+      /* If we don't have enough data for useful work, finish here. */
+      if (frame->raw_length < 3) break;
+      if (0 != parse_frame_header(frame))
+        return pk_error;
+      if (frame->length < 0) break;
     }
-    else {
-      if (chunk->offset + length > chunk->total) {
-        chunk->length = chunk->total - chunk->offset;
+
+    /* Do we still need to parse the chunk headers? */
+    if (chunk->data == NULL) {
+      wanted_length = frame->length + frame->hdr_length;
+      capacity = (frame->raw_frame - parser->buffer) +
+                 frame->raw_length + parser->buffer_bytes_left;
+      if (frame->raw_length >= wanted_length) {
+        parse_length = frame->length;
+      }
+      else if (wanted_length <= capacity) {
+        break;  /* It will fit, wait for the rest. */
       }
       else {
-        chunk->length = length;
+        /* Too big to fit: stream it, from the start of the buffer. */
+        PK_TRACE_LOOP("streaming");
+        pk_parser_compact(parser);
+        parse_length = frame->raw_length - frame->hdr_length;
+        if (!chunk_headers_complete(parse_length, frame->data)) {
+          if (parser->buffer_bytes_left < 1)
+            return (pk_error = ERR_PARSE_NO_MEMORY);
+          break;
+        }
       }
+      if (ERR_PARSE_BAD_CHUNK == parse_chunk_header(frame, chunk, parse_length))
+        return (pk_error = ERR_PARSE_BAD_CHUNK);
     }
-    chunk->offset += chunk->length;
+
+    /* Deliver whatever payload we have. */
+    available = frame->raw_length - (chunk->data - frame->raw_frame);
+    chunk->length = chunk->total - chunk->offset;
+    if (chunk->length > available) chunk->length = available;
+    if ((chunk->length < 1) && (chunk->offset < chunk->total)) break;
 
     if (parser->chunk_callback != (pkChunkCallback *) NULL) {
       char *eof = chunk->eof;
@@ -304,7 +429,8 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
       size_t length = chunk->length;
 
       PK_TRACE_LOOP("callback");
-      if (fragmenting) chunk->eof = NULL;  /* Suppress EOFs */
+      if (chunk->offset + chunk->length < chunk->total)
+        chunk->eof = NULL;  /* Suppress EOFs until the last fragment */
       parser->chunk_callback(parser->chunk_callback_data, chunk);
 
       /* Restore these, as they may have been modified in the callback and
@@ -314,31 +440,42 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
       chunk->length = length;
       chunk->first_chunk = 0;
     }
+    chunk->offset += chunk->length;
 
-    if (fragmenting || (chunk->offset < chunk->total)) {
-      PK_TRACE_LOOP("adjusting");
-      frame->length -= chunk->length;
+    if (chunk->offset < chunk->total) {
+      /* Fragment delivered: drop it, more data will land in its place. */
+      PK_TRACE_LOOP("fragment");
       frame->raw_length -= chunk->length;
       parser->buffer_bytes_left += chunk->length;
+      break;
     }
-    else {
-      leftovers = frame->raw_length - wanted_length;
-      if (leftovers > 0) {
-        PK_TRACE_LOOP("memmove");
-        memmove(frame->raw_frame,
-                frame->raw_frame + wanted_length,
-                leftovers);
-        pk_parser_reset(parser);
-        pk_parser_parse_new_data(parser, leftovers);
-      }
-      else {
-        PK_TRACE_LOOP("reset");
-        pk_parser_reset(parser);
-      }
-    }
+
+    /* Chunk complete: leave the frame where it is, the leftovers become
+     * the next one. */
+    PK_TRACE_LOOP("advancing");
+    leftovers = (frame->raw_frame + frame->raw_length) -
+                (chunk->data + chunk->length);
+    frame->raw_frame = chunk->data + chunk->length;
+    frame_reset_values(frame);
+    pk_chunk_reset_values(chunk);
+    frame->raw_length = leftovers;
   }
 
   PK_CHECK_MEMORY_CANARIES;
+  return 0;
+}
+
+int pk_parser_parse_new_data(struct pk_parser *parser, int length)
+{
+  /* No data, nothing to do. */
+  if (length <= 0) return length;
+
+  /* Update counters. */
+  parser->chunk->frame.raw_length += length;
+  parser->buffer_bytes_left -= length;
+
+  if (0 > pk_parser_process(parser))
+    return pk_error;
   return length;
 }
 
@@ -364,11 +501,8 @@ int pk_parser_parse(struct pk_parser *parser, int length, char *data)
     }
 
     memcpy(frame->raw_frame + frame->raw_length, data, copy);
-    status = pk_parser_parse_new_data(parser, copy);
-    if (status < 0) {
-      pk_parser_reset(parser);
-      return status;
-    }
+    status = pk_parser_parse_in_place(parser, copy);
+    if (status < 0) return status;
 
     parsed += status;
     length -= status;
@@ -379,17 +513,102 @@ int pk_parser_parse(struct pk_parser *parser, int length, char *data)
   return parsed;
 }
 
+/* Expose the free tail of the parser buffer, so data can be read straight
+ * into it; follow up with pk_parser_parse_in_place(). Returns NULL if the
+ * buffer is full. */
+char* pk_parser_buffer(struct pk_parser *parser, int *space)
+{
+  struct pk_frame *frame = &(parser->chunk->frame);
+  if (0 >= (*space = parser->buffer_bytes_left)) {
+    /* We will make no progress.  This is bad! */
+    return pk_err_null(ERR_PARSE_NO_MEMORY);
+  }
+  return frame->raw_frame + frame->raw_length;
+}
+
+int pk_parser_parse_in_place(struct pk_parser *parser, int length)
+{
+  int status = pk_parser_parse_new_data(parser, length);
+  if (status < 0) {
+    pk_parser_reset(parser);
+    return status;
+  }
+  pk_parser_compact(parser);
+  return status;
+}
+
 
 /**[ Serialization ]**********************************************************/
 
+/* Frame formatting runs for every data, EOF and SKB frame we send, so
+ * rather than sprintf() we assemble frames from parts, by hand. */
+
+struct pk_format_part {
+  const char* data;
+  size_t      length;
+};
+#define PK_PART(s)  {s, sizeof(s)-1}
+
+static size_t pk_format_hex(char* buf, size_t value)
+{
+  char tmp[sizeof(size_t) * 2];
+  size_t i = 0, n = 0;
+  do {
+    tmp[i++] = "0123456789abcdef"[value & 0xf];
+    value >>= 4;
+  } while (value);
+  while (i) buf[n++] = tmp[--i];
+  return n;
+}
+
+static size_t pk_format_dec(char* buf, ssize_t value)
+{
+  char tmp[sizeof(ssize_t) * 3];
+  size_t i = 0, n = 0;
+  size_t v = (value < 0) ? -((size_t) value) : (size_t) value;
+  do {
+    tmp[i++] = '0' + (v % 10);
+    v /= 10;
+  } while (v);
+  if (value < 0) buf[n++] = '-';
+  while (i) buf[n++] = tmp[--i];
+  return n;
+}
+
+/* Write the frame length, followed by the header parts. The payload (if
+ * any) is the caller's business. */
+static size_t pk_format_parts(char* buf, size_t bytes,
+                              struct pk_format_part* parts, int count)
+{
+  size_t n;
+  int i;
+  for (i = 0; i < count; i++) bytes += parts[i].length;
+  n = pk_format_hex(buf, bytes);
+  buf[n++] = '\r';
+  buf[n++] = '\n';
+  for (i = 0; i < count; i++) {
+    memcpy(buf + n, parts[i].data, parts[i].length);
+    n += parts[i].length;
+  }
+  buf[n] = '\0';
+  return n;
+}
+
 size_t pk_format_frame(char* buf, const char* sid,
                        const char *headers, size_t bytes)
 {
-  size_t hlen;
+  /* The headers template contains a single %s, which is the SID. */
+  const char* sp = strstr(headers, "%s");
+  struct pk_format_part parts[3];
   if (!sid) sid = "";
-  hlen = strlen(sid) + strlen(headers) - 2;
-  hlen = sprintf(buf, "%zx\r\n", hlen + bytes);
-  return hlen + sprintf(buf + hlen, headers, sid);
+  if (sp == NULL) sp = headers + strlen(headers);
+  parts[0].data = headers;
+  parts[0].length = sp - headers;
+  parts[1].data = sid;
+  parts[1].length = (*sp) ? strlen(sid) : 0;
+  parts[2].data = (*sp) ? sp + 2 : sp;
+  parts[2].length = strlen(parts[2].data);
+  return pk_format_parts(buf, bytes, parts, 3);
 }
 
 size_t pk_reply_overhead(const char *sid, size_t bytes)
@@ -405,11 +624,45 @@ size_t pk_reply_overhead(const char *sid, size_t bytes)
   return hexlen + 2 + chunkhdr; /* %x\r\n... */
 }
 
+size_t pk_format_sid_header(char* buf, const char* sid)
+{
+  size_t n = strlen(sid);
+  memcpy(buf, "SID: ", 5);
+  memcpy(buf + 5, sid, n);
+  memcpy(buf + 5 + n, "\r\n", 3);
+  return n + 7;
+}
+
+size_t pk_format_reply_header(char* buf, const char* sid_header,
+                              size_t sid_header_length, size_t bytes)
+{
+  struct pk_format_part parts[2] = {{sid_header, sid_header_length},
+                                    PK_PART("\r\n")};
+  return pk_format_parts(buf, bytes, parts, 2);
+}
+
+/* As above, but also report delivery progress for this stream, which
+ * saves sending a separate SKB frame. */
+size_t pk_format_reply_header_skb(char* buf, const char* sid_header,
+                                  size_t sid_header_length, ssize_t kilobytes,
+                                  size_t bytes)
+{
+  char kb[24];
+  struct pk_format_part parts[4] = {{sid_header, sid_header_length},
+                                    PK_PART("SKB: "),
+                                    {kb, pk_format_dec(kb, kilobytes)},
+                                    PK_PART("\r\n\r\n")};
+  return pk_format_parts(buf, bytes, parts, 4);
+}
+
 size_t pk_format_reply(char* buf, const char* sid,
                        size_t bytes, const char* input)
 {
   size_t hlen;
-  hlen = pk_format_frame(buf, sid, "SID: %s\r\n\r\n", bytes);
+  struct pk_format_part parts[3] = {PK_PART("SID: "),
+                                    {sid, strlen(sid)},
+                                    PK_PART("\r\n\r\n")};
+  hlen = pk_format_parts(buf, bytes, parts, 3);
   if (NULL != input) {
     memcpy(buf + hlen, input, bytes);
     return hlen + bytes;
@@ -420,24 +673,35 @@ size_t pk_format_reply(char* buf, const char* sid,
 
 ssize_t pk_format_chunk(char* buf, size_t maxbytes, struct pk_chunk* chunk)
 {
+  char headers[PK_FORMAT_CHUNK_HEADERS_MAX];
   size_t bytes = 0;
   size_t hlen = pk_reply_overhead(chunk->sid, maxbytes);
-  char* tbuf = malloc(maxbytes - hlen);
-  if (tbuf == NULL) return (pk_error = ERR_PARSE_NO_MEMORY);
 
-  #define free_and_return(rv) { free(tbuf); return rv; }
+  /* Headers are gathered on the stack, as the frame length has to be known
+   * before they can be written to the destination. */
+  #define _room(h, v) ((hlen + bytes + sizeof(h) + (v) + 4 <= maxbytes) && \
+                       (bytes + sizeof(h) + (v) + 4 <= sizeof(headers)))
+  #define _add_hdr(h) { memcpy(headers + bytes, h ": ", sizeof(h) + 1); \
+                        bytes += sizeof(h) + 1; }
   #define _add_str(h, v) if (v != NULL) { \
-                  if (hlen + bytes + strlen(h) + strlen(v) + 5 <= maxbytes) { \
-                    bytes += sprintf(tbuf + bytes, "%s: %s\r\n", h, v); \
-                  } else free_and_return(pk_error = ERR_PARSE_NO_MEMORY); }
+                  size_t l = strlen(v); \
+                  if (_room(h, l)) { \
+                    _add_hdr(h); \
+                    memcpy(headers + bytes, v, l); \
+                    bytes += l; \
+                    headers[bytes++] = '\r'; \
+                    headers[bytes++] = '\n'; \
+                  } else return (pk_error = ERR_PARSE_NO_MEMORY); }
   #define _add_int(h, v) if (v >= 0) { \
-                  if (hlen + bytes + strlen(h) + 10 + 5 <= maxbytes) { \
-                    bytes += sprintf(tbuf + bytes, "%s: %d\r\n", h, v); \
-                  } else free_and_return(pk_error = ERR_PARSE_NO_MEMORY); }
-  #define _add_sst(h, v) if (v >= 0) { \
-                  if (hlen + bytes + strlen(h) + 10 + 5 <= maxbytes) { \
-                    bytes += sprintf(tbuf + bytes, "%s: %zd\r\n", h, v); \
-                  } else free_and_return(pk_error = ERR_PARSE_NO_MEMORY); }
+                  char n[sizeof(ssize_t) * 3 + 2]; \
+                  size_t l = pk_format_dec(n, v); \
+                  if (_room(h, l)) { \
+                    _add_hdr(h); \
+                    memcpy(headers + bytes, n, l); \
+                    bytes += l; \
+                    headers[bytes++] = '\r'; \
+                    headers[bytes++] = '\n'; \
+                  } else return (pk_error = ERR_PARSE_NO_MEMORY); }
 
   _add_str("EOF",    chunk->eof);
   _add_str("NOOP",   chunk->noop);
@@ -448,70 +712,81 @@ ssize_t pk_format_chunk(char* buf, size_t maxbytes, struct pk_chunk* chunk)
   _add_str("RIP",    chunk->remote_ip);
   _add_int("RPort",  chunk->remote_port);
   _add_str("RTLS",   chunk->remote_tls);
-  _add_sst("SKB",    chunk->remote_sent_kb);
+  _add_int("SKB",    chunk->remote_sent_kb);
   _add_int("QDays",  chunk->quota_days);
   _add_int("QConns", chunk->quota_conns);
   _add_int("Quota",  chunk->quota_mb);
 
-  bytes += sprintf(tbuf + bytes, "\r\n");
+  headers[bytes++] = '\r';
+  headers[bytes++] = '\n';
 
   if (chunk->length > 0) {
     if (hlen + chunk->length + bytes - 2 > maxbytes) {
-      free_and_return(pk_error = ERR_PARSE_NO_MEMORY);
+      return (pk_error = ERR_PARSE_NO_MEMORY);
     }
-    memcpy(tbuf + bytes, chunk->data, chunk->length);
-    bytes += chunk->length;
   }
 
-  hlen = pk_format_frame(buf, chunk->sid, "SID: %s\r\n", bytes);
-  memcpy(buf + hlen, tbuf, bytes);
-
-  free_and_return(hlen + bytes);
+  {
+    struct pk_format_part parts[4] = {PK_PART("SID: "),
+                                      {chunk->sid, strlen(chunk->sid)},
+                                      PK_PART("\r\n"),
+                                      {headers, bytes}};
+    hlen = pk_format_parts(buf, (chunk->length > 0) ? chunk->length : 0,
+                           parts, 4);
+  }
+  if (chunk->length > 0) {
+    memcpy(buf + hlen, chunk->data, chunk->length);
+    hlen += chunk->length;
+  }
+  return hlen;
 }
 
 size_t pk_format_eof(char* buf, const char* sid, int how)
 {
-  char format[64];
-  sprintf(format, "SID: %%s\r\nEOF: 1%s%s\r\n\r\n",
-                  (how & PK_EOF_READ) ? "R" : "",
-                  (how & PK_EOF_WRITE) ? "W" : "");
-  return pk_format_frame(buf, sid, format, 0);
+  struct pk_format_part parts[6] = {PK_PART("SID: "),
+                                    {sid, strlen(sid)},
+                                    PK_PART("\r\nEOF: 1"),
+                                    {"R", (how & PK_EOF_READ) ? 1 : 0},
+                                    {"W", (how & PK_EOF_WRITE) ? 1 : 0},
+                                    PK_PART("\r\n\r\n")};
+  return pk_format_parts(buf, 0, parts, 6);
 }
 
-size_t pk_format_skb(char* buf, const char* sid, int kilobytes)
+size_t pk_format_skb(char* buf, const char* sid, ssize_t kilobytes)
 {
-  char format[64];
-  sprintf(format, "NOOP: 1\r\nSID: %%s\r\nSKB: %d\r\n\r\n", kilobytes);
-  return pk_format_frame(buf, sid, format, 0);
+  char kb[24];
+  struct pk_format_part parts[5] = {PK_PART("NOOP: 1\r\nSID: "),
+                                    {sid, strlen(sid)},
+                                    PK_PART("\r\nSKB: "),
+                                    {kb, pk_format_dec(kb, kilobytes)},
+                                    PK_PART("\r\n\r\n")};
+  return pk_format_parts(buf, 0, parts, 5);
 }
 
 size_t pk_format_pong(char* buf)
 {
-  return pk_format_frame(buf, "", "NOOP: 1%s\r\n\r\n", 0);
+  struct pk_format_part parts[1] = {PK_PART("NOOP: 1\r\n\r\n")};
+  return pk_format_parts(buf, 0, parts, 1);
 }
 
 size_t pk_format_ping(char* buf)
 {
-  return pk_format_frame(buf, "", "NOOP: 1%s\r\nPING: 1\r\n\r\n", 0);
+  struct pk_format_part parts[1] = {PK_PART("NOOP: 1\r\nPING: 1\r\n\r\n")};
+  return pk_format_parts(buf, 0, parts, 1);
 }
 
 size_t pk_format_http_rejection(
   char* buf,
   int frontend_sockfd,
-  const char* default_fancy_url,
+  const char* fancy_url,
   const char* request_proto,
   const char* request_host)
 {
   char pre[PK_REJECT_MAXSIZE];
   char relay_ip[128];
-  char* fancy_url = NULL;
   char* post = NULL;
 
-  if (default_fancy_url && *default_fancy_url) {
-    struct pke_event* ev = pke_post_blocking_event(NULL,
-      PK_EV_CFG_FANCY_URL, 0, request_host, NULL, &fancy_url);
-    if (NULL == fancy_url) fancy_url = (char*) default_fancy_url;
-
+  if (fancy_url && *fancy_url) {
     relay_ip[0] = '\0';
     if (frontend_sockfd != PK_REJECT_BACKEND) {
       struct sockaddr_in sin;
@@ -526,9 +801,6 @@ size_t pk_format_http_rejection(
                  pk_state.app_id_short,
                  request_proto, request_host, relay_ip);
     post = PK_REJECT_FANCY_POST;
-
-    if (ev) pke_free_event(NULL, ev->event_code);
-    if (fancy_url != default_fancy_url) free(fancy_url);
   }
   else {
     pre[0] = '\0';
@@ -904,6 +1176,9 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
   char buffer[16*1024], *p;
   struct pk_pagekite tkite;
   struct pk_kite_request tkite_r;
+#ifdef TCP_NOTSENT_LOWAT
+  int lowat = 2 * CONN_IO_BUFFER_SIZE;
+#endif
 
   PK_TRACE_FUNCTION;
 
@@ -920,6 +1195,14 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
 
   set_blocking(pkc->sockfd);
 
+#ifdef TCP_NOTSENT_LOWAT
+  /* Keep the kernel's backlog of unsent data short, so the order in which
+   * streams share the tunnel is decided by our scheduler, not by whoever
+   * happened to fill the socket buffer first. */
+  setsockopt(pkc->sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+             (char *) &lowat, sizeof(lowat));
+#endif
+
 #ifdef HAVE_OPENSSL
   if ((ctx != NULL) &&
       (0 != pkc_start_ssl(pkc, ctx, hostname)))
@@ -1154,6 +1437,7 @@ static int pkproto_test_format_chunk(void)
 {
   struct pk_chunk chunk;
   char dest[1024];
+  char* big;
 
   pk_chunk_reset_values(&chunk);
   chunk.sid = "1234";
@@ -1169,6 +1453,19 @@ static int pkproto_test_format_chunk(void)
   assert(bytes == pk_format_chunk(dest, bytes, &chunk));
 
   assert(0 == strncmp(expect, dest, bytes));
+
+  /* Long numbers must fit the header buffer, not just most of them */
+  assert(NULL != (big = malloc(4 * PK_FORMAT_CHUNK_HEADERS_MAX)));
+  chunk.eof = big;
+  memset(chunk.eof, 'x', PK_FORMAT_CHUNK_HEADERS_MAX - 30);
+  chunk.eof[PK_FORMAT_CHUNK_HEADERS_MAX - 30] = '\0';
+  chunk.remote_sent_kb = SSIZE_MAX;
+  chunk.quota_mb = -1;
+  chunk.length = 0;
+  assert(ERR_PARSE_NO_MEMORY == pk_format_chunk(big + 1024, 2000, &chunk));
+  chunk.remote_sent_kb = 1;
+  assert(0 < pk_format_chunk(big + 1024, 2000, &chunk));
+  free(big);
   return 1;
 }
 
@@ -1192,6 +1489,143 @@ static int pkproto_test_format_pong(void)
   return 1;
 }
 
+static int pkproto_test_format_skb(void)
+{
+  char dest[1024];
+  char* expect = "22\r\nNOOP: 1\r\nSID: 12345\r\nSKB: 1024\r\n\r\n";
+  size_t bytes = strlen(expect);
+  assert(bytes == pk_format_skb(dest, "12345", 1024));
+  assert(0 == strncmp(expect, dest, bytes));
+  assert(24 == pk_format_ping(dest));
+  assert(0 == strcmp(dest, "14\r\nNOOP: 1\r\nPING: 1\r\n\r\n"));
+  return 1;
+}
+
+static int pkproto_test_format_reply_header(void)
+{
+  char sid_header[BE_MAX_SID_SIZE+8];
+  char dest[1024], big[64];
+  char* expect = "400e\r\nSID: 12345\r\n\r\n";
+  size_t hlen, bytes = strlen(expect);
+
+  hlen = pk_format_sid_header(sid_header, "12345");
+  assert(hlen == strlen(sid_header));
+  assert(0 == strcmp(sid_header, "SID: 12345\r\n"));
+  assert(bytes == pk_format_reply_header(dest, sid_header, hlen, 16384));
+  assert(bytes == pk_reply_overhead("12345", 16384));
+  assert(0 == strcmp(expect, dest));
+
+  expect = "4019\r\nSID: 12345\r\nSKB: 1024\r\n\r\n";
+  bytes = strlen(expect);
+  assert(bytes == pk_format_reply_header_skb(dest, sid_header, hlen,
+                                             1024, 16384));
+  assert(0 == strcmp(expect, dest));
+  pk_format_reply_header_skb(dest, sid_header, hlen, SSIZE_MAX, 0);
+  sprintf(big, "SKB: %zd\r\n", (ssize_t) SSIZE_MAX);
+  assert(NULL != strstr(dest, big));
+  return 1;
+}
+
+static int pkproto_test_format_timing(void)
+{
+  char sid_header[BE_MAX_SID_SIZE+8];
+  char dest[1024];
+  struct timespec t0, t1;
+  size_t hlen, bytes = 0;
+  int i;
+
+  /* Not a correctness test: report how fast we can format frames. */
+  hlen = pk_format_sid_header(sid_header, "12345");
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+  for (i = 0; i < 1000000; i++) {
+    bytes += pk_format_reply_header(dest, sid_header, hlen, i & 0x3fff);
+    bytes += pk_format_skb(dest, "12345", i);
+    bytes += pk_format_eof(dest, "12345", PK_EOF);
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+  long ns = ((t1.tv_sec - t0.tv_sec) * (long)1e9) + (t1.tv_nsec - t0.tv_nsec);
+  fprintf(stderr,
+    "pk_format: TIMING DATA  %ld ns for 3M frames, Mframes/s=%.3f (%zd)\n",
+    ns, 3 * (float)1e9 / ns, bytes);
+  return 1;
+}
+
+static int pkproto_test_parse_headers(void)
+{
+  struct pk_frame frame;
+  struct pk_chunk chunk;
+  char data[512];
+
+  strcpy(data, "7a\r\n"
+               "SID: abc\r\n"
+               "SKB: 1234\r\n"
+               "SPD: 12\r\n"
+               "Port: 80\r\n"
+               "RPort: 1024\r\n"
+               "Host: example.com\r\n"
+               "RTLS: 1\r\n"
+               "QConns: 9\r\n"
+               "X-Other: yes\r\n"
+               "Server: ignored\r\n"
+               "sid:nospace\r\n"
+               "\r\n"
+               "Hello");
+  frame_reset_values(&frame);
+  pk_chunk_reset_values(&chunk);
+  frame.raw_frame = data;
+  frame.raw_length = strlen(data);
+  assert(0 == parse_frame_header(&frame));
+  assert(0x7a == frame.length);
+  assert(0 < parse_chunk_header(&frame, &chunk, frame.raw_length - 4));
+  assert(0 == strcmp(chunk.sid, "abc"));
+  assert(1234 == chunk.remote_sent_kb);
+  assert(12 == chunk.throttle_spd);
+  assert(80 == chunk.request_port);
+  assert(1024 == chunk.remote_port);
+  assert(0 == strcmp(chunk.request_host, "example.com"));
+  assert(0 == strcmp(chunk.remote_tls, "1"));
+  assert(9 == chunk.quota_conns);
+  assert(1 == chunk.header_count);
+  assert(0 == strcmp(chunk.headers[0], "X-Other: yes"));
+  assert(5 == chunk.length);
+  assert(0 == strncmp(chunk.data, "Hello", 5));
+
+  strcpy(data, "zz\r\n");
+  frame_reset_values(&frame);
+  frame.raw_frame = data;
+  frame.raw_length = strlen(data);
+  assert(ERR_PARSE_BAD_FRAME == parse_frame_header(&frame));
+  return 1;
+}
+
+static int pkproto_test_parse_timing(void)
+{
+  char buffer[PARSER_BYTES_AVG];
+  char stream[4096];
+  struct pk_parser* p;
+  struct timespec t0, t1;
+  int i, frames, bytes;
+
+  /* Not a correctness test: report how fast we can parse small frames, as
+   * seen in interactive traffic (short data chunks and SKB acks). */
+  p = pk_parser_init(sizeof(buffer), buffer, NULL, NULL);
+  for (frames = bytes = 0; bytes < (int) sizeof(stream) - 100; frames += 2) {
+    bytes += pk_format_reply(stream + bytes, "a1b2", 40,
+                             "0123456789012345678901234567890123456789");
+    bytes += pk_format_skb(stream + bytes, "a1b2", frames);
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+  for (i = 0; i < 10000; i++) {
+    assert(bytes == pk_parser_parse(p, bytes, stream));
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+  long ns = ((t1.tv_sec - t0.tv_sec) * (long)1e9) + (t1.tv_nsec - t0.tv_nsec);
+  fprintf(stderr,
+    "pk_parser: TIMING DATA  %ld ns for %dk frames, Mframes/s=%.3f\n",
+    ns, frames * 10, (float)frames * 10000 * 1000 / ns);
+  return 1;
+}
+
 static void pkproto_test_callback(int *data, struct pk_chunk *chunk) {
   assert(chunk->sid != NULL);
   assert(chunk->noop != NULL);
@@ -1233,7 +1667,8 @@ static int pkproto_test_parser(struct pk_parser* p, int *callback_called)
                      "\r\n"
                      "54321");
   char buffer[1024], framehead[10];
-  int length;
+  char* dest;
+  int length, space, calls, pos, hlen, j, k;
   int bytes_left = p->buffer_bytes_left;
 
   assert(pk_parser_parse(p, 8, "z\r\n12345") == ERR_PARSE_BAD_FRAME);
@@ -1276,9 +1711,51 @@ static int pkproto_test_parser(struct pk_parser* p, int *callback_called)
   memcpy(frame+hl, "GET / HTTP/1.1\r\nHost: foo.bar.baz\r\n\r\n", 38);
 
   pk_parser_reset(p);
-  pk_parser_parse(p, cs, frame);
+  calls = *callback_called;
+  assert(pk_parser_parse(p, cs, frame) == cs);
+  assert(*callback_called > calls + 1);
+  assert(p->buffer_bytes_left == bytes_left);
   free(frame);
 
+  /* Frames far larger than the buffer are streamed, a few bytes at a time,
+   * and the parser picks up the following frame afterwards. */
+  cl = 256 * 1024;
+  ch = sprintf(framehead, "%x\r\n", cl);
+  calls = *callback_called;
+  hlen = strlen(testchunk) - 5;
+  for (pos = 0; pos < ch + cl + length; pos += j) {
+    dest = pk_parser_buffer(p, &space);
+    assert(dest != NULL);
+    for (j = 0; (j < space) && (j < 1000) && (pos+j < ch + cl + length); j++) {
+      k = pos + j;
+      if (k < ch) dest[j] = framehead[k];
+      else if (k < ch + hlen) dest[j] = testchunk[k-ch];
+      else if (k < ch + cl) dest[j] = 'a';
+      else dest[j] = buffer[k-ch-cl];
+    }
+    assert(pk_parser_parse_in_place(p, j) == j);
+  }
+  assert(*callback_called > calls + (cl / bytes_left));
+  assert(p->buffer_bytes_left == bytes_left);
+
+  /* Reading into the parser's own buffer works the same way; complete
+   * frames are consumed in place and the partial one moved to the front. */
+  pk_parser_reset(p);
+  calls = *callback_called;
+  dest = pk_parser_buffer(p, &space);
+  assert(space == bytes_left);
+  memcpy(dest, buffer, 2*length-10);
+  assert(pk_parser_parse_in_place(p, 2*length-10) == 2*length-10);
+  assert(*callback_called == calls + 1);
+  assert(p->chunk->frame.raw_frame == p->buffer);
+  assert(p->buffer_bytes_left == bytes_left - (length-10));
+  dest = pk_parser_buffer(p, &space);
+  assert(dest == p->buffer + length-10);
+  memcpy(dest, buffer+2*length-10, 10);
+  assert(pk_parser_parse_in_place(p, 10) == 10);
+  assert(*callback_called == calls + 2);
+  assert(p->buffer_bytes_left == bytes_left);
+
   return 1;
 }
 
@@ -1371,8 +1848,13 @@ int pkproto_test(void)
           pkproto_test_format_chunk() &&
           pkproto_test_format_eof() &&
           pkproto_test_format_pong() &&
+          pkproto_test_format_skb() &&
+          pkproto_test_format_reply_header() &&
+          pkproto_test_format_timing() &&
           pkproto_test_alloc(PARSER_BYTES_MIN, buffer, p) &&
           pkproto_test_parser(p, &callback_called) &&
+          pkproto_test_parse_headers() &&
+          pkproto_test_parse_timing() &&
           pkproto_test_make_bsalt() &&
           pkproto_test_sign_kite_request() &&
           pkproto_test_parse_kite_request());
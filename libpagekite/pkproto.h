@@ -79,14 +79,46 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_PROTOCOL_LENGTH   24
 #define PK_DOMAIN_LENGTH   1024
 #define PK_SECRET_LENGTH    256
+#define PK_BACKEND_POOL_MAX  16
+#define PK_BACKEND_UNIX     "unix:"  /* Prefix for Unix socket backends */
+#define PK_KITE_BACKENDS_MAX  8
+struct pk_kite_backend {
+  char  local_domain[PK_DOMAIN_LENGTH+1];
+  int   local_port;
+  int   weight;
+  /* Cached backend address, maintained by pkm_resolve_backend. An
+   * addrlen of zero means the lookup failed (or never happened). */
+  struct sockaddr_storage local_addr;
+  socklen_t             local_addrlen;
+  time_t64              local_addr_expires;
+  /* Idle, pre-connected backend sockets (newest last); these are only
+   * used if the manager's be_pool_max is nonzero. */
+  int                   pool_size;
+  int                   pool_taken;     /* Handed out since last refill */
+  int                   pool_fds[PK_BACKEND_POOL_MAX];
+  time_t64              pool_since[PK_BACKEND_POOL_MAX];
+  unsigned int          pool_gen[PK_BACKEND_POOL_MAX];
+  unsigned int          pool_next_gen;  /* Bumped whenever a slot fills */
+  /* Load balancing and passive health checks, see pkm_choose_backend */
+  int                   active;         /* Streams currently connected */
+  int                   rr_current;     /* Smooth weighted round robin */
+  int                   failures;       /* Connection failures in a row */
+  time_t64              down_until;     /* Skipped until then if failing */
+};
 struct  pk_pagekite {
   PK_MEMORY_CANARY
   char  protocol[PK_PROTOCOL_LENGTH+1];
   char  public_domain[PK_DOMAIN_LENGTH+1];
   int   public_port;
-  char  local_domain[PK_DOMAIN_LENGTH+1];
-  int   local_port;
   char  auth_secret[PK_SECRET_LENGTH+1];
+  int   check_pending;                  /* PK_CHECK_BACKENDS requested */
+  int   breaker;                        /* PK_BREAKER_*, when all fail */
+  int   breaker_trips;                  /* Times the breaker has opened */
+  time_t64 breaker_probe_at;            /* Last stream let through */
+  int   weight;                         /* Share of busy tunnels */
+  int   backend_count;
+  struct pk_kite_backend backends[PK_KITE_BACKENDS_MAX];
+  struct pk_pagekite* next_free;        /* Unused slots, see pkm_add_kite */
 };
 
 /* Data structure describing a kite request */
@@ -118,6 +150,7 @@ struct pk_frame {
 
 /* Data structure describing a parsed chunk */
 #define PK_MAX_CHUNK_HEADERS 64
+#define PK_FORMAT_CHUNK_HEADERS_MAX 1024  /* See pk_format_chunk() */
 struct pk_chunk {
   PK_MEMORY_CANARY
   int             header_count;    /* Raw header data, number of headers.    */
@@ -148,9 +181,15 @@ struct pk_chunk {
 /* Callback for when a chunk is ready. */
 typedef void(pkChunkCallback)(void *, struct pk_chunk *);
 
-/* Parser object. */
+/* Parser object.
+ *
+ * Frames are consumed in place: the raw frame advances through the buffer
+ * as complete frames are handed to the callback, and only the trailing
+ * partial frame is moved back to the start, at most once per read. Readers
+ * can fill the free tail directly, see pk_parser_buffer(). */
 struct pk_parser {
   PK_MEMORY_CANARY
+  char*            buffer;         /* Start of raw frame space */
   int              buffer_bytes_left;
   struct pk_chunk* chunk;
   pkChunkCallback* chunk_callback;
@@ -163,17 +202,24 @@ struct pk_backend_conn;
 struct pk_parser* pk_parser_init (int, char*,
                                   pkChunkCallback*, void *);
 int               pk_parser_parse(struct pk_parser*, int, char*);
+char*             pk_parser_buffer(struct pk_parser*, int*);
+int               pk_parser_parse_in_place(struct pk_parser*, int);
 void              pk_parser_reset(struct pk_parser*);
 void              pk_chunk_reset(struct pk_chunk*);
 void              pk_chunk_reset_values(struct pk_chunk*);
 
+void              pk_reset_kite_backend(struct pk_kite_backend* backend);
 void              pk_reset_pagekite(struct pk_pagekite* kite);
 
 size_t            pk_format_frame(char*, const char*, const char *, size_t);
 size_t            pk_reply_overhead(const char *sid, size_t);
 size_t            pk_format_reply(char*, const char*, size_t, const char*);
+size_t            pk_format_sid_header(char*, const char*);
+size_t            pk_format_reply_header(char*, const char*, size_t, size_t);
+size_t            pk_format_reply_header_skb(char*, const char*, size_t,
+                                             ssize_t, size_t);
 ssize_t           pk_format_chunk(char*, size_t, struct pk_chunk*);
-size_t            pk_format_skb(char*, const char*, int);
+size_t            pk_format_skb(char*, const char*, ssize_t);
 size_t            pk_format_eof(char*, const char*, int);
 size_t            pk_format_pong(char*);
 size_t            pk_format_ping(char*);
@@ -61,11 +61,25 @@ struct pk_global_state {
   unsigned int    live_streams;
   unsigned int    live_tunnels;
   unsigned int    live_listeners;
+  unsigned int    backend_breaker_trips;
   unsigned int    have_ssl:1;
   unsigned int    force_update:1;
   char*           app_id_short;
   char*           app_id_long;
 
+  /* Conn I/O buffer pool occupancy (guarded by the pool's own lock) */
+  unsigned int    buffers_in_use;
+  unsigned int    buffers_idle;
+  size_t          buffer_bytes_in_use;
+  size_t          buffer_bytes_idle;
+
+  /* Control frames which had to wait for queued data, and how long the
+   * oldest waited each time the lane drained (ms). Event loop only. */
+  unsigned int    ctl_frames_queued;
+  unsigned int    ctl_queue_drains;
+  time_t64        ctl_queue_ms_total;
+  time_t64        ctl_queue_ms_max;
+
   /* Quota state (assuming frontends agree) */
   int             quota_days;
   int             quota_conns;
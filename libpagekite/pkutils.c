@@ -136,14 +136,17 @@ int zero_first_eol(int length, char* data)
 
 int zero_first_crlf(int length, char* data)
 {
-  int i;
-  for (i = 0; i < length-1; i++)
+  /* memchr() is usually vectorized, so let it do the scanning. */
+  char* p = data;
+  char* end = data + length - 1;
+  while ((p < end) && (NULL != (p = memchr(p, '\r', end - p))))
   {
-    if ((data[i] == '\r') && (data[i+1] == '\n'))
+    if (p[1] == '\n')
     {
-      data[i] = data[i+1] = '\0';
-      return i+2;
+      p[0] = p[1] = '\0';
+      return (p - data) + 2;
     }
+    p++;
   }
   return 0;
 }
@@ -358,6 +361,13 @@ time_t64 pk_time()
   return time(0);
 }
 
+time_t64 pk_time_ms()
+{
+  struct timespec tp;
+  pk_gettime(&tp);
+  return ((time_t64) tp.tv_sec * 1000) + (tp.tv_nsec / 1000000);
+}
+
 int wait_fd(int fd, int timeout_ms)
 {
 #ifdef HAVE_POLL
@@ -61,6 +61,7 @@ int set_non_blocking(int);
 int set_blocking(int);
 void sleep_ms(int);
 time_t64 pk_time();
+time_t64 pk_time_ms();
 void pk_gettime(struct timespec*);
 void pk_pthread_condattr_setclock(pthread_condattr_t*);
 int wait_fd(int, int);
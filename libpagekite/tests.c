@@ -42,6 +42,7 @@ struct pk_global_state pk_state;
 int utils_test();
 int pke_events_test();
 int pkproto_test();
+int pkconn_test();
 int pkmanager_test();
 
 int main(void) {
@@ -62,6 +63,7 @@ int main(void) {
   assert(utils_test());      fprintf(stderr, "utils test passed\n");
   assert(pke_events_test()); fprintf(stderr, "events test passed\n");
   assert(pkproto_test());    fprintf(stderr, "pkproto test passed\n");
+  assert(pkconn_test());     fprintf(stderr, "pkconn test passed\n");
   assert(pkmanager_test());  fprintf(stderr, "pkmanager test passed\n");
 # if HAVE_RELAY
   assert(pkrelay_test());    fprintf(stderr, "pkrelay test passed\n");
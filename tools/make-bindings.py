@@ -497,7 +497,8 @@ def get_constants(pagekite_h):
             if line.startswith('#define '):
                 define, varname, value = line.split(' ', 2)
                 if varname[:6] in ('PK_WIT', 'PK_AS_', 'PK_STA',
-                                   'PK_LOG', 'PK_VER', 'PK_EV_'):
+                                   'PK_LOG', 'PK_VER', 'PK_EV_', 'PK_BAL',
+                                   'PK_BRE', 'PK_FLO'):
                     if varname == lastvarname:
                         constants[-1] = (varname, value.strip())
                     else: